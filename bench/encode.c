@@ -0,0 +1,206 @@
+/*
+ * tinysvcmdns - a tiny MDNS implementation for publishing services
+ * Copyright (C) 2011 Darell Tan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// times mdns_encode_pkt() on DNS-SD replies, with records encoded field by
+// field and from their wire form built by rr_wire_build(), and checks both
+// give the same bytes. As in the responder, the reply lists are filled from
+// an arena before each encode, which consumes them. bench-encode-list is
+// built from the sources with NAME_COMP_LIST, to time the name compression
+// list the encoder had before its table
+// usage: bench-encode [replies]
+
+#include "mdns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+#include <arpa/inet.h>
+
+#ifdef NAME_COMP_LIST
+#define NAME_COMP		"list"
+#else
+#define NAME_COMP		"table"
+#endif
+
+#define MAX_RECORDS		512
+#define BUF_SIZE		65536
+#define ARENA_SIZE		65536
+
+struct reply {
+	struct mdns_arena arena;
+	struct mdns_pkt pkt;
+	struct rr_entry *records[MAX_RECORDS];
+	int count;
+	int answers;	// the first records are answers, the others additional
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+static void reply_fill(struct reply *r) {
+	mdns_arena_reset(&r->arena);
+	mdns_init_reply(&r->pkt, 0);
+
+	for (int i = 0; i < r->count; i++) {
+		if (i < r->answers)
+			r->pkt.num_ans_rr += rr_list_append_arena(&r->arena, &r->pkt.rr_ans, r->records[i]);
+		else
+			r->pkt.num_add_rr += rr_list_append_arena(&r->arena, &r->pkt.rr_add, r->records[i]);
+	}
+}
+
+// the answer to a browse for _airplay._tcp: a PTR per instance, with
+// their SRV and TXT and the host addresses as additional records
+static void reply_build(struct reply *r, int services) {
+	uint8_t *host = create_nlabel("Living-Room.local"), *type = create_nlabel("_airplay._tcp.local");
+	struct in6_addr *addr6 = calloc(1, sizeof(struct in6_addr));
+	struct in_addr addr = { inet_addr("192.0.2.2") };
+	struct rr_entry *nsec;
+
+	memset(r, 0, sizeof(*r));
+	mdns_arena_init(&r->arena, ARENA_SIZE);
+	r->pkt.arena = &r->arena;
+	r->answers = services;
+
+	for (int i = 0; i < services; i++) {
+		struct rr_entry *srv, *txt;
+		char name[64];
+		uint8_t *inst;
+
+		snprintf(name, sizeof(name), "Living Room %d._airplay._tcp.local", i);
+		inst = create_nlabel(name);
+
+		srv = rr_create_srv(inst, 7000 + i, host);
+		txt = rr_create(inst, RR_TXT);
+		rr_add_txt(txt, "deviceid=00:11:22:33:44:55");
+		rr_add_txt(txt, "features=0x5A7FFFF7,0x1E");
+		rr_add_txt(txt, "model=AppleTV3,2");
+		rr_add_txt(txt, "srcvers=220.68");
+
+		r->records[i] = rr_create_ptr(type, srv);
+		r->records[services + 2 * i] = srv;
+		r->records[services + 2 * i + 1] = txt;
+		free(inst);
+	}
+
+	r->count = 3 * services;
+	r->records[r->count++] = rr_create_a(host, addr);
+	// the record owns its address
+	addr6->s6_addr[0] = 0xfe;
+	addr6->s6_addr[1] = 0x80;
+	addr6->s6_addr[15] = 1;
+	r->records[r->count++] = rr_create_aaaa(host, addr6);
+	nsec = rr_create(host, RR_NSEC);
+	rr_set_nsec(nsec, RR_A);
+	rr_set_nsec(nsec, RR_AAAA);
+	r->records[r->count++] = nsec;
+
+	free(host);
+	free(type);
+}
+
+static void reply_destroy(struct reply *r) {
+	mdns_arena_free(&r->arena);
+	for (int i = 0; i < r->count; i++)
+		rr_entry_destroy(r->records[i]);
+}
+
+static void wire_drop(struct reply *r) {
+	for (int i = 0; i < r->count; i++) {
+		free(r->records[i]->wire);
+		r->records[i]->wire = NULL;
+	}
+}
+
+static void wire_build(struct reply *r) {
+	for (int i = 0; i < r->count; i++)
+		rr_wire_build(r->records[i]);
+}
+
+// returns µs per reply, encode false times filling the lists alone
+static double run(struct reply *r, uint8_t *buf, long count, bool encode) {
+	volatile size_t sink = 0;
+	double start = now();
+
+	for (long i = 0; i < count; i++) {
+		reply_fill(r);
+		if (encode)
+			sink += mdns_encode_pkt(&r->pkt, buf, BUF_SIZE);
+	}
+
+	(void) sink;
+	return (now() - start) * 1e6 / count;
+}
+
+// the larger reply is over any MTU, the responder would split it
+static int bench(int services, long count) {
+	static uint8_t fields[BUF_SIZE], wire[BUF_SIZE];
+	struct reply *r = malloc(sizeof(*r));
+	size_t fields_len, wire_len;
+	double fill_us, fields_us, wire_us;
+	bool same;
+
+	if (!r)
+		return 1;
+
+	reply_build(r, services);
+	fill_us = run(r, NULL, count, false);
+
+	reply_fill(r);
+	fields_len = mdns_encode_pkt(&r->pkt, fields, sizeof(fields));
+	fields_us = run(r, fields, count, true) - fill_us;
+
+	wire_build(r);
+	reply_fill(r);
+	wire_len = mdns_encode_pkt(&r->pkt, wire, sizeof(wire));
+	wire_us = run(r, wire, count, true) - fill_us;
+
+	// every record must have gone in
+	same = fields_len != (size_t) -1 && fields_len == wire_len && !memcmp(fields, wire, wire_len) &&
+		r->pkt.rr_ans == NULL && r->pkt.rr_add == NULL;
+	printf("%s, %3d records, %5zu bytes: fields %7.2f us/reply, wire %7.2f us/reply%s\n",
+		NAME_COMP, r->count, wire_len, fields_us, wire_us, same ? "" : ", OUTPUT DIFFERS");
+
+	wire_drop(r);
+	reply_destroy(r);
+	free(r);
+	return same ? 0 : 1;
+}
+
+int main(int argc, char *argv[]) {
+	long count = argc > 1 ? atol(argv[1]) : 200000;
+	int failed = 0;
+
+	failed += bench(10, count);
+	failed += bench(100, count / 10);
+
+	return failed ? 1 : 0;
+}
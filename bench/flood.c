@@ -0,0 +1,275 @@
+/*
+ * tinysvcmdns - a tiny MDNS implementation for publishing services
+ * Copyright (C) 2011 Darell Tan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// floods a responder started in-process with N workers, for N = 1, 2, 4...,
+// with QU queries, half of them for names it does not own, and reports how
+// many it answers per second. Queries go to the group out of the interface
+// of the address, or straight to the address with -u
+// usage: bench-flood [-u] [address] [queries] [max workers]
+
+#include "mdnssvc.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdbool.h>
+#include <stdint.h>
+#include <time.h>
+#include <unistd.h>
+#include <poll.h>
+#include <arpa/inet.h>
+#include <sys/socket.h>
+
+#define MDNS_ADDR		"224.0.0.251"
+#define MDNS_PORT		5353
+
+#define SERVICES		4
+#define SOCKETS			8		// queries come from several ports
+#define BURST			16		// queries in flight per socket
+#define TIMEOUT_MS		20		// a burst is given up after this
+
+struct sender {
+	int fd;
+	uint16_t id;
+	int pending;	// answers still expected for the last burst
+	uint8_t answered[65536 / 8];
+};
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// builds a query with a single QU question, returns its length
+static size_t query_build(uint8_t *buf, uint16_t id, const char *name, uint16_t type) {
+	size_t off = 12;
+
+	memset(buf, 0, off);
+	buf[0] = id >> 8;
+	buf[1] = id & 0xFF;
+	buf[5] = 1;
+
+	while (*name) {
+		size_t len = strcspn(name, ".");
+		buf[off++] = len;
+		memcpy(buf + off, name, len);
+		off += len;
+		name += len + (name[len] == '.');
+	}
+	buf[off++] = 0;
+
+	buf[off++] = type >> 8;
+	buf[off++] = type & 0xFF;
+	buf[off++] = 0x80;		// unicast response
+	buf[off++] = 1;
+	return off;
+}
+
+// a quarter of the queries browse, a quarter resolve an instance and the
+// rest are for names we don't own, returns true if an answer is expected
+static bool query_send(struct sender *s, const struct sockaddr_in *to, long seq) {
+	uint8_t buf[256];
+	char name[64];
+	size_t len;
+	bool ours = true;
+
+	switch (seq % 4) {
+		case 0:
+			len = query_build(buf, s->id, "_http._tcp.local", 12);
+			break;
+		case 1:
+			snprintf(name, sizeof(name), "flood %ld._http._tcp.local", seq / 4 % SERVICES);
+			len = query_build(buf, s->id, name, 33);
+			break;
+		default:
+			snprintf(name, sizeof(name), "host-%ld.local", seq);
+			len = query_build(buf, s->id, name, 1);
+			ours = false;
+	}
+
+	s->answered[s->id / 8] &= ~(1 << (s->id % 8));
+	s->id++;
+
+	if (sendto(s->fd, buf, len, 0, (const struct sockaddr *) to, sizeof(*to)) != (ssize_t) len)
+		return false;
+	return ours;
+}
+
+// returns the number of new answers, a reply split over several packets
+// counts once
+static int answers_recv(struct sender *s) {
+	uint8_t buf[2048];
+	ssize_t len;
+	int count = 0;
+
+	while ((len = recv(s->fd, buf, sizeof(buf), MSG_DONTWAIT)) >= 12) {
+		uint16_t id = (buf[0] << 8) | buf[1];
+
+		if (s->answered[id / 8] & (1 << (id % 8)))
+			continue;
+
+		s->answered[id / 8] |= 1 << (id % 8);
+		count++;
+	}
+
+	return count;
+}
+
+static struct mdnsd *responder_start(struct in_addr addr, int workers, struct mdns_service **svcs) {
+	const char *txt[] = { "path=/", NULL };
+	struct mdnsd *svr = mdnsd_start_workers(addr, workers, false);
+
+	if (!svr)
+		return NULL;
+
+	mdnsd_set_hostname(svr, "flood.local", addr);
+	for (int i = 0; i < SERVICES; i++) {
+		char name[32];
+
+		snprintf(name, sizeof(name), "flood %d", i);
+		svcs[i] = mdnsd_register_svc(svr, name, "_http._tcp.local", 8000 + i, NULL, txt);
+	}
+
+	// let the first announce go out
+	sleep(1);
+	return svr;
+}
+
+static void responder_stop(struct mdnsd *svr, struct mdns_service **svcs) {
+	for (int i = 0; i < SERVICES; i++)
+		mdns_service_remove(svr, svcs[i]);
+	mdnsd_stop(svr);
+}
+
+// sends count queries with at most BURST in flight per socket
+static void flood(struct sender *senders, const struct sockaddr_in *to, long count, long *answered, long *lost) {
+	struct pollfd fds[SOCKETS];
+	long seq = 0;
+	bool busy = true;
+
+	for (int i = 0; i < SOCKETS; i++) {
+		fds[i].fd = senders[i].fd;
+		fds[i].events = POLLIN;
+	}
+
+	while (seq < count || busy) {
+		busy = false;
+
+		for (int i = 0; i < SOCKETS; i++) {
+			struct sender *s = &senders[i];
+
+			if (s->pending == 0)
+				for (int k = 0; k < BURST && seq < count; k++)
+					s->pending += query_send(s, to, seq++);
+			busy |= s->pending > 0;
+		}
+
+		if (!busy)
+			continue;
+
+		if (poll(fds, SOCKETS, TIMEOUT_MS) <= 0) {
+			for (int i = 0; i < SOCKETS; i++) {
+				*lost += senders[i].pending;
+				senders[i].pending = 0;
+			}
+			continue;
+		}
+
+		for (int i = 0; i < SOCKETS; i++) {
+			struct sender *s = &senders[i];
+			int n;
+
+			if (!(fds[i].revents & POLLIN))
+				continue;
+
+			n = answers_recv(s);
+			*answered += n;
+			s->pending = n < s->pending ? s->pending - n : 0;
+		}
+	}
+}
+
+int main(int argc, char *argv[]) {
+	static struct sender senders[SOCKETS];
+	struct sockaddr_in to = { .sin_family = AF_INET, .sin_port = htons(MDNS_PORT) };
+	bool unicast = argc > 1 && !strcmp(argv[1], "-u");
+	bool multicast = !unicast;
+	struct in_addr addr;
+	long count;
+	int max_workers;
+
+	argv += unicast;
+	argc -= unicast;
+	addr.s_addr = inet_addr(argc > 1 ? argv[1] : "127.0.0.1");
+	count = argc > 2 ? atol(argv[2]) : 100000;
+	max_workers = argc > 3 ? atoi(argv[3]) : 4;
+	to.sin_addr.s_addr = multicast ? inet_addr(MDNS_ADDR) : addr.s_addr;
+
+	for (int i = 0; i < SOCKETS; i++) {
+		struct sockaddr_in from = { .sin_family = AF_INET, .sin_addr = addr };
+		int fd = socket(AF_INET, SOCK_DGRAM, 0);
+		int size = 1 << 20;
+
+		if (fd < 0 || bind(fd, (struct sockaddr *) &from, sizeof(from)) < 0) {
+			perror("sender socket");
+			return 2;
+		}
+
+		setsockopt(fd, SOL_SOCKET, SO_RCVBUF, &size, sizeof(size));
+		if (multicast)
+			setsockopt(fd, IPPROTO_IP, IP_MULTICAST_IF, &addr, sizeof(addr));
+		senders[i].fd = fd;
+	}
+
+	printf("%ld queries to %s, half for names we own\n", count, inet_ntoa(to.sin_addr));
+	printf("workers  answered/s  answered  lost  received\n");
+
+	for (int workers = 1; workers <= max_workers; workers *= 2) {
+		struct mdns_service *svcs[SERVICES];
+		struct mdnsd_stats stats;
+		struct mdnsd *svr = responder_start(addr, workers, svcs);
+		long answered = 0, lost = 0;
+		double start;
+
+		if (!svr) {
+			fprintf(stderr, "can't start %d workers on %s\n", workers, inet_ntoa(addr));
+			return 2;
+		}
+
+		start = now();
+		flood(senders, &to, count, &answered, &lost);
+		start = now() - start;
+
+		mdnsd_get_stats(svr, &stats);
+		printf("%7d  %10.0f  %8ld  %4ld  %8llu\n", workers, answered / start, answered, lost,
+			(unsigned long long) stats.rx_packets);
+		responder_stop(svr, svcs);
+	}
+
+	return 0;
+}
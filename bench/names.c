@@ -0,0 +1,337 @@
+/*
+ * tinysvcmdns - a tiny MDNS implementation for publishing services
+ * Copyright (C) 2011 Darell Tan
+ * All rights reserved.
+ *
+ * Redistribution and use in source and binary forms, with or without
+ * modification, are permitted provided that the following conditions
+ * are met:
+ * 1. Redistributions of source code must retain the above copyright
+ *    notice, this list of conditions and the following disclaimer.
+ * 2. Redistributions in binary form must reproduce the above copyright
+ *    notice, this list of conditions and the following disclaimer in the
+ *    documentation and/or other materials provided with the distribution.
+ * 3. The name of the author may not be used to endorse or promote products
+ *    derived from this software without specific prior written permission.
+ *
+ * THIS SOFTWARE IS PROVIDED BY THE AUTHOR ``AS IS'' AND ANY EXPRESS OR
+ * IMPLIED WARRANTIES, INCLUDING, BUT NOT LIMITED TO, THE IMPLIED WARRANTIES
+ * OF MERCHANTABILITY AND FITNESS FOR A PARTICULAR PURPOSE ARE DISCLAIMED.
+ * IN NO EVENT SHALL THE AUTHOR BE LIABLE FOR ANY DIRECT, INDIRECT,
+ * INCIDENTAL, SPECIAL, EXEMPLARY, OR CONSEQUENTIAL DAMAGES (INCLUDING, BUT
+ * NOT LIMITED TO, PROCUREMENT OF SUBSTITUTE GOODS OR SERVICES; LOSS OF USE,
+ * DATA, OR PROFITS; OR BUSINESS INTERRUPTION) HOWEVER CAUSED AND ON ANY
+ * THEORY OF LIABILITY, WHETHER IN CONTRACT, STRICT LIABILITY, OR TORT
+ * (INCLUDING NEGLIGENCE OR OTHERWISE) ARISING IN ANY WAY OUT OF THE USE OF
+ * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
+ */
+
+// times mdns_decode_name() on the compressed names of DNS-SD responses built
+// from a corpus, and on malformed names it must reject
+// usage: bench-names [corpus] [decodes]
+
+#include "mdns.h"
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <time.h>
+
+// must match MAX_NAME_HOPS in mdns.c
+#define MAX_NAME_HOPS	32
+
+#define PKT_SIZE		1024
+#define MAX_SAMPLES		1024
+
+struct sample {
+	uint8_t pkt[PKT_SIZE];
+	size_t len;
+	size_t off;				// where the name starts
+	size_t wire_len;		// expected return, 0 if it must be rejected
+	uint8_t name[MDNS_NAME_MAX];	// expected name when accepted
+	const char *kind;
+};
+
+static struct sample samples[MAX_SAMPLES];
+static int nsamples;
+
+static double now(void) {
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return ts.tv_sec + ts.tv_nsec / 1e9;
+}
+
+// appends one label, returns the offset after it
+static size_t put_label(uint8_t *pkt, size_t off, const char *label, size_t len) {
+	pkt[off] = len;
+	memcpy(pkt + off + 1, label, len);
+	return off + 1 + len;
+}
+
+// appends the labels of a dotted name, without the root label
+static size_t put_labels(uint8_t *pkt, size_t off, const char *dotted) {
+	while (*dotted) {
+		size_t len = strcspn(dotted, ".");
+		off = put_label(pkt, off, dotted, len);
+		dotted += len + (dotted[len] == '.');
+	}
+	return off;
+}
+
+static size_t put_ptr(uint8_t *pkt, size_t off, size_t target) {
+	pkt[off] = 0xC0 | (target >> 8);
+	pkt[off + 1] = target & 0xFF;
+	return off + 2;
+}
+
+// copies the uncompressed name at off, for the expected result
+static void copy_name(uint8_t *name, const uint8_t *pkt, size_t off) {
+	size_t len = 0;
+
+	while (pkt[off] != 0) {
+		if ((pkt[off] & 0xC0) == 0xC0) {
+			off = ((pkt[off] & 0x3F) << 8) | pkt[off + 1];
+			continue;
+		}
+		memcpy(name + len, pkt + off, pkt[off] + 1);
+		len += pkt[off] + 1;
+		off += pkt[off] + 1;
+	}
+	name[len] = 0;
+}
+
+static struct sample *sample_add(const char *kind) {
+	struct sample *s;
+
+	if (nsamples == MAX_SAMPLES) {
+		fprintf(stderr, "too many samples\n");
+		exit(2);
+	}
+
+	s = &samples[nsamples++];
+	memset(s, 0, sizeof(*s));
+	s->off = 12;
+	s->kind = kind;
+	return s;
+}
+
+// a name that decodes, copying the expected result from the packet
+static void sample_good(struct sample *s, const struct sample *from, size_t off, size_t wire_len) {
+	if (from) {
+		memcpy(s->pkt, from->pkt, from->len);
+		s->len = from->len;
+	}
+	s->off = off;
+	s->wire_len = wire_len;
+	copy_name(s->name, s->pkt, off);
+}
+
+// lays out each corpus entry as a response does: the service type in full,
+// then the instance and the host compressed against it
+static int load_corpus(const char *path) {
+	char line[512];
+	int count = 0;
+	FILE *f = fopen(path, "r");
+
+	if (!f) {
+		perror(path);
+		return -1;
+	}
+
+	while (fgets(line, sizeof(line), f)) {
+		char *inst = strtok(line, "\t\n"), *type = strtok(NULL, "\t\n"), *host = strtok(NULL, "\t\n");
+		struct sample *s;
+		size_t type_off, local_off, inst_off, host_off, sub_off, end;
+
+		if (!inst || inst[0] == '#' || !type || !host)
+			continue;
+
+		s = sample_add("service type");
+		type_off = s->off;
+		end = put_labels(s->pkt, type_off, type);
+		local_off = end - strlen(".local");
+		s->pkt[end++] = 0;
+
+		inst_off = end;
+		end = put_label(s->pkt, end, inst, strlen(inst));
+		end = put_ptr(s->pkt, end, type_off);
+
+		// the host shares the .local suffix of the type
+		host_off = end;
+		end = put_labels(s->pkt, end, host);
+		end = put_ptr(s->pkt, end - strlen(".local"), local_off);
+
+		// a subtype of the type
+		sub_off = end;
+		end = put_labels(s->pkt, end, "_printer._sub");
+		end = put_ptr(s->pkt, end, type_off);
+
+		s->len = end + 16;	// the rdata that follows
+		sample_good(s, NULL, type_off, inst_off - type_off);
+		sample_good(sample_add("instance"), s, inst_off, host_off - inst_off);
+		sample_good(sample_add("host"), s, host_off, sub_off - host_off);
+		sample_good(sample_add("subtype"), s, sub_off, end - sub_off);
+		count++;
+	}
+
+	fclose(f);
+	return count;
+}
+
+// a chain of pointers ending at the root label, followed hops times
+static void chain(struct sample *s, int hops) {
+	size_t off = 12;
+
+	s->pkt[off++] = 0;
+	for (int i = 0; i < hops; i++)
+		off = put_ptr(s->pkt, off, off - (i ? 2 : 1));
+
+	s->off = off - 2;
+	s->len = off;
+}
+
+// a name of len bytes on the wire, root label included, from 63 byte labels
+static size_t long_name(uint8_t *pkt, size_t off, size_t len) {
+	char label[63];
+
+	memset(label, 'x', sizeof(label));
+	while (len > 1) {
+		size_t l = len - 2 < sizeof(label) ? len - 2 : sizeof(label);
+		off = put_label(pkt, off, label, l);
+		len -= l + 1;
+	}
+	pkt[off++] = 0;
+	return off;
+}
+
+static void add_malformed(void) {
+	struct sample *s;
+	size_t off;
+
+	s = sample_add("self loop");
+	s->len = put_ptr(s->pkt, 12, 12) + 16;
+
+	s = sample_add("forward pointer");
+	off = put_ptr(s->pkt, 12, 14);
+	off = put_labels(s->pkt, off, "a");
+	s->pkt[off++] = 0;
+	s->len = off;
+
+	s = sample_add("pointer out of the packet");
+	s->len = put_ptr(s->pkt, 12, 600) + 16;
+
+	s = sample_add("pointer cut by the packet end");
+	s->pkt[12] = 0xC0;
+	s->len = 13;
+
+	// a -> b -> a, entered through b which points backwards first
+	s = sample_add("two label cycle");
+	off = put_labels(s->pkt, 12, "a");
+	off = put_ptr(s->pkt, off, 16);
+	off = put_labels(s->pkt, off, "b");
+	s->len = put_ptr(s->pkt, off, 12);
+	s->off = 16;
+
+	s = sample_add("chain one hop too long");
+	chain(s, MAX_NAME_HOPS + 1);
+
+	s = sample_add("chain of 120 hops");
+	chain(s, 120);
+
+	s = sample_add("256 byte name");
+	s->len = long_name(s->pkt, 12, 256);
+
+	s = sample_add("321 byte name");
+	s->len = long_name(s->pkt, 12, 321);
+
+	// both parts are fine alone
+	s = sample_add("257 byte name through a pointer");
+	off = long_name(s->pkt, 12, 193);
+	s->off = off;
+	off = put_label(s->pkt, off, "xxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxxx", 63);
+	s->len = put_ptr(s->pkt, off, 12);
+
+	s = sample_add("truncated label");
+	put_labels(s->pkt, 12, "_airplay");
+	s->pkt[12] = 63;
+	s->len = 12 + 9;
+
+	s = sample_add("label with the 0x40 bit");
+	off = put_labels(s->pkt, 12, "local");
+	s->pkt[12] |= 0x40;
+	s->pkt[off] = 0;
+	s->len = off + 1;
+
+	s = sample_add("label with the 0x80 bit");
+	off = put_labels(s->pkt, 12, "local");
+	s->pkt[12] |= 0x80;
+	s->pkt[off] = 0;
+	s->len = off + 1;
+}
+
+// the longest names that must still decode
+static void add_limits(void) {
+	struct sample *s;
+
+	s = sample_add("chain at the hop limit");
+	chain(s, MAX_NAME_HOPS);
+	sample_good(s, NULL, s->off, 2);
+
+	s = sample_add("255 byte name");
+	s->len = long_name(s->pkt, 12, 255);
+	sample_good(s, NULL, 12, 255);
+}
+
+// decodes samples [first, last) until count names, returns ns per name
+static double run(int first, int last, long count) {
+	uint8_t name[MDNS_NAME_MAX];
+	volatile size_t sink = 0;
+	double start = now();
+
+	for (long i = 0, k = first; i < count; i++) {
+		struct sample *s = &samples[k];
+
+		sink += mdns_decode_name(s->pkt, s->len, s->off, name);
+		if (++k == last)
+			k = first;
+	}
+
+	(void) sink;
+	return (now() - start) * 1e9 / count;
+}
+
+int main(int argc, char *argv[]) {
+	const char *corpus = argc > 1 ? argv[1] : "bench/names.txt";
+	long count = argc > 2 ? atol(argv[2]) : 5000000;
+	int entries, real, limits, failed = 0;
+
+	entries = load_corpus(corpus);
+	if (entries <= 0) {
+		fprintf(stderr, "no names in %s\n", corpus);
+		return 2;
+	}
+
+	real = nsamples;
+	add_limits();
+	limits = nsamples;
+	add_malformed();
+
+	// check every result before timing anything
+	for (int i = 0; i < nsamples; i++) {
+		struct sample *s = &samples[i];
+		uint8_t name[MDNS_NAME_MAX];
+		size_t len = mdns_decode_name(s->pkt, s->len, s->off, name);
+
+		if (len != s->wire_len || (len && strcmp((char *) name, (char *) s->name))) {
+			printf("FAIL %s at %zu: returned %zu, expected %zu\n", s->kind, s->off, len, s->wire_len);
+			failed++;
+		}
+	}
+
+	printf("%d corpus entries, %d names\n", entries, real);
+	printf("%-32s %8.1f ns/name\n", "corpus", run(0, real, count));
+	printf("%-32s %8.1f ns/name\n", "limits", run(real, limits, count / 4));
+	for (int i = limits; i < nsamples; i++)
+		printf("%-32s %8.1f ns/name\n", samples[i].kind, run(i, i + 1, count / 16));
+
+	return failed ? 1 : 0;
+}
@@ -171,7 +171,7 @@ int asprintf(char** strp, const char* fmt, ...)
 
 /*---------------------------------------------------------------------------*/
 static void print_usage(void) {
-	printf("[-v] [-o <ip|ifname>] -i <identity> -t <type> -p <port> [<txt>] ...[<txt>]\n");
+	printf("[-v] [-o <ip|ifname>] ...[-o <ip|ifname>] [-w <workers>] -i <identity> -t <type> -p <port> [<txt>] ...[<txt>]\n");
 }
 
 /*---------------------------------------------------------------------------*/
@@ -188,9 +188,9 @@ static void sighandler(int signum) {
 /*---------------------------------------------------------------------------*/
 int main(int argc, char *argv[]) {
 	const char** txt = NULL;
-	struct in_addr host;
-	char hostname[256],* arg, * identity = NULL, * type = NULL, * addr = NULL;
-	int port = 0;
+	struct in_addr host, more[8];
+	char hostname[256],* arg, * identity = NULL, * type = NULL, * addrs[8] = { NULL };
+	int port = 0, workers = 1, num_addrs = 0, num_more = 0, i;
 	bool verbose = false;
 
 	if (argc <= 2) {
@@ -216,12 +216,17 @@ int main(int argc, char *argv[]) {
 
 	while ((arg = *++argv) != NULL) {
 		if (!strcasecmp(arg, "-o") || !strcasecmp(arg, "host")) {
-			addr = *++argv;
+			// the first one is the host, the others more interfaces
+			arg = *++argv;
+			if (num_addrs < sizeof(addrs) / sizeof(addrs[0])) addrs[num_addrs++] = arg;
 			argc -= 2;
 		} else if (!strcasecmp(arg, "-p")) {
 			port = atoi(*++argv);
 		} else if (!strcasecmp(arg, "-v")) {
 			verbose = true;
+		} else if (!strcasecmp(arg, "-w")) {
+			workers = atoi(*++argv);
+			argc -= 2;
 		} else if (!strcasecmp(arg, "-t")) {
 			(void)! asprintf(&type, "%s.local", *++argv);
 		} else if (!strcasecmp(arg, "-i")) {
@@ -243,13 +248,20 @@ int main(int argc, char *argv[]) {
 
 	gethostname(hostname, sizeof(hostname));
 	strcat(hostname, ".local");
-	host = get_interface(addr);
+	host = get_interface(addrs[0]);
 
-	svr = mdnsd_start(host, verbose);
+	svr = mdnsd_start_workers(host, workers, verbose);
 	if (svr) {
 		printf("host: %s\nidentity: %s\ntype: %s\nip: %s\nport: %u\n", hostname, identity, type, inet_ntoa(host), port);
 
+		// interfaces first, so that each one answers with its own address
+		for (i = 1; i < num_addrs; i++) {
+			more[num_more] = get_interface(addrs[i]);
+			if (mdnsd_add_interface(svr, more[num_more])) printf("ip: %s\n", inet_ntoa(more[num_more++]));
+		}
+
 		mdnsd_set_hostname(svr, hostname, host);
+		for (i = 0; i < num_more; i++) mdnsd_set_hostname(svr, hostname, more[i]);
 		svc = mdnsd_register_svc(svr, identity, type, port, NULL, txt);
 		// mdns_service_destroy(svc);
 
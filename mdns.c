@@ -31,6 +31,7 @@
 #include <stdlib.h>
 #include <stdio.h>
 #include <string.h>
+#include <stddef.h>
 #include <assert.h>
 
 #ifdef _WIN32
@@ -38,16 +39,376 @@
 #include <in6addr.h>
 #else
 #include <netinet/in.h>
+#include <time.h>
 #endif
 
+#if __has_include(<pthread.h>)
+#include <pthread.h>
+static pthread_mutex_t atoms_mutex = PTHREAD_MUTEX_INITIALIZER;
+#define atoms_lock() pthread_mutex_lock(&atoms_mutex);
+#define atoms_unlock() pthread_mutex_unlock(&atoms_mutex);
+#elif _WIN32
+static SRWLOCK atoms_mutex = SRWLOCK_INIT;
+#define atoms_lock() AcquireSRWLockExclusive(&atoms_mutex);
+#define atoms_unlock() ReleaseSRWLockExclusive(&atoms_mutex);
+#else
+#error missing pthread
+#endif
+
+
+// name compression table, one per encoded packet and kept on the stack
+// suffixes are indexed by hash, only positions reachable by a pointer are kept
+#define COMP_SLOTS	256		// power of 2
+#define COMP_MAX	(COMP_SLOTS * 3 / 4)
+
+#define PKT_OWNERS_MAX	256		// records a packet remembers for its additionals
+
+#ifdef NAME_COMP_LIST
+// the list the table replaced, walked for every label of every name. Only
+// built for bench/encode.c to compare, it keeps as many suffixes as the
+// table so that both encode the same bytes
+struct name_comp_label {
+	const uint8_t *label;
+	uint16_t pos;			// position in msg
+	struct name_comp_label *next;	// encoded before it
+};
+
+struct name_comp {
+	size_t used;
+	struct name_comp_label *head;	// last encoded
+};
+#else
+struct name_comp_slot {
+	const uint8_t *label;	// suffix, NULL if the slot is free
+	uint32_t hash;
+	uint16_t pos;			// position in msg
+};
 
 struct name_comp {
-	uint8_t *label;	// label
-	size_t pos;		// position in msg
+	size_t used;
+	uint8_t order[COMP_MAX];	// slots in the order they were filled
+	struct name_comp_slot slots[COMP_SLOTS];
+};
+#endif
+
+// an interned name, shared by all the records using it
+struct name_atom {
+	struct name_atom *next;	// hash chain
+	uint32_t hash;
+	uint32_t refs;
+	uint8_t name[];
+};
 
-	struct name_comp *next;
+// table of all interned names, common to all responder instances
+static struct {
+	struct name_atom **buckets;
+	size_t size;		// power of 2 (or 0)
+	size_t count;
+} atoms;
+
+#define NAME_ATOM(n) ((struct name_atom *) ((n) - offsetof(struct name_atom, name)))
+
+// compression pointers followed by a name, real packets use a handful and
+// the limit bounds the work a forged chain of pointers can cause
+#define MAX_NAME_HOPS	32
+
+#define ARENA_ALIGN		16
+#define ARENA_MAX_SIZE	(256 * 1024)
+
+// allocation that did not fit in the arena
+struct mdns_arena_block {
+	struct mdns_arena_block *next;
+	uint8_t pad[ARENA_ALIGN - sizeof(struct mdns_arena_block *)];
+	uint8_t data[];
 };
 
+// ----- arena functions -----
+
+void mdns_arena_init(struct mdns_arena *arena, size_t size) {
+	memset(arena, 0, sizeof(struct mdns_arena));
+	arena->base = malloc(size);
+	arena->size = arena->base ? size : 0;
+}
+
+// returns aligned memory valid until the next reset
+void *mdns_arena_alloc(struct mdns_arena *arena, size_t len) {
+	struct mdns_arena_block *block;
+	void *p;
+
+	len = (len + ARENA_ALIGN - 1) & ~(size_t) (ARENA_ALIGN - 1);
+
+	if (arena->used + len <= arena->size) {
+		p = arena->base + arena->used;
+		arena->used += len;
+		return p;
+	}
+
+	// spill to the heap, the arena will grow at the next reset
+	block = malloc(sizeof(struct mdns_arena_block) + len);
+	if (block == NULL)
+		return NULL;
+
+	block->next = arena->blocks;
+	arena->blocks = block;
+	arena->spill += len;
+
+	return block->data;
+}
+
+// releases everything allocated since last reset
+void mdns_arena_reset(struct mdns_arena *arena) {
+	while (arena->blocks) {
+		struct mdns_arena_block *next = arena->blocks->next;
+		free(arena->blocks);
+		arena->blocks = next;
+	}
+
+	// grow so that the same load fits next time, up to a limit so that a
+	// single pathological packet does not pin memory forever
+	if (arena->spill && arena->size < ARENA_MAX_SIZE) {
+		size_t size = arena->size ? arena->size : ARENA_ALIGN;
+		uint8_t *base;
+
+		while (size < arena->used + arena->spill && size < ARENA_MAX_SIZE)
+			size *= 2;
+
+		base = malloc(size);
+		if (base) {
+			free(arena->base);
+			arena->base = base;
+			arena->size = size;
+		}
+	}
+
+	arena->used = 0;
+	arena->spill = 0;
+}
+
+void mdns_arena_free(struct mdns_arena *arena) {
+	mdns_arena_reset(arena);
+	free(arena->base);
+	memset(arena, 0, sizeof(struct mdns_arena));
+}
+
+// allocates from the arena if there is one, from the heap otherwise
+static void *arena_alloc(struct mdns_arena *arena, size_t len) {
+	return arena ? mdns_arena_alloc(arena, len) : malloc(len);
+}
+
+// ----- timer functions -----
+
+// monotonic clock in ms, only differences between values are meaningful
+uint64_t mdns_time_ms(void) {
+#ifdef _WIN32
+	return GetTickCount64();
+#else
+	struct timespec ts;
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+	return (uint64_t) ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+#endif
+}
+
+static void timer_place(struct mdns_timers *timers, struct mdns_timer *t, size_t i) {
+	timers->heap[i] = t;
+	t->slot = i + 1;
+}
+
+// moves the timer at i up or down until the heap order is restored
+static void timer_sift(struct mdns_timers *timers, size_t i) {
+	struct mdns_timer *t = timers->heap[i];
+
+	while (i > 0 && timers->heap[(i - 1) / 2]->deadline > t->deadline) {
+		timer_place(timers, timers->heap[(i - 1) / 2], i);
+		i = (i - 1) / 2;
+	}
+
+	while (2 * i + 1 < timers->count) {
+		size_t c = 2 * i + 1;
+		if (c + 1 < timers->count && timers->heap[c + 1]->deadline < timers->heap[c]->deadline)
+			c++;
+		if (timers->heap[c]->deadline >= t->deadline)
+			break;
+		timer_place(timers, timers->heap[c], i);
+		i = c;
+	}
+
+	timer_place(timers, t, i);
+}
+
+// arms (or re-arms) a timer to fire at the given deadline
+void mdns_timer_arm(struct mdns_timers *timers, struct mdns_timer *t, uint64_t deadline) {
+	t->deadline = deadline;
+
+	if (t->slot) {
+		timer_sift(timers, t->slot - 1);
+		return;
+	}
+
+	if (timers->count == timers->size) {
+		size_t size = timers->size ? timers->size * 2 : 16;
+		struct mdns_timer **heap = realloc(timers->heap, size * sizeof(struct mdns_timer *));
+		if (heap == NULL)
+			return;
+		timers->heap = heap;
+		timers->size = size;
+	}
+
+	timer_place(timers, t, timers->count++);
+	timer_sift(timers, timers->count - 1);
+}
+
+// disarms a timer, does nothing if it is not armed
+void mdns_timer_cancel(struct mdns_timers *timers, struct mdns_timer *t) {
+	size_t i = t->slot - 1;
+
+	if (!t->slot)
+		return;
+
+	t->slot = 0;
+	if (i != --timers->count) {
+		timer_place(timers, timers->heap[timers->count], i);
+		timer_sift(timers, i);
+	}
+}
+
+// fires all the timers that are due, callbacks may arm or cancel timers
+// returns the ms until the next deadline, -1 if no timer is armed
+int mdns_timers_run(struct mdns_timers *timers, uint64_t now) {
+	while (timers->count && timers->heap[0]->deadline <= now) {
+		struct mdns_timer *t = timers->heap[0];
+		mdns_timer_cancel(timers, t);
+		t->cb(t->arg);
+	}
+
+	if (!timers->count)
+		return -1;
+
+	return timers->heap[0]->deadline - now > INT32_MAX ? INT32_MAX : (int) (timers->heap[0]->deadline - now);
+}
+
+void mdns_timers_free(struct mdns_timers *timers) {
+	while (timers->count)
+		mdns_timer_cancel(timers, timers->heap[0]);
+	free(timers->heap);
+	memset(timers, 0, sizeof(struct mdns_timers));
+}
+
+void mdns_wheel_init(struct mdns_wheel *wheel, uint64_t now) {
+	size_t i;
+
+	for (i = 0; i < MDNS_WHEEL_SLOTS; i++)
+		wheel->slots[i].prev = wheel->slots[i].next = &wheel->slots[i];
+	wheel->overflow.prev = wheel->overflow.next = &wheel->overflow;
+	wheel->cursor = now / MDNS_WHEEL_TICK;
+	wheel->count = 0;
+}
+
+static void wheel_link(struct mdns_wheel_node *head, struct mdns_wheel_node *node) {
+	node->next = head;
+	node->prev = head->prev;
+	head->prev->next = node;
+	head->prev = node;
+}
+
+// the list a tick goes in, the overflow one if it is past the slots
+static struct mdns_wheel_node *wheel_head(struct mdns_wheel *wheel, uint64_t tick) {
+	if (tick >= wheel->cursor + MDNS_WHEEL_SLOTS)
+		return &wheel->overflow;
+	return &wheel->slots[tick & (MDNS_WHEEL_SLOTS - 1)];
+}
+
+// moves the nodes of the overflow list that are now within the slots
+static void wheel_cascade(struct mdns_wheel *wheel) {
+	struct mdns_wheel_node *node = wheel->overflow.next;
+
+	while (node != &wheel->overflow) {
+		struct mdns_wheel_node *next = node->next;
+		struct mdns_wheel_node *head = wheel_head(wheel, node->tick);
+
+		if (head != &wheel->overflow) {
+			node->prev->next = node->next;
+			node->next->prev = node->prev;
+			wheel_link(head, node);
+		}
+		node = next;
+	}
+}
+
+// schedules a node, it must not be in the wheel already
+void mdns_wheel_insert(struct mdns_wheel *wheel, struct mdns_wheel_node *node, uint64_t now, uint64_t deadline) {
+	uint64_t tick = (deadline + MDNS_WHEEL_TICK - 1) / MDNS_WHEEL_TICK;
+
+	// nothing is pending, the cursor may be far behind
+	if (wheel->count == 0)
+		wheel->cursor = now / MDNS_WHEEL_TICK;
+
+	if (tick < wheel->cursor)
+		tick = wheel->cursor;
+
+	node->tick = tick;
+	wheel_link(wheel_head(wheel, tick), node);
+	wheel->count++;
+}
+
+// unschedules a node, does nothing if it is not in the wheel
+void mdns_wheel_cancel(struct mdns_wheel *wheel, struct mdns_wheel_node *node) {
+	if (node->prev == NULL)
+		return;
+
+	node->prev->next = node->next;
+	node->next->prev = node->prev;
+	node->prev = node->next = NULL;
+	wheel->count--;
+}
+
+// removes and returns a node that is due, in deadline order, NULL if none
+// is. Nodes that are not taken stay due, so that callers can pace
+struct mdns_wheel_node *mdns_wheel_pop(struct mdns_wheel *wheel, uint64_t now) {
+	uint64_t tick = now / MDNS_WHEEL_TICK;
+
+	// the slots hold the nodes within MDNS_WHEEL_SLOTS of the cursor
+	while (wheel->count && wheel->cursor <= tick) {
+		struct mdns_wheel_node *head = &wheel->slots[wheel->cursor & (MDNS_WHEEL_SLOTS - 1)];
+
+		if (head->next != head) {
+			struct mdns_wheel_node *node = head->next;
+			mdns_wheel_cancel(wheel, node);
+			return node;
+		}
+
+		// a turn of the wheel brings the next overflow nodes in range
+		if ((++wheel->cursor & (MDNS_WHEEL_SLOTS - 1)) == 0)
+			wheel_cascade(wheel);
+	}
+
+	return NULL;
+}
+
+// returns the ms until the next node is due, 0 if one is, -1 if none
+int mdns_wheel_next(const struct mdns_wheel *wheel, uint64_t now) {
+	const struct mdns_wheel_node *node;
+	uint64_t tick;
+
+	if (wheel->count == 0)
+		return -1;
+
+	for (tick = wheel->cursor; tick < wheel->cursor + MDNS_WHEEL_SLOTS; tick++) {
+		const struct mdns_wheel_node *head = &wheel->slots[tick & (MDNS_WHEEL_SLOTS - 1)];
+		if (head->next != head)
+			break;
+	}
+
+	// the overflow list only has nodes past the next turn of the wheel
+	if (tick >= (wheel->cursor | (MDNS_WHEEL_SLOTS - 1)) + 1)
+		for (node = wheel->overflow.next; node != &wheel->overflow; node = node->next)
+			if (node->tick < tick)
+				tick = node->tick;
+
+	if (tick * MDNS_WHEEL_TICK <= now)
+		return 0;
+	return tick * MDNS_WHEEL_TICK - now > INT32_MAX ? INT32_MAX : (int) (tick * MDNS_WHEEL_TICK - now);
+}
+
 // ----- label functions -----
 
 // duplicates a name
@@ -85,6 +446,101 @@ uint8_t *join_nlabel(const uint8_t *n1, const uint8_t *n2) {
 	return s;
 }
 
+// hashes a name (FNV-1a), used to index records by owner name
+uint32_t name_hash(const uint8_t *name) {
+	uint32_t hash = 2166136261u;
+
+	for (; *name; name++) {
+		hash ^= *name;
+		hash *= 16777619u;
+	}
+
+	return hash;
+}
+
+// returns the shared copy of a name, creating it if needed
+// the reference must be dropped with name_release()
+uint8_t *name_intern(const uint8_t *name) {
+	uint32_t hash = name_hash(name);
+	struct name_atom *a;
+	size_t len;
+
+	atoms_lock();
+
+	if (atoms.size) {
+		for (a = atoms.buckets[hash & (atoms.size - 1)]; a; a = a->next) {
+			if (a->hash == hash && cmp_nlabel(a->name, name) == 0) {
+				a->refs++;
+				atoms_unlock();
+				return a->name;
+			}
+		}
+	}
+
+	// keep chains short, rehash when there are more atoms than buckets
+	if (atoms.count >= atoms.size) {
+		size_t i, size = atoms.size ? atoms.size * 2 : 64;
+		struct name_atom **buckets = calloc(size, sizeof(struct name_atom *));
+
+		for (i = 0; i < atoms.size; i++) {
+			struct name_atom *next;
+			for (a = atoms.buckets[i]; a; a = next) {
+				next = a->next;
+				a->next = buckets[a->hash & (size - 1)];
+				buckets[a->hash & (size - 1)] = a;
+			}
+		}
+
+		free(atoms.buckets);
+		atoms.buckets = buckets;
+		atoms.size = size;
+	}
+
+	len = strlen((char *) name);
+	a = malloc(sizeof(struct name_atom) + len + 1);
+	memcpy(a->name, name, len + 1);
+	a->hash = hash;
+	a->refs = 1;
+	a->next = atoms.buckets[hash & (atoms.size - 1)];
+	atoms.buckets[hash & (atoms.size - 1)] = a;
+	atoms.count++;
+
+	atoms_unlock();
+
+	return a->name;
+}
+
+// takes another reference on an interned name
+uint8_t *name_ref(uint8_t *name) {
+	atoms_lock();
+	NAME_ATOM(name)->refs++;
+	atoms_unlock();
+	return name;
+}
+
+// drops a reference to an interned name, freeing it with the last one
+void name_release(uint8_t *name) {
+	struct name_atom *a = NAME_ATOM(name), **pa;
+
+	atoms_lock();
+
+	if (--a->refs == 0) {
+		for (pa = &atoms.buckets[a->hash & (atoms.size - 1)]; *pa != a; pa = &(*pa)->next);
+		*pa = a->next;
+		atoms.count--;
+		free(a);
+	}
+
+	// nothing left, release the table too
+	if (atoms.count == 0) {
+		free(atoms.buckets);
+		atoms.buckets = NULL;
+		atoms.size = 0;
+	}
+
+	atoms_unlock();
+}
+
 // returns a human-readable name label in dotted form
 char *nlabel_to_str(const uint8_t *name) {
 	char *label, *labelp;
@@ -119,28 +575,6 @@ char *nlabel_to_str(const uint8_t *name) {
 	return label;
 }
 
-// returns the length of a label field
-// does NOT uncompress the field, so it could be as small as 2 bytes
-// or 1 for the root
-static size_t label_len(uint8_t *pkt_buf, size_t pkt_len, size_t off) {
-	uint8_t *p;
-	uint8_t *e = pkt_buf + pkt_len;
-	size_t len = 0;
-
-	for (p = pkt_buf + off; p < e; p++) {
-		if (*p == 0) {
-			return len + 1;
-		} else if ((*p & 0xC0) == 0xC0) {
-			return len + 2;
-		} else {
-			len += *p + 1;
-			p += *p;
-		}
-	}
-
-	return len;
-}
-
 // creates a label
 // free() after use
 uint8_t *create_label(const char *txt) {
@@ -196,69 +630,84 @@ uint8_t *create_nlabel(const char *name) {
 	return (uint8_t *) label;
 }
 
-// copies a label from the buffer into a newly-allocated string
-// free() after use
-static uint8_t *copy_label(uint8_t *pkt_buf, size_t pkt_len, size_t off) {
-	int len;
+// walks the labels of a name in a packet
+struct name_walk {
+	size_t off;		// current label
+	size_t limit;	// pointers must target below this
+	size_t end;		// where the name ends in the packet, 0 until known
+	int hops;		// compression pointers followed
+};
 
-	if (off > pkt_len)
-		return NULL;
-	
-	len = pkt_buf[off] + 1;
-	if (off + len > pkt_len) {
-		DEBUG_PRINTF("label length exceeds packet buffer\n");
-		return NULL;
+#define NAME_WALK_INIT(off) { (off), (off), 0, 0 }
+
+// moves to the next actual label, following compression pointers
+// returns false if the name is malformed. A pointer must target somewhere
+// before the name and before the previous target, so loops are impossible
+static inline bool name_walk_label(const uint8_t *buf, size_t len, struct name_walk *w) {
+	while (w->off < len && (buf[w->off] & 0xC0) == 0xC0) {
+		size_t target;
+
+		if (w->off + 1 >= len || ++w->hops > MAX_NAME_HOPS)
+			return false;
+
+		target = ((buf[w->off] & 0x3F) << 8) | buf[w->off + 1];
+		if (target >= w->limit)
+			return false;
+
+		// the name ends in the packet after the first pointer
+		if (w->end == 0)
+			w->end = w->off + 2;
+
+		w->off = w->limit = target;
 	}
 
-	return dup_label(pkt_buf + off);
+	// labels can't have the 0x40 or 0x80 bit (only pointers)
+	return w->off < len && !(buf[w->off] & 0xC0) && w->off + buf[w->off] < len;
 }
 
-// uncompresses a name
-// free() after use
-static uint8_t *uncompress_nlabel(uint8_t *pkt_buf, size_t pkt_len, size_t off) {
-	uint8_t *p;
-	uint8_t *e = pkt_buf + pkt_len;
+// decodes the name at off in a packet into name, uncompressed, in a single
+// pass. Returns the number of bytes the name occupies at off, or 0 if it is
+// malformed: out of the packet, pointer loop or longer than MDNS_NAME_MAX
+size_t mdns_decode_name(const uint8_t *pkt_buf, size_t pkt_len, size_t off, uint8_t name[MDNS_NAME_MAX]) {
+	struct name_walk w = NAME_WALK_INIT(off);
 	size_t len = 0;
-	char *str, *sp;
-	if (off >= pkt_len)
-		return NULL;
 
-	// calculate length of uncompressed label
-	for (p = pkt_buf + off; *p && p < e; p++) {
-		size_t llen = 0;
-		if ((*p & 0xC0) == 0xC0) {
-			uint8_t *p2 = pkt_buf + (((p[0] & ~0xC0) << 8) | p[1]);
-			llen = *p2 + 1;
-			p = p2 + llen - 1;
-		} else {
-			llen = *p + 1;
-			p += llen - 1;
-		}
-		len += llen;
+	while (name_walk_label(pkt_buf, pkt_len, &w)) {
+		uint8_t l = pkt_buf[w.off];
+
+		name[len++] = l;
+
+		if (l == 0)
+			return (w.end ? w.end : w.off + 1) - off;
+
+		// keep room for the root label
+		if (len + l >= MDNS_NAME_MAX - 1)
+			break;
+
+		memcpy(name + len, pkt_buf + w.off + 1, l);
+		len += l;
+		w.off += l + 1;
 	}
 
-	str = sp = malloc(len + 1);
-	if (str == NULL)
+	return 0;
+}
+
+// uncompresses the name at off and stores its wire length in name_len
+// free() after use unless allocated from an arena
+static uint8_t *uncompress_nlabel(struct mdns_arena *arena, uint8_t *pkt_buf, size_t pkt_len, size_t off, size_t *name_len) {
+	uint8_t buf[MDNS_NAME_MAX], *name;
+	size_t len;
+
+	*name_len = mdns_decode_name(pkt_buf, pkt_len, off, buf);
+	if (*name_len == 0)
 		return NULL;
 
-	// FIXME: must merge this with above code
-	for (p = pkt_buf + off; *p && p < e; p++) {
-		size_t llen = 0;
-		if ((*p & 0xC0) == 0xC0) {
-			uint8_t *p2 = pkt_buf + (((p[0] & ~0xC0) << 8) | p[1]);
-			llen = *p2 + 1;
-			strncpy(sp, (char *) p2, llen);
-			p = p2 + llen - 1;
-		} else {
-			llen = *p + 1;
-			strncpy(sp, (char *) p, llen);
-			p += llen - 1;
-		}
-		sp += llen;
-	}
-	*sp = '\0';
+	len = strlen((char *) buf) + 1;
+	name = arena_alloc(arena, len);
+	if (name)
+		memcpy(name, buf, len);
 
-	return (uint8_t *) str;
+	return name;
 }
 
 // ----- RR list & group functions -----
@@ -276,18 +725,12 @@ const char *rr_get_type_name(enum rr_type type) {
 	return NULL;
 }
 
-void rr_entry_destroy(struct rr_entry *rr) {
+// frees the data elements of an RR, except names
+static void rr_data_destroy(struct rr_entry *rr) {
 	struct rr_data_txt *txt_rec;
-	assert(rr);
 
 	// check rr_type and free data elements
 	switch (rr->type) {
-		case RR_PTR:
-			if (rr->data.PTR.name)
-				free(rr->data.PTR.name);
-			// don't free entry
-			break;
-
 		case RR_TXT:
 			txt_rec = &rr->data.TXT;
 			while (txt_rec) {
@@ -303,11 +746,6 @@ void rr_entry_destroy(struct rr_entry *rr) {
 			}
 			break;
 
-		case RR_SRV:
-			if (rr->data.SRV.target)
-				free(rr->data.SRV.target);
-			break;
-
 		case RR_AAAA:
 			if (rr->data.AAAA.addr)
 				free(rr->data.AAAA.addr);
@@ -317,6 +755,37 @@ void rr_entry_destroy(struct rr_entry *rr) {
 			// nothing to free
 			break;
 	}
+}
+
+// destroys an RR created by rr_create*(), names are interned
+void rr_entry_destroy(struct rr_entry *rr) {
+	assert(rr);
+
+	// PTR only have a name of their own when copied, don't free entry
+	if (rr->type == RR_SRV && rr->data.SRV.target)
+		name_release(rr->data.SRV.target);
+	if (rr->type == RR_PTR && rr->data.PTR.name)
+		name_release(rr->data.PTR.name);
+
+	rr_data_destroy(rr);
+
+	if (rr->wire)
+		free(rr->wire);
+
+	name_release(rr->name);
+	free(rr);
+}
+
+// destroys an RR parsed from a packet, names are private copies
+static void rr_entry_destroy_parsed(struct rr_entry *rr) {
+	assert(rr);
+
+	if (rr->type == RR_PTR && rr->data.PTR.name)
+		free(rr->data.PTR.name);
+	if (rr->type == RR_SRV && rr->data.SRV.target)
+		free(rr->data.SRV.target);
+
+	rr_data_destroy(rr);
 
 	free(rr->name);
 	free(rr);
@@ -340,37 +809,6 @@ int rr_list_count(struct rr_list *rr) {
 	return i;
 }
 
-struct rr_entry *rr_entry_remove(struct rr_group *group, struct rr_entry *entry, enum rr_type type) {
-	struct rr_group *g;
-
-	for (g = group; g; g = g->next) {
-		struct rr_list *lrr = g->rr, *prr= NULL;
-		for (; lrr; lrr = lrr->next) {
-			if (lrr->e->type == type) {
-				switch (type) {
-				case RR_PTR:
-					if (lrr->e->data.PTR.entry == entry) {
-						struct rr_entry *e = lrr->e;
-						if (prr == NULL) {
-							g->rr = lrr->next;
-						} else {
-							prr->next = lrr->next;
-						}
-						free(lrr);
-						return e;
-					}
-					break;
-				default:
-					break;
-				}
-			}
-			prr = lrr;
-		}
-	}
-
-	return NULL;
-}
-
 struct rr_entry *rr_list_remove(struct rr_list **rr_head, struct rr_entry *rr) {
 	struct rr_list *le = *rr_head, *pe = NULL;
 	for (; le; le = le->next) {
@@ -390,34 +828,21 @@ struct rr_entry *rr_list_remove(struct rr_list **rr_head, struct rr_entry *rr) {
 	return NULL;
 }
 
-void rr_group_clean(struct rr_group **head) {
-	struct rr_group *le = *head, *pe = NULL;
-
-	while (le) {
-		if (le->rr == NULL) {
-			free(le->name);
-			if (pe == NULL) {
-				*head = le->next;
-				 free(le);
-				 le = *head;
-			 } else {
-				pe->next = le->next;
-				free(le);
-				le = pe->next;
-			 }
-		} else {
-			pe = le;
-			le = le->next;
-        }
-	}
-}
-
 // appends an rr_entry to an RR list
 // if the RR is already in the list, it will not be added
 // RRs are compared by memory location - not its contents
 // return value of 0 means item not added
 int rr_list_append(struct rr_list **rr_head, struct rr_entry *rr) {
-	struct rr_list *node = malloc(sizeof(struct rr_list));
+	return rr_list_append_arena(NULL, rr_head, rr);
+}
+
+// same as rr_list_append() but the list node is allocated from an arena
+// (if not NULL) so the list must not be destroyed by rr_list_destroy()
+int rr_list_append_arena(struct mdns_arena *arena, struct rr_list **rr_head, struct rr_entry *rr) {
+	struct rr_list *node = arena_alloc(arena, sizeof(struct rr_list));
+	if (node == NULL)
+		return 0;
+
 	node->e = rr;
 	node->next = NULL;
 
@@ -428,7 +853,8 @@ int rr_list_append(struct rr_list **rr_head, struct rr_entry *rr) {
 		for (; e; e = e->next) {
 			// already in list - don't add
 			if (e->e == rr) {
-				free(node);
+				if (arena == NULL)
+					free(node);
 				return 0;
 			}
 			if (e->next == NULL)
@@ -440,13 +866,13 @@ int rr_list_append(struct rr_list **rr_head, struct rr_entry *rr) {
 }
 
 #define FILL_RR_ENTRY(rr, _name, _type)	\
-	rr->name = _name;			\
+	rr->name = name_intern(_name);	\
 	rr->type = _type;			\
 	rr->ttl  = DEFAULT_TTL;		\
 	rr->cache_flush = 1;		\
 	rr->rr_class  = 1;
 
-struct rr_entry *rr_create_a(uint8_t *name, struct in_addr addr) {
+struct rr_entry *rr_create_a(const uint8_t *name, struct in_addr addr) {
 	DECL_MALLOC_ZERO_STRUCT(rr, rr_entry);
 	FILL_RR_ENTRY(rr, name, RR_A);
 	rr->data.A.addr = addr.s_addr;
@@ -454,7 +880,7 @@ struct rr_entry *rr_create_a(uint8_t *name, struct in_addr addr) {
 	return rr;
 }
 
-struct rr_entry *rr_create_aaaa(uint8_t *name, struct in6_addr *addr) {
+struct rr_entry *rr_create_aaaa(const uint8_t *name, struct in6_addr *addr) {
 	DECL_MALLOC_ZERO_STRUCT(rr, rr_entry);
 	FILL_RR_ENTRY(rr, name, RR_AAAA);
 	rr->data.AAAA.addr = addr;
@@ -462,16 +888,16 @@ struct rr_entry *rr_create_aaaa(uint8_t *name, struct in6_addr *addr) {
 	return rr;
 }
 
-struct rr_entry *rr_create_srv(uint8_t *name, uint16_t port, uint8_t *target) {
+struct rr_entry *rr_create_srv(const uint8_t *name, uint16_t port, const uint8_t *target) {
 	DECL_MALLOC_ZERO_STRUCT(rr, rr_entry);
 	FILL_RR_ENTRY(rr, name, RR_SRV);
 	rr->data.SRV.port = port;
-	rr->data.SRV.target = target;
+	rr->data.SRV.target = name_intern(target);
 	rr->ttl = DEFAULT_TTL_FOR_RECORD_WITH_HOSTNAME; // 120 seconds -- see RFC 6762 Section 10
 	return rr;
 }
 
-struct rr_entry *rr_create_ptr(uint8_t *name, struct rr_entry *d_rr) {
+struct rr_entry *rr_create_ptr(const uint8_t *name, struct rr_entry *d_rr) {
 	DECL_MALLOC_ZERO_STRUCT(rr, rr_entry);
 	FILL_RR_ENTRY(rr, name, RR_PTR);
 	rr->cache_flush = 0;	// PTRs shouldn't have their cache flush bit set
@@ -480,23 +906,89 @@ struct rr_entry *rr_create_ptr(uint8_t *name, struct rr_entry *d_rr) {
 	return rr;
 }
 
-struct rr_entry *rr_create(uint8_t *name, enum rr_type type) {
+struct rr_entry *rr_create(const uint8_t *name, enum rr_type type) {
 	DECL_MALLOC_ZERO_STRUCT(rr, rr_entry);
 	FILL_RR_ENTRY(rr, name, type);
 	return rr;
 }
 
+// copies a record parsed from a packet into one rr_entry_destroy() frees,
+// names are interned. Only A, AAAA, PTR, SRV and TXT can be copied
+// returns NULL for other types
+struct rr_entry *rr_entry_copy(const struct rr_entry *rr) {
+	const struct rr_data_txt *src;
+	struct rr_data_txt *dst;
+	struct rr_entry *e;
+
+	switch (rr->type) {
+		case RR_A: case RR_AAAA: case RR_PTR: case RR_SRV: case RR_TXT:
+			break;
+		default:
+			return NULL;
+	}
+
+	e = malloc(sizeof(struct rr_entry));
+	memset(e, 0, sizeof(struct rr_entry));
+	e->name = name_intern(rr->name);
+	e->type = rr->type;
+	e->ttl = rr->ttl;
+	e->cache_flush = rr->cache_flush;
+	e->rr_class = rr->rr_class;
+
+	switch (rr->type) {
+		case RR_A:
+			e->data.A = rr->data.A;
+			break;
+
+		case RR_AAAA:
+			e->data.AAAA.addr = malloc(sizeof(struct in6_addr));
+			memcpy(e->data.AAAA.addr, rr->data.AAAA.addr, sizeof(struct in6_addr));
+			break;
+
+		case RR_PTR:
+			e->data.PTR.name = name_intern(MDNS_RR_GET_PTR_NAME(rr));
+			break;
+
+		case RR_SRV:
+			e->data.SRV = rr->data.SRV;
+			e->data.SRV.target = name_intern(rr->data.SRV.target);
+			break;
+
+		default:
+			for (src = &rr->data.TXT, dst = &e->data.TXT; src; src = src->next) {
+				if (dst->txt != NULL) {
+					dst->next = malloc(sizeof(struct rr_data_txt));
+					dst = dst->next;
+					dst->next = NULL;
+				}
+				dst->txt = malloc(src->txt[0] + 2);
+				memcpy(dst->txt, src->txt, src->txt[0] + 1);
+				dst->txt[src->txt[0] + 1] = '\0';
+			}
+	}
+
+	return e;
+}
+
 void rr_set_nsec(struct rr_entry *rr_nsec, enum rr_type type) {
 	assert(rr_nsec->type == RR_NSEC);
 	assert((type / 8) < sizeof(rr_nsec->data.NSEC.bitmap));
 
-	rr_nsec->data.NSEC.bitmap[ type / 8 ] = 1 << (7 - (type % 8));
+	rr_nsec->data.NSEC.bitmap[ type / 8 ] |= 1 << (7 - (type % 8));
+
+	// wire form is now stale
+	free(rr_nsec->wire);
+	rr_nsec->wire = NULL;
 }
 
 void rr_add_txt(struct rr_entry *rr_txt, const char *txt) {
 	struct rr_data_txt *txt_rec;
 	assert(rr_txt->type == RR_TXT);
 
+	// wire form is now stale
+	free(rr_txt->wire);
+	rr_txt->wire = NULL;
+
 	txt_rec = &rr_txt->data.TXT;
 
 	// is current data filled?
@@ -516,38 +1008,300 @@ void rr_add_txt(struct rr_entry *rr_txt, const char *txt) {
 	txt_rec->next = NULL;
 }
 
-// adds a record to an rr_group
-void rr_group_add(struct rr_group **group, struct rr_entry *rr) {
-	struct rr_group *g;
+// removed groups leave a tombstone so that probing goes past them
+static struct rr_group rr_group_tomb;
 
-	assert(rr != NULL);
+// returns the slot holding the group for name or, if there is none, the
+// slot where it should be inserted. The table must have at least one slot
+static struct rr_group **rr_group_slot(struct rr_groups *groups, const uint8_t *name, uint32_t hash) {
+	struct rr_group **tomb = NULL;
+	size_t mask = groups->size - 1;
+	size_t i;
 
-	if (*group) {
-		g = rr_group_find(*group, rr->name);
-		if (g) {
-			rr_list_append(&g->rr, rr);
-			return;
+	for (i = hash & mask; ; i = (i + 1) & mask) {
+		struct rr_group **slot = groups->slots + i;
+
+		if (*slot == NULL)
+			return tomb ? tomb : slot;
+
+		if (*slot == &rr_group_tomb) {
+			if (tomb == NULL)
+				tomb = slot;
+		} else if ((*slot)->hash == hash && cmp_nlabel((*slot)->name, name) == 0) {
+			return slot;
+		}
+	}
+}
+
+// rehashes into a table sized for the live groups, dropping tombstones
+static void rr_group_resize(struct rr_groups *groups) {
+	struct rr_group **old = groups->slots;
+	size_t old_size = groups->size;
+	size_t i;
+
+	groups->size = 16;
+	while (groups->size < (groups->used + 1) * 2)
+		groups->size *= 2;
+
+	groups->slots = calloc(groups->size, sizeof(struct rr_group *));
+	groups->tombs = 0;
+
+	for (i = 0; i < old_size; i++) {
+		struct rr_group *g = old[i];
+		if (g != NULL && g != &rr_group_tomb)
+			*rr_group_slot(groups, g->name, g->hash) = g;
+	}
+
+	free(old);
+}
+
+// hashes a label into the hash of the suffix that follows it, a word at a
+// time as this runs for every question we receive
+static uint32_t name_filter_hash(uint32_t hash, const uint8_t *label) {
+	size_t len = label[0] + 1, i;
+
+	for (i = 0; i + 4 <= len; i += 4) {
+		uint32_t v;
+		memcpy(&v, label + i, 4);
+		hash = (hash ^ v) * 16777619u;
+	}
+	for (; i < len; i++)
+		hash = (hash ^ label[i]) * 16777619u;
+
+	return hash ^ (hash >> 15);
+}
+
+#define NAME_FILTER_SLOT1(h)	(((h) * 0x9E3779B1u) >> (32 - NAME_FILTER_BITS))
+#define NAME_FILTER_SLOT2(h)	(((h) * 0x85EBCA77u) >> (32 - NAME_FILTER_BITS))
+
+static void name_filter_count(uint16_t *c, int delta) {
+	// a saturated counter stays so, it can't tell how many it has seen
+	if (*c != UINT16_MAX && (delta > 0 || *c != 0))
+		*c += delta;
+}
+
+// adds (delta 1) or removes (delta -1) a name and its suffixes
+static void name_filter_update(struct rr_groups *groups, const uint8_t *name, int delta) {
+	const uint8_t *labels[MDNS_NAME_MAX / 2];
+	uint32_t hash = 2166136261u;
+	int n, i;
+
+	for (n = 0; name[0] && n < sizeof(labels) / sizeof(labels[0]); n++) {
+		labels[n] = name;
+		name += name[0] + 1;
+	}
+
+	for (i = n - 1; i >= 0; i--) {
+		hash = name_filter_hash(hash, labels[i]);
+		name_filter_count(&groups->filter[NAME_FILTER_SLOT1(hash)], delta);
+		name_filter_count(&groups->filter[NAME_FILTER_SLOT2(hash)], delta);
+	}
+}
+
+// tells if the name at off in a packet may be one we own, without decoding
+// it. There are no false negatives. Suffixes are checked from the root up,
+// so most foreign names are rejected in a label or two
+bool rr_groups_may_own(const struct rr_groups *groups, const struct mdns_pkt_view *view, size_t off) {
+	const uint8_t *labels[MDNS_NAME_MAX / 2];
+	struct name_walk w = NAME_WALK_INIT(off);
+	uint32_t hash = 2166136261u;
+	int n = 0;
+
+	while (name_walk_label(view->buf, view->len, &w)) {
+		const uint8_t *label = view->buf + w.off;
+
+		if (*label == 0) {
+			// we never own the root
+			if (n == 0)
+				return false;
+
+			while (n--) {
+				hash = name_filter_hash(hash, labels[n]);
+				if (!groups->filter[NAME_FILTER_SLOT1(hash)] || !groups->filter[NAME_FILTER_SLOT2(hash)])
+					return false;
+			}
+			return true;
 		}
+
+		if (n == sizeof(labels) / sizeof(labels[0]))
+			return false;
+
+		labels[n++] = label;
+		w.off += *label + 1;
+	}
+
+	return false;
+}
+
+// recomputes the types bitmap of a group
+static void rr_group_update_types(struct rr_group *g) {
+	struct rr_list *n;
+
+	g->types = 0;
+	for (n = g->rr; n; n = n->next)
+		g->types |= RR_TYPE_BIT(n->e->type);
+}
+
+// returns the group in slot once it belongs to this version of the table,
+// a group shared with an older version is replaced by a copy first
+static struct rr_group *rr_group_own(struct rr_groups *groups, struct rr_group **slot) {
+	struct rr_group *g = *slot, *c;
+	struct rr_list *n, **tail;
+
+	if (g->version == groups->version)
+		return g;
+
+	MALLOC_ZERO_STRUCT(c, rr_group);
+	c->name = name_ref(g->name);
+	c->hash = g->hash;
+	c->types = g->types;
+	c->version = groups->version;
+
+	for (n = g->rr, tail = &c->rr; n; n = n->next, tail = &(*tail)->next) {
+		*tail = malloc(sizeof(struct rr_list));
+		(*tail)->e = n->e;
+		(*tail)->next = NULL;
+	}
+
+	g->next = groups->retired;
+	groups->retired = g;
+
+	*slot = c;
+	return c;
+}
+
+// returns the group for name, owned by this version of the table, or NULL
+static struct rr_group *rr_group_find_own(struct rr_groups *groups, const uint8_t *name) {
+	struct rr_group **slot;
+
+	if (groups->size == 0)
+		return NULL;
+
+	slot = rr_group_slot(groups, name, name_hash(name));
+	if (*slot == NULL || *slot == &rr_group_tomb)
+		return NULL;
+
+	return rr_group_own(groups, slot);
+}
+
+// removes an owned group from the table if it has no RR left
+static void rr_group_drop_empty(struct rr_groups *groups, struct rr_group *g) {
+	struct rr_group **slot;
+
+	if (g->rr != NULL)
+		return;
+
+	slot = rr_group_slot(groups, g->name, g->hash);
+	assert(*slot == g);
+
+	*slot = &rr_group_tomb;
+	groups->used--;
+	groups->tombs++;
+
+	name_filter_update(groups, g->name, -1);
+	name_release(g->name);
+	free(g);
+}
+
+// adds a record to the rr_group of its name, creating the group if needed
+void rr_group_add(struct rr_groups *groups, struct rr_entry *rr) {
+	struct rr_group **slot, *g;
+	uint32_t hash;
+
+	assert(rr != NULL);
+
+	// keep at least 1/4 of the slots empty so that probing terminates fast
+	if ((groups->used + groups->tombs + 1) * 4 > groups->size * 3)
+		rr_group_resize(groups);
+
+	hash = name_hash(rr->name);
+	slot = rr_group_slot(groups, rr->name, hash);
+	g = *slot;
+
+	if (g == NULL || g == &rr_group_tomb) {
+		if (g == &rr_group_tomb)
+			groups->tombs--;
+
+		MALLOC_ZERO_STRUCT(g, rr_group);
+		g->name = name_ref(rr->name);
+		g->hash = hash;
+		g->version = groups->version;
+
+		*slot = g;
+		groups->used++;
+
+		name_filter_update(groups, g->name, 1);
+	} else {
+		g = rr_group_own(groups, slot);
 	}
 
-	MALLOC_ZERO_STRUCT(g, rr_group);
-	g->name = dup_nlabel(rr->name);
 	rr_list_append(&g->rr, rr);
+	g->types |= RR_TYPE_BIT(rr->type);
 
-	// prepend to list
-	g->next = *group;
-	*group = g;
+	// records are served many times, encode them once for all
+	if (rr->wire == NULL)
+		rr_wire_build(rr);
 }
 
-// finds a rr_group matching the given name
-struct rr_group *rr_group_find(struct rr_group* g, uint8_t *name) {
-	for (; g; g = g->next) {
-		if (cmp_nlabel(g->name, name) == 0)
-			return g;
+// removes a record from its rr_group, the group is dropped once empty
+// returns the record or NULL if it was not found
+struct rr_entry *rr_group_remove(struct rr_groups *groups, struct rr_entry *rr) {
+	struct rr_group *g = rr_group_find_own(groups, rr->name);
+
+	if (g == NULL || rr_list_remove(&g->rr, rr) == NULL)
+		return NULL;
+
+	rr_group_update_types(g);
+	rr_group_drop_empty(groups, g);
+
+	return rr;
+}
+
+// removes from the group of the given name the first record of that type
+// pointing to entry (only PTR are supported)
+// returns the removed record or NULL
+struct rr_entry *rr_entry_remove(struct rr_groups *groups, const uint8_t *name, struct rr_entry *entry, enum rr_type type) {
+	struct rr_group *g = rr_group_find(groups, name);
+	struct rr_list *lrr;
+
+	if (g == NULL || !(g->types & RR_TYPE_BIT(type)))
+		return NULL;
+
+	g = rr_group_find_own(groups, name);
+
+	for (lrr = g->rr; lrr; lrr = lrr->next) {
+		if (lrr->e->type != type)
+			continue;
+
+		switch (type) {
+		case RR_PTR:
+			if (lrr->e->data.PTR.entry == entry) {
+				struct rr_entry *e = lrr->e;
+				rr_list_remove(&g->rr, e);
+				rr_group_update_types(g);
+				rr_group_drop_empty(groups, g);
+				return e;
+			}
+			break;
+		default:
+			break;
+		}
 	}
+
 	return NULL;
 }
 
+// finds the rr_group matching the given name
+struct rr_group *rr_group_find(struct rr_groups *groups, const uint8_t *name) {
+	struct rr_group *g;
+
+	if (groups->size == 0)
+		return NULL;
+
+	g = *rr_group_slot(groups, name, name_hash(name));
+	return g == &rr_group_tomb ? NULL : g;
+}
+
 struct rr_entry *rr_entry_find(struct rr_list *rr_list, uint8_t *name, uint16_t type) {
 	struct rr_list *rr = rr_list;
 	for (; rr; rr = rr->next) {
@@ -574,42 +1328,344 @@ struct rr_entry *rr_entry_match(struct rr_list *rr_list, struct rr_entry *entry)
 	return NULL;
 }
 
-void rr_group_destroy(struct rr_group *group) {
-	struct rr_group *g = group;
+// hashes what tells apart the records of the same name and type that we
+// can parse, the PTR and SRV targets and addresses
+static uint32_t rr_data_hash(const struct rr_entry *rr) {
+	switch (rr->type) {
+		case RR_PTR:
+			return name_hash(MDNS_RR_GET_PTR_NAME(rr));
+
+		case RR_SRV:
+			return rr->data.SRV.target ? name_hash(rr->data.SRV.target) ^ rr->data.SRV.port : 0;
+
+		case RR_A:
+			return rr->data.A.addr;
+
+		case RR_AAAA: {
+			uint32_t hash = 2166136261u;
+			int i;
+
+			for (i = 0; rr->data.AAAA.addr && i < sizeof(struct in6_addr); i++) {
+				hash ^= rr->data.AAAA.addr->s6_addr[i];
+				hash *= 16777619u;
+			}
+			return hash;
+		}
+
+		default:
+			return 0;
+	}
+}
+
+static bool rr_data_equal(const struct rr_entry *a, const struct rr_entry *b) {
+	const struct rr_data_txt *ta, *tb;
+
+	switch (a->type) {
+		case RR_PTR:
+			return cmp_nlabel(MDNS_RR_GET_PTR_NAME(a), MDNS_RR_GET_PTR_NAME(b)) == 0;
+
+		case RR_SRV:
+			if (a->data.SRV.target == NULL || b->data.SRV.target == NULL)
+				return a->data.SRV.target == b->data.SRV.target;
+			return a->data.SRV.port == b->data.SRV.port &&
+				a->data.SRV.priority == b->data.SRV.priority &&
+				a->data.SRV.weight == b->data.SRV.weight &&
+				cmp_nlabel(a->data.SRV.target, b->data.SRV.target) == 0;
+
+		case RR_TXT:
+			for (ta = &a->data.TXT, tb = &b->data.TXT; ta && tb; ta = ta->next, tb = tb->next) {
+				if (ta->txt == NULL || tb->txt == NULL) {
+					if (ta->txt != tb->txt)
+						return false;
+				} else if (ta->txt[0] != tb->txt[0] || memcmp(ta->txt, tb->txt, ta->txt[0] + 1) != 0) {
+					return false;
+				}
+			}
+			return ta == tb;
+
+		case RR_A:
+			return a->data.A.addr == b->data.A.addr;
+
+		case RR_AAAA:
+			return a->data.AAAA.addr && b->data.AAAA.addr &&
+				memcmp(a->data.AAAA.addr, b->data.AAAA.addr, sizeof(struct in6_addr)) == 0;
+
+		default:
+			return true;
+	}
+}
+
+// tells if two records have the same name, type and data
+bool rr_entry_same(const struct rr_entry *a, const struct rr_entry *b) {
+	return a->type == b->type && cmp_nlabel(a->name, b->name) == 0 && rr_data_equal(a, b);
+}
+
+// hash of a record given the name_hash() of its name
+static uint32_t rr_hashset_hash(const struct rr_entry *rr, uint32_t hash) {
+	hash = (hash ^ rr->type) * 16777619u;
+	hash = (hash ^ rr_data_hash(rr)) * 16777619u;
+	return hash ^ (hash >> 15);
+}
+
+// indexes the count records of list in a hash set allocated from arena, so
+// that the known answers of a query are found with a single probe. Records
+// of the same name, type and data keep the highest TTL
+void rr_hashset_init(struct rr_hashset *set, struct mdns_arena *arena, struct rr_list *list, int count) {
+	size_t size = 8;
+
+	set->size = 0;
+	set->slots = NULL;
+	if (count <= 0)
+		return;
+
+	// at most half full
+	while (size < (size_t) count * 2)
+		size *= 2;
+
+	set->slots = mdns_arena_alloc(arena, size * sizeof(struct rr_hashset_slot));
+	if (set->slots == NULL)
+		return;
+	memset(set->slots, 0, size * sizeof(struct rr_hashset_slot));
+	set->size = size;
+
+	for (; list && count--; list = list->next) {
+		struct rr_entry *rr = list->e;
+		uint32_t hash = rr_hashset_hash(rr, name_hash(rr->name));
+		size_t i;
+
+		for (i = hash & (size - 1); set->slots[i].e; i = (i + 1) & (size - 1)) {
+			struct rr_entry *e = set->slots[i].e;
+			if (set->slots[i].hash == hash && e->type == rr->type &&
+					cmp_nlabel(e->name, rr->name) == 0 && rr_data_equal(e, rr))
+				break;
+		}
+
+		if (set->slots[i].e == NULL || set->slots[i].e->ttl < rr->ttl) {
+			set->slots[i].hash = hash;
+			set->slots[i].e = rr;
+		}
+	}
+}
+
+// finds the record of the set matching entry, hash is the name_hash() of
+// its name. Like rr_entry_match(), PTRs must also have the same target
+struct rr_entry *rr_hashset_match(const struct rr_hashset *set, const struct rr_entry *entry, uint32_t hash) {
+	size_t i;
+
+	if (set->size == 0)
+		return NULL;
+
+	hash = rr_hashset_hash(entry, hash);
+	for (i = hash & (set->size - 1); set->slots[i].e; i = (i + 1) & (set->size - 1)) {
+		struct rr_entry *e = set->slots[i].e;
+		if (set->slots[i].hash == hash && e->type == entry->type &&
+				cmp_nlabel(e->name, entry->name) == 0 && rr_data_equal(e, entry))
+			return e;
+	}
+
+	return NULL;
+}
+
+// finds the rr_group for the name at off in a packet, without decoding it
+struct rr_group *rr_group_find_view(struct rr_groups *groups, const struct mdns_pkt_view *view, size_t off) {
+	size_t mask = groups->size - 1;
+	uint32_t hash;
+	size_t i;
+
+	if (groups->size == 0 || !mdns_view_name_hash(view, off, &hash))
+		return NULL;
+
+	for (i = hash & mask; groups->slots[i]; i = (i + 1) & mask) {
+		struct rr_group *g = groups->slots[i];
+		if (g != &rr_group_tomb && g->hash == hash && mdns_view_cmp_name(view, off, g->name) == 0)
+			return g;
+	}
+
+	return NULL;
+}
+
+// starts a new version of a table, sharing all its groups
+struct rr_groups *rr_groups_clone(const struct rr_groups *groups) {
+	struct rr_groups *c = malloc(sizeof(struct rr_groups));
+
+	*c = *groups;
+	c->version = groups->version + 1;
+	c->retired = NULL;
+
+	if (groups->size) {
+		c->slots = malloc(groups->size * sizeof(struct rr_group *));
+		memcpy(c->slots, groups->slots, groups->size * sizeof(struct rr_group *));
+	}
+
+	return c;
+}
+
+// frees groups replaced by a newer version, but not their records
+void rr_groups_free_retired(struct rr_group *retired) {
+	while (retired) {
+		struct rr_group *next = retired->next;
+
+		name_release(retired->name);
+		rr_list_destroy(retired->rr, 0);
+		free(retired);
+
+		retired = next;
+	}
+}
+
+// destroys a table and its records, groups it retired are freed as well
+void rr_group_destroy(struct rr_groups *groups) {
+	size_t i;
+
+	for (i = 0; i < groups->size; i++) {
+		struct rr_group *g = groups->slots[i];
+		if (g == NULL || g == &rr_group_tomb)
+			continue;
+
+		name_release(g->name);
+		rr_list_destroy(g->rr, 1);
+		free(g);
+	}
+
+	rr_groups_free_retired(groups->retired);
+
+	free(groups->slots);
+	memset(groups, 0, sizeof(struct rr_groups));
+}
+
+uint8_t *mdns_write_u16(uint8_t *ptr, const uint16_t v) {
+	*ptr++ = (uint8_t) (v >> 8) & 0xFF;
+	*ptr++ = (uint8_t) (v >> 0) & 0xFF;
+	return ptr;
+}
+
+uint8_t *mdns_write_u32(uint8_t *ptr, const uint32_t v) {
+	*ptr++ = (uint8_t) (v >> 24) & 0xFF;
+	*ptr++ = (uint8_t) (v >> 16) & 0xFF;
+	*ptr++ = (uint8_t) (v >>  8) & 0xFF;
+	*ptr++ = (uint8_t) (v >>  0) & 0xFF;
+	return ptr;
+}
+
+uint16_t mdns_read_u16(const uint8_t *ptr) {
+	return  ((ptr[0] & 0xFF) << 8) | 
+			((ptr[1] & 0xFF) << 0);
+}
+
+uint32_t mdns_read_u32(const uint8_t *ptr) {
+	return  ((ptr[0] & 0xFF) << 24) | 
+			((ptr[1] & 0xFF) << 16) | 
+			((ptr[2] & 0xFF) <<  8) | 
+			((ptr[3] & 0xFF) <<  0);
+}
+
+// pre-encodes everything of a record but its name, so that the encoder just
+// has to copy it, patch the TTL and compress the name in RDATA (if any)
+// the wire form must be rebuilt if the record data changes
+void rr_wire_build(struct rr_entry *rr) {
+	struct rr_data_txt *txt_rec;
+	const uint8_t *name = NULL;
+	size_t len = 0, name_pos = 0, name_len = 0;
+	struct rr_wire *wire;
+	uint8_t *p;
+
+	// size RDATA and find the name in it
+	switch (rr->type) {
+		case RR_A:
+			len = sizeof(uint32_t);
+			break;
+
+		case RR_AAAA:
+			len = sizeof(struct in6_addr);
+			break;
+
+		case RR_PTR:
+			name = MDNS_RR_GET_PTR_NAME(rr);
+			break;
+
+		case RR_SRV:
+			name_pos = 3 * sizeof(uint16_t);
+			name = rr->data.SRV.target;
+			break;
+
+		case RR_NSEC:
+			name = rr->name;
+			len = 2 + sizeof(rr->data.NSEC.bitmap);
+			break;
+
+		case RR_TXT:
+			for (txt_rec = &rr->data.TXT; txt_rec; txt_rec = txt_rec->next)
+				len += txt_rec->txt[0] + 1;
+			break;
+
+		default:
+			// encoder will do it the slow way
+			return;
+	}
+
+	if (name)
+		name_len = strlen((char *) name) + 1;
+
+	len += name_pos + name_len;
+	if (len > 0xFFFF)
+		return;
+
+	wire = malloc(sizeof(struct rr_wire) + RR_WIRE_RDATA + len);
+	if (wire == NULL)
+		return;
+
+	wire->len = RR_WIRE_RDATA + len;
+	wire->name_pos = name_pos;
+	wire->name_len = name_len;
+
+	p = wire->data;
+	p = mdns_write_u16(p, rr->type);
+	p = mdns_write_u16(p, (rr->rr_class & ~0x8000) | (rr->cache_flush << 15));
+	p = mdns_write_u32(p, rr->ttl);
+	p = mdns_write_u16(p, len);
+
+	switch (rr->type) {
+		case RR_A:
+			/* htonl() needed coz addr already in net order */
+			mdns_write_u32(p, htonl(rr->data.A.addr));
+			break;
 
-	while (g) {
-		struct rr_group *nextg = g->next;
-		free(g->name);
-		rr_list_destroy(g->rr, 1);
-		free(g);
-		g = nextg;
-	}
-}
+		case RR_AAAA:
+			memcpy(p, rr->data.AAAA.addr->s6_addr, sizeof(struct in6_addr));
+			break;
 
-uint8_t *mdns_write_u16(uint8_t *ptr, const uint16_t v) {
-	*ptr++ = (uint8_t) (v >> 8) & 0xFF;
-	*ptr++ = (uint8_t) (v >> 0) & 0xFF;
-	return ptr;
-}
+		case RR_PTR:
+			memcpy(p, name, name_len);
+			break;
 
-uint8_t *mdns_write_u32(uint8_t *ptr, const uint32_t v) {
-	*ptr++ = (uint8_t) (v >> 24) & 0xFF;
-	*ptr++ = (uint8_t) (v >> 16) & 0xFF;
-	*ptr++ = (uint8_t) (v >>  8) & 0xFF;
-	*ptr++ = (uint8_t) (v >>  0) & 0xFF;
-	return ptr;
-}
+		case RR_SRV:
+			p = mdns_write_u16(p, rr->data.SRV.priority);
+			p = mdns_write_u16(p, rr->data.SRV.weight);
+			p = mdns_write_u16(p, rr->data.SRV.port);
+			memcpy(p, name, name_len);
+			break;
 
-uint16_t mdns_read_u16(const uint8_t *ptr) {
-	return  ((ptr[0] & 0xFF) << 8) | 
-			((ptr[1] & 0xFF) << 0);
-}
+		case RR_NSEC:
+			memcpy(p, name, name_len);
+			p += name_len;
+			*p++ = 0;	// bitmap window/block number
+			*p++ = sizeof(rr->data.NSEC.bitmap);	// bitmap length
+			memcpy(p, rr->data.NSEC.bitmap, sizeof(rr->data.NSEC.bitmap));
+			break;
 
-uint32_t mdns_read_u32(const uint8_t *ptr) {
-	return  ((ptr[0] & 0xFF) << 24) | 
-			((ptr[1] & 0xFF) << 16) | 
-			((ptr[2] & 0xFF) <<  8) | 
-			((ptr[3] & 0xFF) <<  0);
+		case RR_TXT:
+			for (txt_rec = &rr->data.TXT; txt_rec; txt_rec = txt_rec->next) {
+				memcpy(p, txt_rec->txt, txt_rec->txt[0] + 1);
+				p += txt_rec->txt[0] + 1;
+			}
+			break;
+
+		default:
+			break;
+	}
+
+	free(rr->wire);
+	rr->wire = wire;
 }
 
 // initialize the packet for reply
@@ -617,6 +1673,8 @@ uint32_t mdns_read_u32(const uint8_t *ptr) {
 void mdns_init_reply(struct mdns_pkt *pkt, uint16_t id) {
 	// broadcast by default
 	pkt->unicast = 0;
+	pkt->goodbye = 0;
+	pkt->split = 0;
 
 	// copy transaction ID
 	pkt->id = id;
@@ -624,10 +1682,13 @@ void mdns_init_reply(struct mdns_pkt *pkt, uint16_t id) {
 	// response flags
 	pkt->flags = MDNS_FLAG_RESP | MDNS_FLAG_AA;
 
-	rr_list_destroy(pkt->rr_qn,   0);
-	rr_list_destroy(pkt->rr_ans,  0);
-	rr_list_destroy(pkt->rr_auth, 0);
-	rr_list_destroy(pkt->rr_add,  0);
+	// lists from an arena are released when it is reset
+	if (pkt->arena == NULL) {
+		rr_list_destroy(pkt->rr_qn,   0);
+		rr_list_destroy(pkt->rr_ans,  0);
+		rr_list_destroy(pkt->rr_auth, 0);
+		rr_list_destroy(pkt->rr_add,  0);
+	}
 
 	pkt->rr_qn    = NULL;
 	pkt->rr_ans   = NULL;
@@ -641,11 +1702,20 @@ void mdns_init_reply(struct mdns_pkt *pkt, uint16_t id) {
 }
 
 // destroys an mdns_pkt struct, including its contents
+// nothing to do for an arena packet, it goes away with the arena reset
 void mdns_pkt_destroy(struct mdns_pkt *p) {
-	rr_list_destroy(p->rr_qn, 1);
-	rr_list_destroy(p->rr_ans, 1);
-	rr_list_destroy(p->rr_auth, 1);
-	rr_list_destroy(p->rr_add, 1);
+	struct rr_list *rr_set[] = { p->rr_qn, p->rr_ans, p->rr_auth, p->rr_add };
+	int i;
+
+	if (p->arena)
+		return;
+
+	for (i = 0; i < sizeof(rr_set) / sizeof(rr_set[0]); i++) {
+		struct rr_list *rr;
+		for (rr = rr_set[i]; rr; rr = rr->next)
+			rr_entry_destroy_parsed(rr->e);
+		rr_list_destroy(rr_set[i], 0);
+	}
 
 	free(p);
 }
@@ -658,57 +1728,85 @@ static size_t mdns_parse_qn(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 	const uint8_t *p = pkt_buf + off;
 	struct rr_entry *rr;
 	uint8_t *name;
+	size_t name_len;
    
 	assert(pkt != NULL);
 
-	rr = malloc(sizeof(struct rr_entry)); 
+	name = uncompress_nlabel(pkt->arena, pkt_buf, pkt_len, off, &name_len);
+	if (name == NULL || off + name_len + 4 > pkt_len) {
+		DEBUG_PRINTF("invalid question name or length\n");
+		if (name && pkt->arena == NULL)
+			free(name);
+		return 0;
+	}
+
+	rr = arena_alloc(pkt->arena, sizeof(struct rr_entry));
+	if (rr == NULL) {
+		if (pkt->arena == NULL)
+			free(name);
+		return 0;
+	}
 	memset(rr, 0, sizeof(struct rr_entry));
 
-	name = uncompress_nlabel(pkt_buf, pkt_len, off);
-	p += label_len(pkt_buf, pkt_len, off);
+	p += name_len;
 	rr->name = name;
 
 	rr->type = mdns_read_u16(p);
 	p += sizeof(uint16_t);
 
 	rr->unicast_query = (*p & 0x80) == 0x80;
-	rr->rr_class = mdns_read_u16(p) & ~0x80;
+	rr->rr_class = mdns_read_u16(p) & ~0x8000;
 	p += sizeof(uint16_t);
 
-	rr_list_append(&pkt->rr_qn, rr);
+	// a fresh entry is only left out if there is no memory for the node
+	if (!rr_list_append_arena(pkt->arena, &pkt->rr_qn, rr)) {
+		if (pkt->arena == NULL)
+			rr_entry_destroy_parsed(rr);
+		return 0;
+	}
 	
 	return p - (pkt_buf + off);
 }
 
-// parse the MDNS RR section
-// stores the parsed data in the given mdns_pkt struct
+// parse a MDNS RR
+// stores the parsed data in the given list of the mdns_pkt struct
 static size_t mdns_parse_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off, 
-		struct mdns_pkt *pkt) {
+		struct mdns_pkt *pkt, struct rr_list **list) {
 	const uint8_t *p = pkt_buf + off;
 	const uint8_t *e = pkt_buf + pkt_len;
 	struct rr_entry *rr;
 	uint8_t *name;
+	size_t name_len;
 	size_t rr_data_len = 0;
 	struct rr_data_txt *txt_rec;
 	int parse_error = 0;
 
 	assert(pkt != NULL);
 
-	if (off > pkt_len)
+	name = uncompress_nlabel(pkt->arena, pkt_buf, pkt_len, off, &name_len);
+	if (name == NULL || off + name_len + 10 > pkt_len) {
+		DEBUG_PRINTF("invalid RR name or length\n");
+		if (name && pkt->arena == NULL)
+			free(name);
 		return 0;
+	}
 
-	rr = malloc(sizeof(struct rr_entry)); 
+	rr = arena_alloc(pkt->arena, sizeof(struct rr_entry));
+	if (rr == NULL) {
+		if (pkt->arena == NULL)
+			free(name);
+		return 0;
+	}
 	memset(rr, 0, sizeof(struct rr_entry));
 
-	name = uncompress_nlabel(pkt_buf, pkt_len, off);
-	p += label_len(pkt_buf, pkt_len, off);
+	p += name_len;
 	rr->name = name;
 
 	rr->type = mdns_read_u16(p);
 	p += sizeof(uint16_t);
 
 	rr->cache_flush = (*p & 0x80) == 0x80;
-	rr->rr_class = mdns_read_u16(p) & ~0x80;
+	rr->rr_class = mdns_read_u16(p) & ~0x8000;
 	p += sizeof(uint16_t);
 
 	rr->ttl = mdns_read_u32(p);
@@ -720,7 +1818,8 @@ static size_t mdns_parse_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 
 	if (p + rr_data_len > e) {
 		DEBUG_PRINTF("rr_data_len goes beyond packet buffer: %zu > %zu\n", rr_data_len, e - p);
-		rr_entry_destroy(rr);
+		if (pkt->arena == NULL)
+			rr_entry_destroy_parsed(rr);
 		return 0;
 	}
 
@@ -745,7 +1844,11 @@ static size_t mdns_parse_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 				parse_error = 1;
 				break;
 			}
-			rr->data.AAAA.addr = malloc(sizeof(struct in6_addr));
+			rr->data.AAAA.addr = arena_alloc(pkt->arena, sizeof(struct in6_addr));
+			if (rr->data.AAAA.addr == NULL) {
+				parse_error = 1;
+				break;
+			}
 			for (i = 0; i < sizeof(struct in6_addr); i++)
 				rr->data.AAAA.addr->s6_addr[i] = p[i];
 			p += sizeof(struct in6_addr);
@@ -754,7 +1857,7 @@ static size_t mdns_parse_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 
 
 		case RR_PTR:
-			rr->data.PTR.name = uncompress_nlabel(pkt_buf, pkt_len, p - pkt_buf);
+			rr->data.PTR.name = uncompress_nlabel(pkt->arena, pkt_buf, e - pkt_buf, p - pkt_buf, &name_len);
 			if (rr->data.PTR.name == NULL) {
 				DEBUG_PRINTF("unable to parse/uncompress label for PTR name\n");
 				parse_error = 1;
@@ -763,31 +1866,67 @@ static size_t mdns_parse_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 			p += rr_data_len;
 			break;
 
+		case RR_SRV:
+			if (rr_data_len < 3 * sizeof(uint16_t) + 1) {
+				DEBUG_PRINTF("invalid rr_data_len=%zu for SRV record\n", rr_data_len);
+				parse_error = 1;
+				break;
+			}
+			rr->data.SRV.priority = mdns_read_u16(p);
+			rr->data.SRV.weight = mdns_read_u16(p + 2);
+			rr->data.SRV.port = mdns_read_u16(p + 4);
+			rr->data.SRV.target = uncompress_nlabel(pkt->arena, pkt_buf, e - pkt_buf, p + 6 - pkt_buf, &name_len);
+			if (rr->data.SRV.target == NULL) {
+				DEBUG_PRINTF("unable to parse/uncompress label for SRV target\n");
+				parse_error = 1;
+				break;
+			}
+			p = e;
+			break;
+
 		case RR_TXT:
 			txt_rec = &rr->data.TXT;
 
 			// not supposed to happen, but we should handle it
 			if (rr_data_len == 0) {
 				DEBUG_PRINTF("WARN: rr_data_len for TXT is 0\n");
-				txt_rec->txt = create_label("");
+				txt_rec->txt = arena_alloc(pkt->arena, 2);
+				if (txt_rec->txt == NULL) {
+					parse_error = 1;
+					break;
+				}
+				txt_rec->txt[0] = txt_rec->txt[1] = '\0';
 				break;
 			}
 
 			while (1) {
-				txt_rec->txt = copy_label(pkt_buf, pkt_len, p - pkt_buf);
+				// strings must not go past RR data
+				if (p + *p + 1 > e) {
+					DEBUG_PRINTF("TXT string exceeds RR data\n");
+					parse_error = 1;
+					break;
+				}
+
+				txt_rec->txt = arena_alloc(pkt->arena, *p + 2);
 				if (txt_rec->txt == NULL) {
-					DEBUG_PRINTF("unable to copy label for TXT record\n");
 					parse_error = 1;
 					break;
 				}
-				p += txt_rec->txt[0] + 1;
+				memcpy(txt_rec->txt, p, *p + 1);
+				txt_rec->txt[*p + 1] = '\0';
+				p += *p + 1;
 
 				if (p >= e)
 					break;
 
 				// allocate another record
-				txt_rec->next = malloc(sizeof(struct rr_data_txt));
+				txt_rec->next = arena_alloc(pkt->arena, sizeof(struct rr_data_txt));
+				if (txt_rec->next == NULL) {
+					parse_error = 1;
+					break;
+				}
 				txt_rec = txt_rec->next;
+				txt_rec->txt = NULL;
 				txt_rec->next = NULL;
 			}
 			break;
@@ -799,17 +1938,29 @@ static size_t mdns_parse_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 
 	// if there was a parse error, destroy partial rr_entry
 	if (parse_error) {
-		rr_entry_destroy(rr);
+		if (pkt->arena == NULL)
+			rr_entry_destroy_parsed(rr);
 		return 0;
 	}
 
-	rr_list_append(&pkt->rr_ans, rr);
+	// a fresh entry is only left out if there is no memory for the node
+	if (!rr_list_append_arena(pkt->arena, list, rr)) {
+		if (pkt->arena == NULL)
+			rr_entry_destroy_parsed(rr);
+		return 0;
+	}
 	
 	return p - (pkt_buf + off);
 }
 
 // parse a MDNS packet into an mdns_pkt struct
 struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len) {
+	return mdns_parse_pkt_arena(NULL, pkt_buf, pkt_len);
+}
+
+// same as mdns_parse_pkt() but everything is allocated from the arena (if
+// not NULL) so the packet is only valid until the arena is reset
+struct mdns_pkt *mdns_parse_pkt_arena(struct mdns_arena *arena, uint8_t *pkt_buf, size_t pkt_len) {
 	uint8_t *p = pkt_buf;
 	size_t off;
 	struct mdns_pkt *pkt;
@@ -818,7 +1969,11 @@ struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len) {
 	if (pkt_len < 12) 
 		return NULL;
 
-	MALLOC_ZERO_STRUCT(pkt, mdns_pkt);
+	pkt = arena_alloc(arena, sizeof(struct mdns_pkt));
+	if (pkt == NULL)
+		return NULL;
+	memset(pkt, 0, sizeof(struct mdns_pkt));
+	pkt->arena = arena;
 
 	// parse header
 	pkt->id 			= mdns_read_u16(p); p += sizeof(uint16_t);
@@ -844,7 +1999,7 @@ struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len) {
 
 	// parse answer RRs
 	for (i = 0; i < pkt->num_ans_rr; i++) {
-		size_t l = mdns_parse_rr(pkt_buf, pkt_len, off, pkt);
+		size_t l = mdns_parse_rr(pkt_buf, pkt_len, off, pkt, &pkt->rr_ans);
 		if (! l) {
 			DEBUG_PRINTF("error parsing answer #%d\n", i);
 			mdns_pkt_destroy(pkt);
@@ -854,74 +2009,407 @@ struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len) {
 		off += l;
 	}
 
-	// TODO: parse the authority and additional RR sections
+	// authority and additional RRs are only a help, keep what parses
+	for (i = 0; i < pkt->num_auth_rr; i++) {
+		size_t l = mdns_parse_rr(pkt_buf, pkt_len, off, pkt, &pkt->rr_auth);
+		if (! l)
+			break;
+		off += l;
+	}
+	if (i < pkt->num_auth_rr) {
+		DEBUG_PRINTF("error parsing authority #%d\n", i);
+		pkt->num_auth_rr = i;
+		pkt->num_add_rr = 0;
+	}
+
+	for (i = 0; i < pkt->num_add_rr; i++) {
+		size_t l = mdns_parse_rr(pkt_buf, pkt_len, off, pkt, &pkt->rr_add);
+		if (! l) {
+			DEBUG_PRINTF("error parsing additional #%d\n", i);
+			pkt->num_add_rr = i;
+			break;
+		}
+		off += l;
+	}
 
 	return pkt;
 }
 
+// ----- packet view functions -----
+
+// returns the number of bytes a name occupies at off (not following
+// pointers), 0 if it runs past the end of the packet
+static size_t view_name_len(const uint8_t *buf, size_t len, size_t off) {
+	size_t start = off;
+
+	while (off < len) {
+		if ((buf[off] & 0xC0) == 0xC0)
+			return off + 2 <= len ? off + 2 - start : 0;
+		if (buf[off] & 0xC0)
+			return 0;
+		if (buf[off] == 0)
+			return off + 1 - start;
+		off += buf[off] + 1;
+	}
+
+	return 0;
+}
+
+// reads the packet header, returns false if it is too short
+bool mdns_view_init(struct mdns_pkt_view *view, const uint8_t *pkt_buf, size_t pkt_len) {
+	memset(view, 0, sizeof(struct mdns_pkt_view));
+
+	if (pkt_len < 12)
+		return false;
+
+	view->buf = pkt_buf;
+	view->len = pkt_len;
+
+	view->id 			= mdns_read_u16(pkt_buf);
+	view->flags 		= mdns_read_u16(pkt_buf + 2);
+	view->num_qn 		= mdns_read_u16(pkt_buf + 4);
+	view->num_ans_rr 	= mdns_read_u16(pkt_buf + 6);
+	view->num_auth_rr 	= mdns_read_u16(pkt_buf + 8);
+	view->num_add_rr 	= mdns_read_u16(pkt_buf + 10);
+
+	view->off = 12;
+
+	return true;
+}
+
+// reads the next question or RR, returns false at the end of the packet
+// or if it is malformed (in which case nothing further can be read)
+bool mdns_view_next(struct mdns_pkt_view *view, struct mdns_rr_view *rr) {
+	int index = view->index;
+	size_t l, off = view->off;
+
+	if (index < view->num_qn) {
+		rr->section = MDNS_SECTION_QN;
+	} else if ((index -= view->num_qn) < view->num_ans_rr) {
+		rr->section = MDNS_SECTION_ANS;
+	} else if ((index -= view->num_ans_rr) < view->num_auth_rr) {
+		rr->section = MDNS_SECTION_AUTH;
+	} else if ((index -= view->num_auth_rr) < view->num_add_rr) {
+		rr->section = MDNS_SECTION_ADD;
+	} else {
+		return false;
+	}
+
+	l = view_name_len(view->buf, view->len, off);
+	if (l == 0 || off + l + 4 > view->len)
+		goto error;
+
+	rr->name = off;
+	off += l;
+
+	rr->type = mdns_read_u16(view->buf + off);
+	rr->flag = (view->buf[off + 2] & 0x80) == 0x80;
+	rr->rr_class = mdns_read_u16(view->buf + off + 2) & ~0x8000;
+	off += 4;
+
+	if (rr->section == MDNS_SECTION_QN) {
+		rr->ttl = 0;
+		rr->data = off;
+		rr->data_len = 0;
+	} else {
+		if (off + 6 > view->len)
+			goto error;
+
+		rr->ttl = mdns_read_u32(view->buf + off);
+		rr->data_len = mdns_read_u16(view->buf + off + 4);
+		rr->data = off + 6;
+		off = rr->data + rr->data_len;
+
+		if (off > view->len)
+			goto error;
+	}
+
+	view->off = off;
+	view->index++;
+
+	return true;
+
+error:
+	DEBUG_PRINTF("malformed record #%d\n", view->index);
+	view->index = view->num_qn + view->num_ans_rr + view->num_auth_rr + view->num_add_rr;
+	return false;
+}
+
+// compares the name at off with an uncompressed name without decoding it
+// returns 0 if they are equal
+int mdns_view_cmp_name(const struct mdns_pkt_view *view, size_t off, const uint8_t *name) {
+	struct name_walk w = NAME_WALK_INIT(off);
+
+	while (name_walk_label(view->buf, view->len, &w)) {
+		const uint8_t *label = view->buf + w.off;
+
+		if (*label != *name || memcmp(label + 1, name + 1, *name))
+			return 1;
+
+		if (*name == 0)
+			return 0;
+
+		name += *name + 1;
+		w.off += *label + 1;
+	}
+
+	return -1;
+}
+
+// hashes the name at off the same way as name_hash() hashes its decoded
+// form, returns false if the name is malformed
+bool mdns_view_name_hash(const struct mdns_pkt_view *view, size_t off, uint32_t *hash) {
+	struct name_walk w = NAME_WALK_INIT(off);
+	uint32_t h = 2166136261u;
+
+	while (name_walk_label(view->buf, view->len, &w)) {
+		const uint8_t *label = view->buf + w.off;
+		int i;
+
+		if (*label == 0) {
+			*hash = h;
+			return true;
+		}
+
+		for (i = 0; i <= *label; i++) {
+			h ^= label[i];
+			h *= 16777619u;
+		}
+
+		w.off += *label + 1;
+	}
+
+	return false;
+}
+
+#ifdef NAME_COMP_LIST
+static void comp_init(struct name_comp *comp) {
+	comp->used = 0;
+	comp->head = NULL;
+}
+
+static void comp_free(struct name_comp *comp) {
+	while (comp->head) {
+		struct name_comp_label *c = comp->head;
+		comp->head = c->next;
+		free(c);
+	}
+}
+
 // encodes a name (label) into a packet using the name compression scheme
 // encoded names will be added to the compression list for subsequent use
+// returns 0 if the name does not fit in pkt_len
 static size_t mdns_encode_name(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 		const uint8_t *name, struct name_comp *comp) {
-	struct name_comp *c, *c_tail = NULL;
+	struct name_comp_label *c;
 	uint8_t *p = pkt_buf + off;
 	size_t len = 0;
 
-	if (name) {
-		while (*name) {
+	while (name && *name) {
+		size_t segment_len = name[0] + 1, pos;
+
+		// find match for compression
+		for (c = comp->head; c; c = c->next) {
+			if (cmp_nlabel(name, c->label) == 0) {
+				if (off + len + sizeof(uint16_t) > pkt_len)
+					return 0;
+				mdns_write_u16(p, 0xC000 | c->pos);
+				return len + sizeof(uint16_t);
+			}
+		}
+
+		if (off + len + segment_len > pkt_len)
+			return 0;
+
+		// cache the name for subsequent compression
+		pos = p - pkt_buf;
+		if (pos < 0x4000 && comp->used < COMP_MAX && (c = malloc(sizeof(*c))) != NULL) {
+			c->label = name;
+			c->pos = (uint16_t) pos;
+			c->next = comp->head;
+			comp->head = c;
+			comp->used++;
+		}
+
+		// copy this segment
+		memcpy(p, name, segment_len);
+		p += segment_len;
+		len += segment_len;
+		name += segment_len;
+	}
+
+	if (off + len >= pkt_len)
+		return 0;
+
+	*p = '\0';	// root "label"
+	len += 1;
+
+	return len;
+}
+
+// forgets the suffixes encoded from pos on, which were cut off the packet
+static void comp_rollback(struct name_comp *comp, size_t pos) {
+	while (comp->head && comp->head->pos >= pos) {
+		struct name_comp_label *c = comp->head;
+		comp->head = c->next;
+		comp->used--;
+		free(c);
+	}
+}
+#else
+static void comp_init(struct name_comp *comp) {
+	comp->used = 0;
+	memset(comp->slots, 0, sizeof(comp->slots));
+}
+
+static void comp_free(struct name_comp *comp) {
+	(void) comp;
+}
+
+// encodes a name (label) into a packet using the name compression scheme
+// encoded names will be added to the compression table for subsequent use
+// returns 0 if the name does not fit in pkt_len
+static size_t mdns_encode_name(uint8_t *pkt_buf, size_t pkt_len, size_t off,
+		const uint8_t *name, struct name_comp *comp) {
+	uint8_t *p = pkt_buf + off;
+	size_t len = 0;
+
+	if (name && *name) {
+		const uint8_t *labels[MDNS_NAME_MAX / 2];
+		uint32_t hashes[MDNS_NAME_MAX / 2];
+		uint32_t hash = 2166136261u;
+		int n, i;
+
+		// hash every suffix, from the root up, so that each one is one lookup
+		// only length and edge bytes are mixed in, collisions are sorted out by
+		// comparing names so this only has to spread labels across the table
+		for (n = 0; name[0] && n < sizeof(labels) / sizeof(labels[0]); n++) {
+			labels[n] = name;
+			name += name[0] + 1;
+		}
+		for (i = n - 1; i >= 0; i--) {
+			const uint8_t *l = labels[i];
+			hash ^= l[0] | l[1] << 8 | l[l[0] - 1] << 16 | l[l[0]] << 24;
+			hash *= 16777619u;
+			hash ^= hash >> 15;
+			hashes[i] = hash;
+		}
+
+		for (i = 0; i < n; i++) {
+			struct name_comp_slot *slot;
+			size_t k = hashes[i] & (COMP_SLOTS - 1), pos;
 			int segment_len;
-			// cache the name for subsequent compression
-			DECL_STRUCT(new_c, name_comp);
 
-			// find match for compression
-			for (c = comp; c; c = c->next) {
-				if (cmp_nlabel(name, c->label) == 0) {
-					mdns_write_u16(p, 0xC000 | (c->pos & ~0xC000));
+			// longest known suffix wins
+			for (slot = comp->slots + k; slot->label; slot = comp->slots + (k = (k + 1) & (COMP_SLOTS - 1))) {
+				if (slot->hash == hashes[i] && cmp_nlabel(labels[i], slot->label) == 0) {
+					if (off + len + sizeof(uint16_t) > pkt_len)
+						return 0;
+					mdns_write_u16(p, 0xC000 | slot->pos);
 					return len + sizeof(uint16_t);
 				}
-
-				if (c->next == NULL)
-					c_tail = c;
 			}
 
-			// copy this segment
-			segment_len = *name + 1;
-			strncpy((char *) p, (char *) name, segment_len);
-			MALLOC_ZERO_STRUCT(new_c, name_comp);
+			segment_len = labels[i][0] + 1;
+			if (off + len + segment_len > pkt_len)
+				return 0;
 
-			new_c->label = (uint8_t *) name;
-			new_c->pos = p - pkt_buf;
-			c_tail->next = new_c;
+			// remember this suffix if a pointer can reach it
+			pos = p - pkt_buf;
+			if (pos < 0x4000 && comp->used < COMP_MAX) {
+				slot->label = labels[i];
+				slot->hash = hashes[i];
+				slot->pos = (uint16_t) pos;
+				comp->order[comp->used++] = (uint8_t) k;
+			}
 
-			// advance to next name segment
+			// copy this segment
+			memcpy(p, labels[i], segment_len);
 			p += segment_len;
 			len += segment_len;
-			name += segment_len;
 		}
 	}
 
+	if (off + len >= pkt_len)
+		return 0;
+
 	*p = '\0';	// root "label"
 	len += 1;
 
 	return len;
 }
 
+// forgets the suffixes encoded from pos on, which were cut off the packet
+// slots are freed in the reverse order they were filled, which leaves the
+// probe sequences of the others as they were
+static void comp_rollback(struct name_comp *comp, size_t pos) {
+	while (comp->used > 0 && comp->slots[comp->order[comp->used - 1]].pos >= pos)
+		comp->slots[comp->order[--comp->used]].label = NULL;
+}
+#endif
+
 // encodes an RR entry at the given offset
-// returns the size of the entire RR entry
+// returns the size of the entire RR entry, 0 if it does not fit in pkt_len
 static size_t mdns_encode_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off, 
-		struct rr_entry *rr, struct name_comp *comp) {
+		struct rr_entry *rr, uint32_t ttl, struct name_comp *comp) {
 	uint8_t *p = pkt_buf + off, *p_data;
+	const uint8_t *end = pkt_buf + pkt_len;
 	size_t l;
 	struct rr_data_txt *txt_rec;
 	uint8_t *label;
 	int i;
 
-	assert(off < pkt_len);
+	assert(off <= pkt_len);
+
+// fails the record unless n more bytes fit
+#define ENCODE_ROOM(n) do { if ((size_t) (end - p) < (size_t) (n)) return 0; } while (0)
+
+// encodes a name at p, failing the record if it does not fit
+#define ENCODE_NAME(name) do { \
+		l = mdns_encode_name(pkt_buf, pkt_len, p - pkt_buf, name, comp); \
+		if (l == 0) \
+			return 0; \
+		p += l; \
+	} while (0)
 
 	// name
-	l = mdns_encode_name(pkt_buf, pkt_len, off, rr->name, comp);
-	assert(l != 0);
-	p += l;
+	ENCODE_NAME(rr->name);
+
+	// pre-encoded record, only the TTL and the name in RDATA need work
+	if (rr->wire) {
+		const uint8_t *data = rr->wire->data + RR_WIRE_RDATA;
+		size_t data_len = rr->wire->len - RR_WIRE_RDATA;
+
+		ENCODE_ROOM(RR_WIRE_RDATA);
+		memcpy(p, rr->wire->data, RR_WIRE_RDATA);
+		mdns_write_u32(p + RR_WIRE_TTL, ttl);
+		p += RR_WIRE_RDATA;
+
+		if (rr->wire->name_len == 0) {
+			ENCODE_ROOM(data_len);
+			memcpy(p, data, data_len);
+			p += data_len;
+		} else {
+			size_t tail = data_len - rr->wire->name_pos - rr->wire->name_len;
+
+			p_data = p;
+			ENCODE_ROOM(rr->wire->name_pos);
+			memcpy(p, data, rr->wire->name_pos);
+			p += rr->wire->name_pos;
+			ENCODE_NAME(data + rr->wire->name_pos);
+			ENCODE_ROOM(tail);
+			memcpy(p, data + rr->wire->name_pos + rr->wire->name_len, tail);
+			p += tail;
+
+			// compression changed RDATA length
+			mdns_write_u16(p_data - sizeof(uint16_t), p - p_data);
+		}
+
+		return p - pkt_buf - off;
+	}
+
+	// type, class & cache flush, TTL and data length (filled in later)
+	ENCODE_ROOM(RR_WIRE_RDATA);
 
 	// type
 	p = mdns_write_u16(p, rr->type);
@@ -930,7 +2418,7 @@ static size_t mdns_encode_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 	p = mdns_write_u16(p, (rr->rr_class & ~0x8000) | (rr->cache_flush << 15));
 
 	// TTL
-	p = mdns_write_u32(p, rr->ttl);
+	p = mdns_write_u32(p, ttl);
 	
 	// data length (filled in later)
 	p += sizeof(uint16_t);
@@ -940,11 +2428,13 @@ static size_t mdns_encode_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 
 	switch (rr->type) {
 		case RR_A:
+			ENCODE_ROOM(sizeof(uint32_t));
 			/* htonl() needed coz addr already in net order */
 			p = mdns_write_u32(p, htonl(rr->data.A.addr));
 			break;
 
 		case RR_AAAA:
+			ENCODE_ROOM(sizeof(struct in6_addr));
 			for (i = 0; i < sizeof(struct in6_addr); i++)
 				*p++ = rr->data.AAAA.addr->s6_addr[i];
 			break;
@@ -953,32 +2443,35 @@ static size_t mdns_encode_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 			label = rr->data.PTR.name ? 
 					rr->data.PTR.name : 
 					rr->data.PTR.entry->name;
-			p += mdns_encode_name(pkt_buf, pkt_len, p - pkt_buf, label, comp);
+			ENCODE_NAME(label);
 			break;
 
 		case RR_TXT:
 			txt_rec = &rr->data.TXT;
 			for (; txt_rec; txt_rec = txt_rec->next) {
 				int len = txt_rec->txt[0] + 1;
+				ENCODE_ROOM(len);
 				strncpy((char *) p, (char *) txt_rec->txt, len);
 				p += len;
 			}
 			break;
 
 		case RR_SRV:
+			ENCODE_ROOM(3 * sizeof(uint16_t));
+
 			p = mdns_write_u16(p, rr->data.SRV.priority);
 			
 			p = mdns_write_u16(p, rr->data.SRV.weight);
 
 			p = mdns_write_u16(p, rr->data.SRV.port);
 
-			p += mdns_encode_name(pkt_buf, pkt_len, p - pkt_buf, 
-					rr->data.SRV.target, comp);
+			ENCODE_NAME(rr->data.SRV.target);
 			break;
 
 		case RR_NSEC:
-			p += mdns_encode_name(pkt_buf, pkt_len, p - pkt_buf, 
-					rr->name, comp);
+			ENCODE_NAME(rr->name);
+
+			ENCODE_ROOM(2 + sizeof(rr->data.NSEC.bitmap));
 
 			*p++ = 0;	// bitmap window/block number
 
@@ -993,6 +2486,9 @@ static size_t mdns_encode_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 			DEBUG_PRINTF("unhandled rr type 0x%02x\n", rr->type);
 	}
 
+#undef ENCODE_NAME
+#undef ENCODE_ROOM
+
 	// calculate data length based on p
 	l = p - p_data;
 
@@ -1002,70 +2498,170 @@ static size_t mdns_encode_rr(uint8_t *pkt_buf, size_t pkt_len, size_t off,
 	return p - pkt_buf - off;
 }
 
-// encodes a MDNS packet from the given mdns_pkt struct into a buffer
-// returns the size of the entire MDNS packet
+// encodes a question at the given offset
+// returns its size, 0 if it does not fit in pkt_len
+static size_t mdns_encode_qn(uint8_t *pkt_buf, size_t pkt_len, size_t off,
+		struct rr_entry *qn, struct name_comp *comp) {
+	size_t l = mdns_encode_name(pkt_buf, pkt_len, off, qn->name, comp);
+
+	if (l == 0 || off + l + 2 * sizeof(uint16_t) > pkt_len)
+		return 0;
+
+	mdns_write_u16(pkt_buf + off + l, qn->type);
+	mdns_write_u16(pkt_buf + off + l + sizeof(uint16_t),
+			(qn->rr_class & ~0x8000) | (qn->unicast_query << 15));
+
+	return l + 2 * sizeof(uint16_t);
+}
+
+// tells if rr is one of the additional records that go with owner, as
+// mdnsd looks them up: the SRV and TXT of a PTR target, the addresses and
+// TXT of a SRV, and the NSEC of an address
+static bool rr_goes_with(const struct rr_entry *owner, const struct rr_entry *rr) {
+	switch (owner->type) {
+		case RR_PTR:
+			return cmp_nlabel(MDNS_RR_GET_PTR_NAME(owner), rr->name) == 0;
+
+		case RR_SRV:
+			return cmp_nlabel(owner->data.SRV.target, rr->name) == 0 ||
+				(rr->type == RR_TXT && cmp_nlabel(owner->name, rr->name) == 0);
+
+		case RR_A:
+		case RR_AAAA:
+			return rr->type == RR_NSEC && cmp_nlabel(owner->name, rr->name) == 0;
+
+		default:
+			return false;
+	}
+}
+
+// tells if rr goes with one of the count records already in the packet,
+// or if there were too many of them to tell
+static bool rr_goes_with_any(const struct rr_entry **owners, int count, const struct rr_entry *rr) {
+	int i;
+
+	if (count > PKT_OWNERS_MAX)
+		return true;
+
+	for (i = 0; i < count; i++)
+		if (rr_goes_with(owners[i], rr))
+			return true;
+
+	return false;
+}
+
+// encodes a MDNS packet from the given mdns_pkt struct into a buffer of
+// pkt_len bytes, which is the most the packet may take on the wire.
+// Questions go first, then answers, authority and additional records in
+// the room left
+// encoded records are taken off the packet lists, what is left is for a
+// follow-up packet (questions and answers are split there in order). Once
+// answers are split, only the authority and additional records that go
+// with the records of the packet join them. A record too large for any
+// packet is dropped. A query whose known answers go on in a follow-up
+// packet has its TC bit set (RFC 6762 section 7.2)
+// returns the size of the entire MDNS packet, (size_t) -1 if nothing fit
 size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len) {
-	struct name_comp *comp;
-	uint8_t *p = pkt_buf;
-	//uint8_t *e = pkt_buf + pkt_len;
+	struct name_comp comp;
 	size_t off;
 	int i;
-	struct rr_list *rr_set[3];
+	uint16_t counts[4] = { 0, 0, 0, 0 };
+	uint16_t flags;
+	struct rr_list **rr_set[4];
+	uint16_t *rr_num[4];
+	const struct rr_entry *owners[PKT_OWNERS_MAX];
+	int num_owners = 0;
 
 	assert(answer != NULL);
-	assert(pkt_len >= 12);
 
-	if (p == NULL)
+	if (pkt_buf == NULL || pkt_len <= MDNS_HEADER_SIZE)
 		return -1;
 
-	// this is an Answer - number of qns should be zero
-	assert(answer->num_qn == 0);
+	off = MDNS_HEADER_SIZE;
 
-	p = mdns_write_u16(p, answer->id);
-	p = mdns_write_u16(p, answer->flags);
-	p = mdns_write_u16(p, answer->num_qn);
-	p = mdns_write_u16(p, answer->num_ans_rr);
-	p = mdns_write_u16(p, answer->num_auth_rr);
-	p = mdns_write_u16(p, answer->num_add_rr);
+	// empty table for name compression
+	comp_init(&comp);
 
-	off = p - pkt_buf;
+	rr_set[0] = &answer->rr_qn;
+	rr_set[1] =	&answer->rr_ans;
+	rr_set[2] = &answer->rr_auth;
+	rr_set[3] =	&answer->rr_add;
+	rr_num[0] = &answer->num_qn;
+	rr_num[1] = &answer->num_ans_rr;
+	rr_num[2] = &answer->num_auth_rr;
+	rr_num[3] = &answer->num_add_rr;
 
-	// allocate list for name compression
-	comp = malloc(sizeof(struct name_comp));
-	if (comp == NULL)
-		return -1;
-	memset(comp, 0, sizeof(struct name_comp));
+	// encode questions, answer, authority and additional RRs
+	for (i = 0; i < sizeof(rr_set) / sizeof(rr_set[0]); i++) {
+		struct rr_list **rr = rr_set[i];
 
-	// dummy entry
-	comp->label = (uint8_t *) "";
-	comp->pos = 0;
+		while (*rr) {
+			struct rr_list *n = *rr;
+			size_t l;
 
-	// skip encoding of qn
-	rr_set[0] =	answer->rr_ans;
-	rr_set[1] = answer->rr_auth;
-	rr_set[2] =	answer->rr_add;
+			// the records of answers in other packets stay out
+			if (i >= 2 && answer->split && !rr_goes_with_any(owners, num_owners, n->e)) {
+				rr = &n->next;
+				continue;
+			}
 
-	// encode answer, authority and additional RRs
-	for (i = 0; i < sizeof(rr_set) / sizeof(rr_set[0]); i++) {
-		struct rr_list *rr = rr_set[i];
-		for (; rr; rr = rr->next) {
-			size_t l = mdns_encode_rr(pkt_buf, pkt_len, off, rr->e, comp);
-			off += l;
-
-			if (off >= pkt_len) {
-				DEBUG_PRINTF("packet buffer too small\n");
-				return -1;
+			l = i == 0 ? mdns_encode_qn(pkt_buf, pkt_len, off, n->e, &comp) :
+					mdns_encode_rr(pkt_buf, pkt_len, off, n->e,
+							answer->goodbye ? 0 : n->e->ttl, &comp);
+
+			if (l == 0) {
+				comp_rollback(&comp, off);
+
+				if (off > MDNS_HEADER_SIZE) {
+					// questions and answers keep their order, the other
+					// records make way for smaller ones
+					if (i <= 1) {
+						answer->split |= i == 1;
+						break;
+					}
+					rr = &n->next;
+					continue;
+				}
+
+				DEBUG_PRINTF("record too large for a packet of %zu bytes\n", pkt_len);
+			} else {
+				off += l;
+				counts[i]++;
+
+				// one past the end when there are too many to tell
+				if (i > 0 && num_owners <= PKT_OWNERS_MAX) {
+					if (num_owners < PKT_OWNERS_MAX)
+						owners[num_owners] = n->e;
+					num_owners++;
+				}
 			}
+
+			*rr = n->next;
+			(*rr_num[i])--;
+			if (answer->arena == NULL)
+				free(n);
 		}
 
+		// answers wait for the rest of the questions
+		if (i == 0 && *rr)
+			break;
 	}
 
-	// free name compression list
-	while (comp) {
-		struct name_comp *c = comp->next;
-		free(comp);
-		comp = c;
-	}
+	comp_free(&comp);
+
+	if (off == MDNS_HEADER_SIZE)
+		return -1;
+
+	flags = answer->flags;
+	if ((flags & MDNS_FLAG_RESP) == 0 && answer->rr_ans != NULL)
+		flags |= MDNS_FLAG_TC;
+
+	pkt_buf = mdns_write_u16(pkt_buf, answer->id);
+	pkt_buf = mdns_write_u16(pkt_buf, flags);
+	pkt_buf = mdns_write_u16(pkt_buf, counts[0]);
+	pkt_buf = mdns_write_u16(pkt_buf, counts[1]);
+	pkt_buf = mdns_write_u16(pkt_buf, counts[2]);
+	pkt_buf = mdns_write_u16(pkt_buf, counts[3]);
 
 	return off;
 }
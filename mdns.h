@@ -50,6 +50,9 @@
 #define DECL_STRUCT(x, type) \
 	struct type * x;
 
+// longest uncompressed name, root label and terminator included
+#define MDNS_NAME_MAX 256
+
 #define DEFAULT_TTL_FOR_RECORD_WITH_HOSTNAME 120
 #define DEFAULT_TTL 4500
 
@@ -92,6 +95,21 @@ struct rr_data_aaaa {
 	struct in6_addr *addr;
 };
 
+// pre-encoded form of a record, see rr_wire_build()
+struct rr_wire {
+	uint16_t len;		// bytes in data
+	uint16_t name_pos;	// offset in RDATA of a name to compress
+	uint16_t name_len;	// length of that name, 0 if there is none
+
+	// type, class, TTL, RDATA length then RDATA with names uncompressed
+	uint8_t data[];
+};
+
+// offsets of the fields to patch in rr_wire.data
+#define RR_WIRE_TTL		4
+#define RR_WIRE_RDLEN	8
+#define RR_WIRE_RDATA	10
+
 typedef enum rr_type {
 	RR_A		= 0x01,
 	RR_PTR		= 0x0C,
@@ -116,6 +134,12 @@ struct rr_entry {
 
 	uint16_t rr_class;
 
+	// wire form (owned records only), NULL when not built or stale
+	struct rr_wire *wire;
+
+	// interface the record is published on, 0 for all (owned records only)
+	unsigned int ifindex;
+
 	// RR data
 	union {
 		struct rr_data_nsec NSEC;
@@ -132,14 +156,58 @@ struct rr_list {
 	struct rr_list *next;
 };
 
+// all RRs sharing the same owner name
 struct rr_group {
 	uint8_t *name;
+	uint32_t hash;		// name_hash() of name
+
+	// bitmap of the types present in rr, see RR_TYPE_BIT()
+	uint64_t types;
 
 	struct rr_list *rr;
 
-	struct rr_group *next;
+	uint32_t version;		// of the rr_groups that created it
+	struct rr_group *next;	// in rr_groups.retired
+};
+
+// counters of the owned name filter, see rr_groups_may_own()
+#define NAME_FILTER_BITS 11
+#define NAME_FILTER_SIZE (1 << NAME_FILTER_BITS)
+
+// open-addressing hash table of rr_group, keyed by owner name
+struct rr_groups {
+	struct rr_group **slots;
+	size_t size;		// number of slots, power of 2 (or 0)
+	size_t used;		// slots holding a group
+	size_t tombs;		// slots of removed groups
+
+	// groups created by an older version are shared with it, so they are
+	// copied before being modified and the originals are kept in retired
+	// until nobody can see that older version anymore
+	uint32_t version;
+	struct rr_group *retired;
+
+	// counting Bloom filter of the group names and all their suffixes
+	uint16_t filter[NAME_FILTER_SIZE];
+};
+
+// bit of a type in rr_group.types, RR_ANY matches every type
+#define RR_TYPE_BIT(t)	((t) == RR_ANY ? ~(uint64_t) 0 : \
+						 (t) < 64 ? (uint64_t) 1 << (t) : 0)
+
+// hash set of records keyed by name, type and data, see rr_hashset_init()
+struct rr_hashset_slot {
+	uint32_t hash;
+	struct rr_entry *e;
+};
+
+struct rr_hashset {
+	struct rr_hashset_slot *slots;
+	size_t size;		// number of slots, power of 2 (or 0)
 };
 
+#define MDNS_HEADER_SIZE 12	// id, flags and the four section counts
+
 #define MDNS_FLAG_RESP 	(1 << 15)	// Query=0 / Response=1
 #define MDNS_FLAG_AA	(1 << 10)	// Authoritative
 #define MDNS_FLAG_TC	(1 <<  9)	// TrunCation
@@ -153,7 +221,56 @@ struct rr_group {
 // gets the PTR target name, either from "name" member or "entry" member
 #define MDNS_RR_GET_PTR_NAME(rr)  (rr->data.PTR.name != NULL ? rr->data.PTR.name : rr->data.PTR.entry->name)
 
+// bump allocator for short-lived packets, everything allocated from it is
+// released at once by mdns_arena_reset()
+struct mdns_arena {
+	uint8_t *base;
+	size_t size;
+	size_t used;
+
+	// allocations that did not fit in base since the last reset
+	size_t spill;
+	struct mdns_arena_block *blocks;
+};
+
+// timer armed in a mdns_timers heap, deadlines are in ms of mdns_time_ms()
+struct mdns_timer {
+	uint64_t deadline;
+	void (*cb)(void *arg);
+	void *arg;
+	size_t slot;	// position in the heap + 1, 0 when not armed
+};
+
+// min-heap of armed timers, earliest deadline first
+struct mdns_timers {
+	struct mdns_timer **heap;
+	size_t count;
+	size_t size;
+};
+
+#define MDNS_WHEEL_SLOTS 512	// power of 2
+#define MDNS_WHEEL_TICK 10		// ms per slot
+
+// entry of a mdns_wheel, embedded in what it schedules
+struct mdns_wheel_node {
+	struct mdns_wheel_node *prev;	// NULL when not in a wheel
+	struct mdns_wheel_node *next;
+	uint64_t tick;
+};
+
+// hashed timer wheel, O(1) insert and cancel. Deadlines more than
+// MDNS_WHEEL_SLOTS ticks ahead wait in an overflow list, which is moved
+// into the slots once per turn of the wheel
+struct mdns_wheel {
+	struct mdns_wheel_node slots[MDNS_WHEEL_SLOTS];	// list heads
+	struct mdns_wheel_node overflow;	// list head
+	uint64_t cursor;	// first tick not expired yet
+	size_t count;
+};
+
 struct mdns_pkt {
+	struct mdns_arena *arena;	// NULL if records and lists are on the heap
+
 	uint16_t id;	// transaction ID
 	uint16_t flags;
 	uint16_t num_qn;
@@ -162,6 +279,8 @@ struct mdns_pkt {
 	uint16_t num_add_rr;
 
 	char unicast;
+	char goodbye;		// records are encoded with a zero TTL
+	char split;			// answers went over several packets, see mdns_encode_pkt()
 
 	struct rr_list *rr_qn;		// questions
 	struct rr_list *rr_ans;		// answer RRs
@@ -169,35 +288,108 @@ struct mdns_pkt {
 	struct rr_list *rr_add;		// additional RRs
 };
 
+// read-only view over a received packet, nothing is copied and records
+// are decoded one at a time by mdns_view_next()
+struct mdns_pkt_view {
+	const uint8_t *buf;
+	size_t len;
+
+	uint16_t id;
+	uint16_t flags;
+	uint16_t num_qn;
+	uint16_t num_ans_rr;
+	uint16_t num_auth_rr;
+	uint16_t num_add_rr;
+
+	size_t off;		// offset of the next record
+	int index;		// records already read (questions included)
+};
+
+enum mdns_section {
+	MDNS_SECTION_QN,
+	MDNS_SECTION_ANS,
+	MDNS_SECTION_AUTH,
+	MDNS_SECTION_ADD,
+};
+
+// a question or RR as it lies in the packet
+struct mdns_rr_view {
+	enum mdns_section section;
+
+	size_t name;		// offset of the (possibly compressed) name
+	uint16_t type;
+	uint16_t rr_class;
+	bool flag;			// unicast response for questions, cache flush for RRs
+
+	// RRs only
+	uint32_t ttl;
+	size_t data;		// offset of RDATA
+	uint16_t data_len;
+};
+
 void mdnsd_log(bool force, char* fmt, ...);
 
+void mdns_arena_init(struct mdns_arena *arena, size_t size);
+void *mdns_arena_alloc(struct mdns_arena *arena, size_t len);
+void mdns_arena_reset(struct mdns_arena *arena);
+void mdns_arena_free(struct mdns_arena *arena);
+
+uint64_t mdns_time_ms(void);
+void mdns_timer_arm(struct mdns_timers *timers, struct mdns_timer *t, uint64_t deadline);
+void mdns_timer_cancel(struct mdns_timers *timers, struct mdns_timer *t);
+int mdns_timers_run(struct mdns_timers *timers, uint64_t now);
+void mdns_timers_free(struct mdns_timers *timers);
+void mdns_wheel_init(struct mdns_wheel *wheel, uint64_t now);
+void mdns_wheel_insert(struct mdns_wheel *wheel, struct mdns_wheel_node *node, uint64_t now, uint64_t deadline);
+void mdns_wheel_cancel(struct mdns_wheel *wheel, struct mdns_wheel_node *node);
+struct mdns_wheel_node *mdns_wheel_pop(struct mdns_wheel *wheel, uint64_t now);
+int mdns_wheel_next(const struct mdns_wheel *wheel, uint64_t now);
+
+size_t mdns_decode_name(const uint8_t *pkt_buf, size_t pkt_len, size_t off, uint8_t name[MDNS_NAME_MAX]);
 struct mdns_pkt *mdns_parse_pkt(uint8_t *pkt_buf, size_t pkt_len);
+struct mdns_pkt *mdns_parse_pkt_arena(struct mdns_arena *arena, uint8_t *pkt_buf, size_t pkt_len);
+
+bool mdns_view_init(struct mdns_pkt_view *view, const uint8_t *pkt_buf, size_t pkt_len);
+bool mdns_view_next(struct mdns_pkt_view *view, struct mdns_rr_view *rr);
+int mdns_view_cmp_name(const struct mdns_pkt_view *view, size_t off, const uint8_t *name);
+bool mdns_view_name_hash(const struct mdns_pkt_view *view, size_t off, uint32_t *hash);
 
 void mdns_init_reply(struct mdns_pkt *pkt, uint16_t id);
 size_t mdns_encode_pkt(struct mdns_pkt *answer, uint8_t *pkt_buf, size_t pkt_len);
 
 void mdns_pkt_destroy(struct mdns_pkt *p);
-void rr_group_destroy(struct rr_group *group);
-struct rr_group *rr_group_find(struct rr_group *g, uint8_t *name);
+void rr_group_destroy(struct rr_groups *groups);
+struct rr_groups *rr_groups_clone(const struct rr_groups *groups);
+void rr_groups_free_retired(struct rr_group *retired);
+struct rr_group *rr_group_find(struct rr_groups *groups, const uint8_t *name);
+struct rr_group *rr_group_find_view(struct rr_groups *groups, const struct mdns_pkt_view *view, size_t off);
+bool rr_groups_may_own(const struct rr_groups *groups, const struct mdns_pkt_view *view, size_t off);
 struct rr_entry *rr_entry_find(struct rr_list *rr_list, uint8_t *name, uint16_t type);
 struct rr_entry *rr_entry_match(struct rr_list *rr_list, struct rr_entry *entry);
+bool rr_entry_same(const struct rr_entry *a, const struct rr_entry *b);
+void rr_hashset_init(struct rr_hashset *set, struct mdns_arena *arena, struct rr_list *list, int count);
+struct rr_entry *rr_hashset_match(const struct rr_hashset *set, const struct rr_entry *entry, uint32_t hash);
+struct rr_entry *rr_entry_copy(const struct rr_entry *rr);
 void rr_entry_destroy(struct rr_entry *rr);
-struct rr_entry *rr_entry_remove(struct rr_group *group, struct rr_entry *entry, enum rr_type type);
-void rr_group_add(struct rr_group **group, struct rr_entry *rr);
-void rr_group_clean(struct rr_group **head);
+struct rr_entry *rr_entry_remove(struct rr_groups *groups, const uint8_t *name, struct rr_entry *entry, enum rr_type type);
+void rr_group_add(struct rr_groups *groups, struct rr_entry *rr);
+struct rr_entry *rr_group_remove(struct rr_groups *groups, struct rr_entry *rr);
 
 int rr_list_count(struct rr_list *rr);
 int rr_list_append(struct rr_list **rr_head, struct rr_entry *rr);
+int rr_list_append_arena(struct mdns_arena *arena, struct rr_list **rr_head, struct rr_entry *rr);
 struct rr_entry *rr_list_remove(struct rr_list **rr_head, struct rr_entry *rr);
 void rr_list_destroy(struct rr_list *rr, char destroy_items);
 
-struct rr_entry *rr_create_ptr(uint8_t *name, struct rr_entry *d_rr);
-struct rr_entry *rr_create_srv(uint8_t *name, uint16_t port, uint8_t *target);
-struct rr_entry *rr_create_aaaa(uint8_t *name, struct in6_addr *addr);
-struct rr_entry *rr_create_a(uint8_t *name, struct in_addr addr);
-struct rr_entry *rr_create(uint8_t *name, enum rr_type type);
+// names given to rr_create*() are interned, the caller keeps its copy
+struct rr_entry *rr_create_ptr(const uint8_t *name, struct rr_entry *d_rr);
+struct rr_entry *rr_create_srv(const uint8_t *name, uint16_t port, const uint8_t *target);
+struct rr_entry *rr_create_aaaa(const uint8_t *name, struct in6_addr *addr);
+struct rr_entry *rr_create_a(const uint8_t *name, struct in_addr addr);
+struct rr_entry *rr_create(const uint8_t *name, enum rr_type type);
 void rr_set_nsec(struct rr_entry *rr_nsec, enum rr_type type);
 void rr_add_txt(struct rr_entry *rr_txt, const char *txt);
+void rr_wire_build(struct rr_entry *rr);
 
 const char *rr_get_type_name(enum rr_type type);
 
@@ -207,10 +399,14 @@ char *nlabel_to_str(const uint8_t *name);
 uint8_t *dup_label(const uint8_t *label);
 uint8_t *dup_nlabel(const uint8_t *n);
 uint8_t *join_nlabel(const uint8_t *n1, const uint8_t *n2);
+uint32_t name_hash(const uint8_t *name);
+uint8_t *name_intern(const uint8_t *name);
+uint8_t *name_ref(uint8_t *name);
+void name_release(uint8_t *name);
 
-// compares 2 names
+// compares 2 names, interned names are equal only if they are the same
 static inline int cmp_nlabel(const uint8_t *L1, const uint8_t *L2) {
-	return strcmp((char *) L1, (char *) L2);
+	return L1 == L2 ? 0 : strcmp((char *) L1, (char *) L2);
 }
 
 #endif /*!__MDNS_H__*/
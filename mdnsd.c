@@ -26,9 +26,15 @@
  * THIS SOFTWARE, EVEN IF ADVISED OF THE POSSIBILITY OF SUCH DAMAGE.
  */
 
+#if defined(__linux__) && !defined(_GNU_SOURCE)
+#define _GNU_SOURCE		// recvmmsg() and sendmmsg()
+#endif
+
 #ifdef _WIN32
 #include <winsock2.h>
 #include <ws2tcpip.h>
+#include <iphlpapi.h>
+#pragma comment(lib, "IPHLPAPI.lib")
 #define LOG_ERR		3
 #else
 #include <sys/select.h>
@@ -37,9 +43,18 @@
 #include <netinet/in.h>
 #include <arpa/inet.h>
 #include <net/if.h>
+#include <ifaddrs.h>
 #include <syslog.h>
 #endif
 
+// on Linux, wait with epoll and wake up the loop with an eventfd, unless
+// NO_EPOLL is defined, other platforms use select() and a pipe
+#if defined(__linux__) && !defined(NO_EPOLL)
+#define USE_EPOLL
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#endif
+
 #include <sys/types.h>
 #include <sys/stat.h>
 #include <fcntl.h>
@@ -72,34 +87,368 @@
 #endif
 
 #define MDNS_ADDR "224.0.0.251"
+#define MDNS_ADDR6 "ff02::fb"
 #define MDNS_PORT 5353
 
+// also answer on ff02::fb, from the same workers and store, unless NO_IPV6
+// is defined
+#if !defined(_WIN32) && defined(IPV6_JOIN_GROUP) && defined(IPV6_RECVPKTINFO) && !defined(NO_IPV6)
+#define USE_IPV6
+#endif
+
 #define PACKET_SIZE 65536
+#define ARENA_SIZE (16 * 1024)
+
+// packets are kept within the MTU of the interface, less the IP and UDP
+// headers, as fragmented multicast is lost on many networks. The same
+// packets go to both groups, so the IPv6 headers count once its socket is
+// open
+#define MTU_DEFAULT 1500
+#define MTU_MIN 576
+#define MTU_MAX (9000 + UDP_OVERHEAD)	// largest mDNS message (RFC 6762 section 17)
+#define UDP_OVERHEAD 28
+#define UDP6_OVERHEAD 48
+
+// answers with shared records are delayed by 20-120 ms to be aggregated, and
+// no record is multicast again within a second (RFC 6762 section 6)
+#define AGGR_DELAY_MIN 20
+#define AGGR_DELAY_MAX 120
+#define AGGR_MAX 64
+#define MULTICAST_INTERVAL 1000
+#define STAMP_SLOTS 512		// records a worker remembers multicasting, a power of 2
+
+// queries with the TC bit set are answered when their last known-answer
+// packet arrives, or after 400-500 ms (RFC 6762 section 7.2)
+#define TC_DELAY_MIN 400
+#define TC_DELAY_MAX 500
+#define TC_MAX 16		// sources followed at once by a worker
+#define TC_PKTS 8		// packets kept per source
+
+// services are announced ANNOUNCE_COUNT times, one second apart and then
+// twice as long each time (RFC 6762 section 8.3). Announces and goodbyes
+// that are due together share packets of up to ANNOUNCE_PKT_SIZE bytes, at
+// most ANNOUNCE_BURST of them go out per tick of the wheel to pace large
+// registrations
+#define ANNOUNCE_COUNT 3
+#define ANNOUNCE_INTERVAL 1000
+#define ANNOUNCE_BURST 4
+#define ANNOUNCE_PKT_SIZE 1450
+
+// the goodbyes sent when the responder stops may take that many ms at most
+#define GOODBYE_TIMEOUT 250
+
+// browsed types are first queried after 20-120 ms, then one second later
+// and twice as long each time up to an hour (RFC 6762 section 5.2). The
+// instances are queried for again once 80% of their TTL went by
+#define QUERY_DELAY_MIN 20
+#define QUERY_DELAY_MAX 120
+#define QUERY_INTERVAL_MIN 1000
+#define QUERY_INTERVAL_MAX (60 * 60 * 1000)
+#define QUERY_REFRESH 80
+#define QUERY_PKTS 16	// packets of a query and its known answers at most
+
+// records learnt from responses, the least recently used ones make room
+// past CACHE_MAX (or what mdnsd_cache_responses() sets). Expired ones are
+// looked for every CACHE_SWEEP ms. Records flushed by a newer one or said
+// goodbye to are kept for one more second (RFC 6762 sections 10.1 and 10.2)
+#define CACHE_MAX 4096
+#define CACHE_SWEEP 1000
+#define CACHE_GRACE 1000
+
+// interfaces a responder answers on, see mdnsd_add_interface()
+#define IFACE_MAX 16
+
+// announces are packed by their uncompressed size, within the MTU
+#define announce_max(svr) ((svr)->pkt_max < ANNOUNCE_PKT_SIZE ? (svr)->pkt_max : ANNOUNCE_PKT_SIZE)
+
+// on Linux, drain up to BATCH_SIZE datagrams per wakeup and send all the
+// replies with a single system call, unless NO_BATCH_IO is defined
+#if defined(__linux__) && defined(MSG_WAITFORONE) && !defined(NO_BATCH_IO)
+#define BATCH_IO
+#define BATCH_SIZE 16
+#define BATCH_PKT_SIZE 9000		// largest mDNS message (RFC 6762 section 17)
+#endif
+
+// several workers need SO_REUSEPORT so that they all get the multicast
+// queries, and IP_PKTINFO to tell those from unicast ones
+#if !defined(_WIN32) && defined(SO_REUSEPORT) && defined(IP_PKTINFO)
+#define MAX_WORKERS 64
+#else
+#define MAX_WORKERS 1
+#endif
+
+// the kernel copies a multicast datagram to every socket bound to the port
+// that is in the group, so workers which all joined it would each wake up
+// and read every query to answer a share of them. Where sockets can stay
+// out of the groups they did not join, only worker 0 joins and hands the
+// multicast packets to the worker they hash to, see handoff_push(). Unicast
+// ones are spread over the workers by SO_REUSEPORT either way
+#if defined(BATCH_IO) && defined(IP_MULTICAST_ALL) && (!defined(USE_IPV6) || defined(IPV6_MULTICAST_ALL))
+#define HANDOFF
+#define HANDOFF_SLOTS 256		// per worker, power of 2
+#define HANDOFF_PKT_SIZE 1500	// larger packets are answered by worker 0
+#define group_members(svr) 1
+#else
+#define group_members(svr) ((svr)->num_workers)
+#endif
 
 #define SERVICES_DNS_SD_NLABEL \
 		((uint8_t *) "\x09_services\x07_dns-sd\x04_udp\x05local")
 
 #define log_message(l,f,...) mdnsd_log(true, f, ##__VA_ARGS__)
 
+// ordered loads and stores for what workers read without data_lock, there
+// is never a need for an atomic read-modify-write
+#if defined(__GNUC__) || defined(__clang__)
+#define load_acquire(p)		__atomic_load_n(p, __ATOMIC_ACQUIRE)
+#define load_relaxed(p)		__atomic_load_n(p, __ATOMIC_RELAXED)
+#define store_release(p, v)	__atomic_store_n(p, v, __ATOMIC_RELEASE)
+#define store_relaxed(p, v)	__atomic_store_n(p, v, __ATOMIC_RELAXED)
+#define full_fence()		__atomic_thread_fence(__ATOMIC_SEQ_CST)
+#elif defined(_MSC_VER)
+// x86/x64, where volatile accesses are acquire/release with /volatile:ms,
+// the default there. Elsewhere they are not ordered at all
+#if !defined(_M_IX86) && !defined(_M_X64)
+#error MSVC builds need x86 or x64
+#endif
+#define load_acquire(p)		(*(p))
+#define load_relaxed(p)		(*(p))
+#define store_release(p, v)	(*(p) = (v))
+#define store_relaxed(p, v)	(*(p) = (v))
+#define full_fence()		MemoryBarrier()
+#endif
+
+// what writers took out of the store, freed once no worker can see it
+struct retired {
+	struct retired *next;
+	size_t epoch;				// global epoch when it was retired
+	struct rr_groups *store;	// a previous version, without its groups
+	struct rr_group *groups;	// groups replaced by the next version
+	struct rr_list *entries;	// records removed from the store
+};
+
+// source or destination of a datagram, of either family
+union sockaddr_any {
+	struct sockaddr sa;
+	struct sockaddr_in v4;
+#ifdef USE_IPV6
+	struct sockaddr_in6 v6;
+#endif
+};
+
+// a service as seen by the announcer, scheduled in svr->wheel while it has
+// announces or its goodbye to send. The responder owns it, so that it can
+// outlive mdns_service_destroy()
+struct announce {
+	struct mdns_wheel_node node;	// first, the wheel gives it back
+	struct announce *prev;
+	struct announce *next;
+	struct rr_entry *ptr;		// PTR of the service type
+	struct rr_entry *bptr;		// its services PTR, until the goodbye
+	int sent;					// announces sent so far
+	bool leave;
+};
+
+// a record learnt from a response, see cache_add()
+struct cache_entry {
+	struct cache_entry *next;	// in its bucket
+	struct cache_entry *lru_prev;	// more recently used
+	struct cache_entry *lru_next;	// less recently used
+	struct rr_entry *rr;		// copy, see rr_entry_copy()
+	uint32_t hash;				// cache_hash() of its name and type
+	uint64_t recv_ms;			// last time it was received
+	uint64_t expire_ms;			// when its TTL runs out
+	bool refreshed;				// queried for again, see QUERY_REFRESH
+};
+
+// hash table of cache_entry by name and type, bounded by LRU eviction
+struct rr_cache {
+	struct cache_entry **buckets;
+	size_t size;		// number of buckets, power of 2 (or 0)
+	size_t count;
+	size_t max;			// records kept at most
+	struct cache_entry *lru_head;	// most recently used
+	struct cache_entry *lru_tail;	// next to be evicted
+	uint64_t sweep_ms;	// next look for expired records, see cache_expire()
+};
+
+// a service type browsed by the application, queried by worker 0 as long
+// as it has browses
+struct browse_query {
+	struct browse_query *next;
+	uint8_t *type;			// interned
+	uint64_t next_ms;		// of the next query
+	uint32_t interval;		// ms from it to the one after, 0 until scheduled
+	bool refresh;			// an instance is due to be queried for again
+	struct mdns_browse *browses;
+};
+
+struct mdns_browse {
+	struct mdns_browse *next;	// of the same query
+	struct browse_query *query;
+	mdns_browse_cb cb;
+	void *arg;
+};
+
+// an interface the responder joined the group on
+struct mdnsd_iface {
+	struct in_addr addr;
+	unsigned int ifindex;	// 0 if unknown, the system picks
+};
+
 struct mdnsd {
 #ifdef USE_WIN32_THREAD
 	HANDLE data_lock;
 #else
 	pthread_mutex_t data_lock;
 #endif
+	int stop_flag;		// read by the workers, see workers_stop()
+	bool running;		// workers are started, under data_lock
+
+	// the first one is the host the responder was started with, others are
+	// only appended, under data_lock
+	struct mdnsd_iface ifaces[IFACE_MAX];
+	volatile int num_ifaces;
+	size_t mtu;					// smallest of the interfaces, under data_lock
+	volatile size_t pkt_max;	// largest packet sent, see packet_max_update()
+
+	struct mdnsd_worker *workers;
+	int num_workers;
+
+	// records are read by workers without data_lock: writers publish a new
+	// version of the store and retire what it replaced, which is freed once
+	// every worker has left the epoch it was retired in
+	struct rr_groups *volatile store;
+	volatile size_t epoch;
+	struct retired *retired;
+
+	// announces and goodbyes, sent by worker 0
+	struct mdns_wheel wheel;
+	struct announce *services;	// registered
+	struct announce *leaving;	// removed, goodbye not sent yet
+
+	uint8_t *hostname;
+
+	// records learnt from responses and the browsed types, under
+	// cache_lock. Responses are only parsed while caching is set
+#ifdef USE_WIN32_THREAD
+	HANDLE cache_lock;
+#else
+	pthread_mutex_t cache_lock;
+#endif
+	struct rr_cache cache;
+	struct browse_query *queries;
+	bool passive;		// every response is cached, see mdnsd_cache_responses()
+	volatile bool caching;
+};
+
+// counters of a worker, see mdnsd_stats. They are word sized so that
+// mdnsd_get_stats() reads them without 8-byte atomics on 32-bit targets
+struct worker_stats {
+	size_t rx_packets;
+	size_t rx_batches;
+	size_t tx_packets;
+	size_t tx_batches;
+	size_t tx_unicast;
+	size_t tx_multicast;
+	size_t filter_hits;
+	size_t filter_misses;
+};
+
+// a query whose known answers span several packets, kept until the last one
+struct tc_query {
+	struct mdnsd_worker *w;
+	struct mdns_timer timer;
+	union sockaddr_any from;
+	unsigned int ifindex;	// it came in from, see iface_scope()
+	int count;		// packets received, 0 if the slot is free
+	uint8_t *pkts[TC_PKTS];
+	size_t lens[TC_PKTS];
+};
+
+// the last time a worker multicast a record. The table is indexed by the
+// address of the record and a newer one takes the slot, records are never
+// dereferenced so a stamp may outlive its record
+struct multicast_stamp {
+	const struct rr_entry *e;
+	uint64_t ms;
+	unsigned int ifindex;	// it was multicast on, 0 for all
+};
+
+#ifdef HANDOFF
+// a multicast packet worker 0 received for another worker
+struct handoff {
+	uint8_t pkt[HANDOFF_PKT_SIZE];
+	size_t len;
+	union sockaddr_any from;
+	unsigned int ifindex;	// it came in from, see iface_scope()
+};
+#endif
+
+// every worker runs main_loop() on its own socket and answers the multicast
+// queries that hash to it, see pkt_owner(). The first group_members() get
+// them from the kernel, the others from worker 0
+// worker 0 also sends the announces and goodbyes
+struct mdnsd_worker {
+	struct mdnsd *svr;
+	int id;
 	int sockfd;
+	int sockfd6;	// -1 without IPv6
+#ifdef USE_EPOLL
+	int epoll_fd;
+	int event_fd;
+#else
 	int notify_pipe[2];
-	int stop_flag;
+#endif
+#ifdef USE_WIN32_THREAD
+	HANDLE thread;
+#else
+	pthread_t thread;
+#endif
 
-	struct rr_group *group;
-	struct rr_list *announce;
-	struct rr_list *services;
-	struct rr_list *leave;
-	uint8_t *hostname;
+	// epoch of the store the worker is reading, 0 when it is not
+	volatile size_t epoch;
+
+	// only written by the worker thread, no lock needed
+	struct mdns_timers timers;
+	struct worker_stats stats;
+
+	// shared answers waiting to be multicast together, see aggregate()
+	struct mdns_timer aggr_timer;
+	struct mdns_timer announce_timer;	// worker 0, next tick of svr->wheel
+	struct mdns_timer query_timer;		// worker 0, next query or cache sweep
+	struct rr_entry *aggr[AGGR_MAX];
+	int aggr_count;
+	int aggr_family;	// of the queries, AF_UNSPEC if both
+	unsigned int aggr_ifindex;	// interface of the queries
+	uint32_t rand_state;
+
+	struct tc_query tc[TC_MAX];
+
+	// when records were last multicast by family, see multicast_recently()
+	struct multicast_stamp stamps[2][STAMP_SLOTS];
+
+#ifdef HANDOFF
+	// ring of packets from worker 0, which fills it at head while the
+	// worker empties it at tail. NULL for worker 0
+	struct handoff *handoffs;
+	volatile size_t handoff_head;
+	volatile size_t handoff_tail __attribute__((aligned(64)));
+	uint64_t handoff_wake;	// worker 0, workers to wake up after a batch
+#endif
+
+	// scratch space of main_loop(), for the timer callbacks
+	struct mdns_arena *arena;
+	struct mdns_pkt *reply;
+	uint8_t *pkt_buffer;
 };
 
+// adds to a counter that only its worker writes
+#define stats_add(w, counter, n) store_relaxed(&(w)->stats.counter, (w)->stats.counter + (n))
+
 struct mdns_service {
 	struct rr_list *entries;
+	struct announce *announce;
 };
 
 static bool log_verbose;
@@ -108,23 +457,26 @@ static bool log_verbose;
 
 void mdnsd_log(bool force, char* fmt, ...) {
 	if (force || log_verbose) {
-		va_list ap;
+		va_list ap, ap2;
 		va_start(ap, fmt);
+		va_copy(ap2, ap);
 	
 		int size = vsnprintf(NULL, 0, fmt, ap);
 
 		if (size > 0) {
 			char* buf = malloc(size + 1);
-			vsprintf(buf, fmt, ap);
+			vsprintf(buf, fmt, ap2);
 			fprintf(stderr, "%s", buf);
 			free(buf);
 		}
 
+		va_end(ap2);
 		va_end(ap);
 	}
 }
 
-static int create_recv_sock(uint32_t host) {
+// a socket that does not join the group gets no multicast packets at all
+static int create_recv_sock(uint32_t host, bool join) {
 	int sd = socket(AF_INET, SOCK_DGRAM, 0);
 	int r = -1;
 	int on = 1;
@@ -178,11 +530,19 @@ static int create_recv_sock(uint32_t host) {
 
 	// add membership to receiving socket
 	mreq.imr_multiaddr.s_addr = inet_addr(MDNS_ADDR);
-	if ((r = setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *) &mreq, sizeof(mreq))) < 0) {
+	if (join && (r = setsockopt(sd, IPPROTO_IP, IP_ADD_MEMBERSHIP, (char *) &mreq, sizeof(mreq))) < 0) {
 		log_message(LOG_ERR, "recv setsockopt(IP_ADD_MEMBERSHIP): %m\n");
 		return r;
 	}
 
+#ifdef HANDOFF
+	on = 0;
+	if (!join && (r = setsockopt(sd, IPPROTO_IP, IP_MULTICAST_ALL, (char *) &on, sizeof(on))) < 0) {
+		log_message(LOG_ERR, "recv setsockopt(IP_MULTICAST_ALL): %m\n");
+		return r;
+	}
+#endif
+
 	// enable loopback in case someone else needs the data
 	if ((r = setsockopt(sd, IPPROTO_IP, IP_MULTICAST_LOOP, (char *) &onChar, sizeof(onChar))) < 0) {
 		log_message(LOG_ERR, "recv setsockopt(IP_MULTICAST_LOOP): %m\n");
@@ -201,33 +561,481 @@ static int create_recv_sock(uint32_t host) {
 	return sd;
 }
 
-static ssize_t send_packet(int fd, const void *data, size_t len) {
-	static struct sockaddr_in toaddr;
-	if (toaddr.sin_family != AF_INET) {
-		memset(&toaddr, 0, sizeof(struct sockaddr_in));
-		toaddr.sin_family = AF_INET;
-		toaddr.sin_port = htons(MDNS_PORT);
-		toaddr.sin_addr.s_addr = inet_addr(MDNS_ADDR);
+#ifdef USE_IPV6
+// same as create_recv_sock() for ff02::fb on the given interface
+// returns -1 if IPv6 is not available
+static int create_recv_sock6(unsigned int ifindex, bool join) {
+	int sd = socket(AF_INET6, SOCK_DGRAM, 0);
+	int on = 1;
+	int hops = 255;
+	struct sockaddr_in6 serveraddr;
+	struct ipv6_mreq mreq;
+
+	if (sd < 0) {
+		log_message(LOG_ERR, "recv socket6(): %m\n");
+		return -1;
+	}
+
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEADDR, &on, sizeof(on)) < 0) {
+		log_message(LOG_ERR, "recv6 setsockopt(SO_REUSEADDR): %m\n");
+		goto fail;
+	}
+
+#ifdef SO_REUSEPORT
+	if (setsockopt(sd, SOL_SOCKET, SO_REUSEPORT, &on, sizeof(on)) < 0)
+		log_message(LOG_ERR, "recv6 setsockopt(SO_REUSEPORT): %m\n");
+#endif
+
+	// the IPv4 socket gets the IPv4 packets
+	if (setsockopt(sd, IPPROTO_IPV6, IPV6_V6ONLY, &on, sizeof(on)) < 0) {
+		log_message(LOG_ERR, "recv6 setsockopt(IPV6_V6ONLY): %m\n");
+		goto fail;
+	}
+
+	memset(&serveraddr, 0, sizeof(serveraddr));
+	serveraddr.sin6_family = AF_INET6;
+	serveraddr.sin6_port = htons(MDNS_PORT);
+	serveraddr.sin6_addr = in6addr_any;	/* receive multicast */
+
+	if (bind(sd, (struct sockaddr *) &serveraddr, sizeof(serveraddr)) < 0) {
+		log_message(LOG_ERR, "recv6 bind(): %m\n");
+		goto fail;
+	}
+
+	if (setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_IF, &ifindex, sizeof(ifindex)) < 0) {
+		log_message(LOG_ERR, "recv6 setsockopt(IPV6_MULTICAST_IF): %m\n");
+		goto fail;
+	}
+
+	if (setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_HOPS, &hops, sizeof(hops)) < 0) {
+		log_message(LOG_ERR, "recv6 setsockopt(IPV6_MULTICAST_HOPS): %m\n");
+		goto fail;
+	}
+
+	// add membership to receiving socket
+	memset(&mreq, 0, sizeof(mreq));
+	inet_pton(AF_INET6, MDNS_ADDR6, &mreq.ipv6mr_multiaddr);
+	mreq.ipv6mr_interface = ifindex;
+	if (join && setsockopt(sd, IPPROTO_IPV6, IPV6_JOIN_GROUP, &mreq, sizeof(mreq)) < 0) {
+		log_message(LOG_ERR, "recv6 setsockopt(IPV6_JOIN_GROUP): %m\n");
+		goto fail;
+	}
+
+#ifdef HANDOFF
+	// before Linux 4.20, the worker runs on IPv4 only
+	on = 0;
+	if (!join && setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_ALL, &on, sizeof(on)) < 0) {
+		log_message(LOG_ERR, "recv6 setsockopt(IPV6_MULTICAST_ALL): %m\n");
+		goto fail;
+	}
+	on = 1;
+#endif
+
+	// enable loopback in case someone else needs the data
+	if (setsockopt(sd, IPPROTO_IPV6, IPV6_MULTICAST_LOOP, &on, sizeof(on)) < 0) {
+		log_message(LOG_ERR, "recv6 setsockopt(IPV6_MULTICAST_LOOP): %m\n");
+		goto fail;
+	}
+
+	if (setsockopt(sd, IPPROTO_IPV6, IPV6_RECVPKTINFO, &on, sizeof(on)) < 0) {
+		log_message(LOG_ERR, "recv6 setsockopt(IPV6_RECVPKTINFO): %m\n");
+		goto fail;
+	}
+
+	return sd;
+
+fail:
+	close(sd);
+	return -1;
+}
+#endif
+
+// joins (or leaves) the group on another interface with sockets created by
+// create_recv_sock() and create_recv_sock6(), the latter being optional (-1)
+static bool join_group(int sd, int sd6, struct in_addr addr, unsigned int ifindex, bool join) {
+	struct ip_mreq mreq;
+
+	memset(&mreq, 0, sizeof(mreq));
+	mreq.imr_multiaddr.s_addr = inet_addr(MDNS_ADDR);
+	mreq.imr_interface = addr;
+	if (setsockopt(sd, IPPROTO_IP, join ? IP_ADD_MEMBERSHIP : IP_DROP_MEMBERSHIP, (char *) &mreq, sizeof(mreq)) < 0) {
+		log_message(LOG_ERR, "recv setsockopt(IP_ADD_MEMBERSHIP): %m\n");
+		return false;
+	}
+
+#ifdef USE_IPV6
+	if (sd6 >= 0) {
+		struct ipv6_mreq mreq6;
+
+		memset(&mreq6, 0, sizeof(mreq6));
+		inet_pton(AF_INET6, MDNS_ADDR6, &mreq6.ipv6mr_multiaddr);
+		mreq6.ipv6mr_interface = ifindex;
+
+		// IPv6 stays optional, the interface may not have it
+		if (setsockopt(sd6, IPPROTO_IPV6, join ? IPV6_JOIN_GROUP : IPV6_LEAVE_GROUP, &mreq6, sizeof(mreq6)) < 0)
+			log_message(LOG_ERR, "recv6 setsockopt(IPV6_JOIN_GROUP): %m\n");
+	}
+#else
+	(void) sd6;
+	(void) ifindex;
+#endif
+
+	return true;
+}
+
+static socklen_t sockaddr_len(const union sockaddr_any *a) {
+#ifdef USE_IPV6
+	if (a->sa.sa_family == AF_INET6)
+		return sizeof(struct sockaddr_in6);
+#endif
+	return sizeof(struct sockaddr_in);
+}
+
+static bool sockaddr_equal(const union sockaddr_any *a, const union sockaddr_any *b) {
+	if (a->sa.sa_family != b->sa.sa_family)
+		return false;
+#ifdef USE_IPV6
+	if (a->sa.sa_family == AF_INET6)
+		return a->v6.sin6_port == b->v6.sin6_port &&
+				memcmp(&a->v6.sin6_addr, &b->v6.sin6_addr, sizeof(struct in6_addr)) == 0;
+#endif
+	return a->v4.sin_port == b->v4.sin_port && a->v4.sin_addr.s_addr == b->v4.sin_addr.s_addr;
+}
+
+static uint32_t sockaddr_hash(const union sockaddr_any *a) {
+#ifdef USE_IPV6
+	if (a->sa.sa_family == AF_INET6) {
+		uint32_t w[4];
+		memcpy(w, &a->v6.sin6_addr, sizeof(w));
+		return w[0] ^ w[1] ^ w[2] ^ w[3] ^ a->v6.sin6_port;
+	}
+#endif
+	return a->v4.sin_addr.s_addr ^ a->v4.sin_port;
+}
+
+static uint16_t sockaddr_port(const union sockaddr_any *a) {
+#ifdef USE_IPV6
+	if (a->sa.sa_family == AF_INET6)
+		return ntohs(a->v6.sin6_port);
+#endif
+	return ntohs(a->v4.sin_port);
+}
+
+// the mDNS group of a family
+static void mdns_group(union sockaddr_any *a, int family) {
+	memset(a, 0, sizeof(*a));
+#ifdef USE_IPV6
+	if (family == AF_INET6) {
+		a->v6.sin6_family = AF_INET6;
+		a->v6.sin6_port = htons(MDNS_PORT);
+		inet_pton(AF_INET6, MDNS_ADDR6, &a->v6.sin6_addr);
+		return;
+	}
+#endif
+	a->v4.sin_family = AF_INET;
+	a->v4.sin_port = htons(MDNS_PORT);
+	a->v4.sin_addr.s_addr = inet_addr(MDNS_ADDR);
+}
+
+#ifndef _WIN32
+#ifdef USE_IPV6
+#define PKTINFO_SIZE CMSG_SPACE(sizeof(struct in6_pktinfo))
+#elif defined(IP_PKTINFO)
+#define PKTINFO_SIZE CMSG_SPACE(sizeof(struct in_pktinfo))
+#else
+#define PKTINFO_SIZE CMSG_SPACE(1)
+#endif
+
+// tells from IP_PKTINFO (IPV6_PKTINFO) if a datagram was sent to a
+// multicast address, assumes it was when that is unknown. ifindex gets the
+// interface it came in from, 0 if that is unknown too
+static bool msg_to_multicast(struct msghdr *msg, unsigned int *ifindex) {
+#ifdef IP_PKTINFO
+	struct cmsghdr *c;
+
+	for (c = CMSG_FIRSTHDR(msg); c; c = CMSG_NXTHDR(msg, c)) {
+		if (c->cmsg_level == IPPROTO_IP && c->cmsg_type == IP_PKTINFO) {
+			struct in_pktinfo *info = (struct in_pktinfo *) CMSG_DATA(c);
+			*ifindex = info->ipi_ifindex;
+			return IN_MULTICAST(ntohl(info->ipi_addr.s_addr));
+		}
+#ifdef USE_IPV6
+		if (c->cmsg_level == IPPROTO_IPV6 && c->cmsg_type == IPV6_PKTINFO) {
+			struct in6_pktinfo *info = (struct in6_pktinfo *) CMSG_DATA(c);
+			*ifindex = info->ipi6_ifindex;
+			return IN6_IS_ADDR_MULTICAST(&info->ipi6_addr);
+		}
+#endif
+	}
+#endif
+	*ifindex = 0;
+	return true;
+}
+
+#ifdef IP_PKTINFO
+// fills buf, of PKTINFO_SIZE bytes, with the IP_PKTINFO (IPV6_PKTINFO) that
+// sends a datagram of family out of an interface
+// returns the length of the control data
+static size_t pktinfo_set(uint8_t *buf, int family, const struct mdnsd_iface *ifc) {
+	struct msghdr msg;
+	struct cmsghdr *c;
+	struct in_pktinfo info;
+
+	memset(buf, 0, PKTINFO_SIZE);
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_control = buf;
+	msg.msg_controllen = PKTINFO_SIZE;
+	c = CMSG_FIRSTHDR(&msg);
+
+#ifdef USE_IPV6
+	if (family == AF_INET6) {
+		struct in6_pktinfo info6;
+
+		memset(&info6, 0, sizeof(info6));
+		info6.ipi6_ifindex = ifc->ifindex;
+		c->cmsg_level = IPPROTO_IPV6;
+		c->cmsg_type = IPV6_PKTINFO;
+		c->cmsg_len = CMSG_LEN(sizeof(info6));
+		memcpy(CMSG_DATA(c), &info6, sizeof(info6));
+		return CMSG_SPACE(sizeof(info6));
+	}
+#endif
+
+	// from its address, receivers check that it is on the link
+	memset(&info, 0, sizeof(info));
+	info.ipi_ifindex = ifc->ifindex;
+	info.ipi_spec_dst = ifc->addr;
+	c->cmsg_level = IPPROTO_IP;
+	c->cmsg_type = IP_PKTINFO;
+	c->cmsg_len = CMSG_LEN(sizeof(info));
+	memcpy(CMSG_DATA(c), &info, sizeof(info));
+	return CMSG_SPACE(sizeof(info));
+}
+#endif
+#endif
+
+// sends from fd to "to", out of the interface ifc unless it is NULL
+static ssize_t send_to(int fd, const void *data, size_t len, const union sockaddr_any *to,
+		const struct mdnsd_iface *ifc) {
+#if !defined(_WIN32) && defined(IP_PKTINFO)
+	if (ifc) {
+		union {
+			struct cmsghdr align;
+			uint8_t buf[PKTINFO_SIZE];
+		} ctrl;
+		struct iovec iov = { (void *) data, len };
+		struct msghdr msg;
+
+		memset(&msg, 0, sizeof(msg));
+		msg.msg_name = (void *) to;
+		msg.msg_namelen = sockaddr_len(to);
+		msg.msg_iov = &iov;
+		msg.msg_iovlen = 1;
+		msg.msg_control = ctrl.buf;
+		msg.msg_controllen = pktinfo_set(ctrl.buf, to->sa.sa_family, ifc);
+
+		return sendmsg(fd, &msg, 0);
+	}
+#else
+	(void) ifc;
+#endif
+	return sendto(fd, data, len, 0, &to->sa, sockaddr_len(to));
+}
+
+// multicasts on the socket of the given family, out of the interface ifc
+// unless it is NULL
+static ssize_t send_packet(int fd, int family, const struct mdnsd_iface *ifc, const void *data, size_t len) {
+	union sockaddr_any toaddr;
+
+	mdns_group(&toaddr, family);
+	return send_to(fd, data, len, &toaddr, ifc);
+}
+
+#ifndef BATCH_IO
+// receives one datagram and tells if it was sent to a multicast address,
+// and from which interface (0 if unknown)
+static ssize_t recv_packet(int fd, void *data, size_t len, union sockaddr_any *fromaddr, bool *multicast,
+		unsigned int *ifindex) {
+#ifdef _WIN32
+	socklen_t sockaddr_size = sizeof(union sockaddr_any);
+
+	*multicast = true;
+	*ifindex = 0;
+	return recvfrom(fd, data, len, 0, &fromaddr->sa, &sockaddr_size);
+#else
+	union {
+		struct cmsghdr align;
+		uint8_t buf[PKTINFO_SIZE];
+	} ctrl;
+	struct iovec iov = { data, len };
+	struct msghdr msg;
+	ssize_t r;
+
+	memset(&msg, 0, sizeof(msg));
+	msg.msg_name = fromaddr;
+	msg.msg_namelen = sizeof(union sockaddr_any);
+	msg.msg_iov = &iov;
+	msg.msg_iovlen = 1;
+	msg.msg_control = ctrl.buf;
+	msg.msg_controllen = sizeof(ctrl.buf);
+
+	r = recvmsg(fd, &msg, 0);
+	*ifindex = 0;
+	*multicast = r < 0 || msg_to_multicast(&msg, ifindex);
+
+	return r;
+#endif
+}
+#endif
+
+// answers from the bound socket, so replies come from port 5353 without
+// opening a socket each time
+static ssize_t send_unicast(int fd, const void *data, size_t len, const union sockaddr_any *toaddr,
+		const struct mdnsd_iface *ifc) {
+	DEBUG_PRINTF("unicast answer\n");
+	return send_to(fd, data, len, toaddr, ifc);
+}
+
+// the interface a packet came in from if it is one of those we answer on
+// and there are several, 0 otherwise (loopback, unknown...) so that it
+// sees all the records
+static unsigned int iface_scope(struct mdnsd *svr, unsigned int ifindex) {
+	int i, n = load_acquire(&svr->num_ifaces);
+
+	if (n == 1 || ifindex == 0)
+		return 0;
+
+	for (i = 0; i < n; i++)
+		if (svr->ifaces[i].ifindex == ifindex)
+			return ifindex;
+
+	return 0;
+}
+
+// the interface to send out of for a scope given by iface_scope(), NULL
+// for the one of the host
+static const struct mdnsd_iface *iface_get(struct mdnsd *svr, unsigned int ifindex) {
+	int i, n = load_acquire(&svr->num_ifaces);
+
+	for (i = 0; ifindex && i < n; i++)
+		if (svr->ifaces[i].ifindex == ifindex)
+			return svr->ifaces + i;
+
+	return NULL;
+}
+
+// tells if a record is published on an interface, 0 for any
+#define rr_on_iface(e, ifindex) ((e)->ifindex == 0 || (ifindex) == 0 || (e)->ifindex == (ifindex))
+
+
+// ----- record store -----
+
+// returns the current version of the store, only valid between
+// reader_enter() and reader_leave() or with data_lock held
+static struct rr_groups *store_get(struct mdnsd *svr) {
+	return load_acquire(&svr->store);
+}
+
+// starts reading the store, nothing it retires from now on will be freed
+// until reader_leave(). The fence makes sure that either the writers see
+// our epoch or we see what they published
+static void reader_enter(struct mdnsd_worker *w) {
+	store_relaxed(&w->epoch, load_acquire(&w->svr->epoch));
+	full_fence();
+}
+
+static void reader_leave(struct mdnsd_worker *w) {
+	store_release(&w->epoch, 0);
+}
+
+static void retired_free(struct retired *r) {
+	rr_list_destroy(r->entries, 1);
+	rr_groups_free_retired(r->groups);
+	if (r->store) {
+		free(r->store->slots);
+		free(r->store);
+	}
+	free(r);
+}
+
+// frees what was retired before the oldest epoch a worker is reading
+// must be called with data_lock held
+static void reclaim(struct mdnsd *svr) {
+	struct retired **r = &svr->retired;
+	size_t oldest = (size_t) -1;
+	int i;
+
+	full_fence();
+	for (i = 0; i < svr->num_workers; i++) {
+		size_t epoch = load_acquire(&svr->workers[i].epoch);
+		if (epoch && epoch < oldest)
+			oldest = epoch;
+	}
+
+	// the list is sorted by decreasing epoch
+	while (*r && (*r)->epoch >= oldest)
+		r = &(*r)->next;
+
+	while (*r) {
+		struct retired *next = (*r)->next;
+		retired_free(*r);
+		store_relaxed(r, next);
 	}
+}
+
+// hands things workers may still see to reclaim(), they must not be
+// reachable from the current store anymore. Must be called with data_lock held
+static void retire(struct mdnsd *svr, struct rr_groups *store, struct rr_group *groups, struct rr_list *entries) {
+	struct retired *r;
+
+	if (!store && !groups && !entries)
+		return;
+
+	r = malloc(sizeof(struct retired));
+	r->store = store;
+	r->groups = groups;
+	r->entries = entries;
+	r->epoch = svr->epoch;
+	r->next = svr->retired;
+	store_relaxed(&svr->retired, r);
 
-	return sendto(fd, data, len, 0, (struct sockaddr *) &toaddr, sizeof(struct sockaddr_in));
+	// workers that start reading after this can't see any of it
+	store_release(&svr->epoch, svr->epoch + 1);
+
+	reclaim(svr);
+}
+
+// starts a new version of the store, must be called with data_lock held
+static struct rr_groups *store_begin(struct mdnsd *svr) {
+	return rr_groups_clone(svr->store);
 }
 
+// publishes a new version of the store and retires the previous one, with
+// the records removed in between. Must be called with data_lock held
+static void store_commit(struct mdnsd *svr, struct rr_groups *next, struct rr_list *removed) {
+	struct rr_groups *prev = svr->store;
+	struct rr_group *replaced = next->retired;
+
+	next->retired = NULL;
+	store_release(&svr->store, next);
 
-// populate the specified list which matches the RR name and type
+	retire(svr, prev, replaced, removed);
+}
+
+// populate the specified list of reply which matches the RR name and type
 // type can be RR_ANY, which populates all entries EXCEPT RR_NSEC
-static int populate_answers(struct mdnsd *svr, struct rr_list **rr_head, uint8_t *name, enum rr_type type) {
+// records in known with at least half of their TTL are left out, and so
+// are those not published on the interface ifindex
+static int populate_answers(struct mdnsd *svr, struct mdns_pkt *reply, struct rr_list **rr_head, uint8_t *name, enum rr_type type,
+		const struct rr_hashset *known, unsigned int ifindex) {
 	int num_ans = 0;
 	struct rr_group *ans_grp;
 	struct rr_list *n;
 
 	// check if we have the records
-	mutex_lock(svr->data_lock);
-	ans_grp = rr_group_find(svr->group, name);
-	if (ans_grp == NULL) {
-		mutex_unlock(svr->data_lock);
+	ans_grp = rr_group_find(store_get(svr), name);
+	if (ans_grp == NULL || !(ans_grp->types & RR_TYPE_BIT(type)))
 		return num_ans;
-	}
 
 	// decide which records should go into answers
     n = ans_grp->rr;
@@ -236,43 +1044,53 @@ static int populate_answers(struct mdnsd *svr, struct rr_list **rr_head, uint8_t
 		if (type == RR_ANY && n->e->type == RR_NSEC)
 			continue;
 
-		if ((type == n->e->type || type == RR_ANY) && cmp_nlabel(name, n->e->name) == 0) {
-			num_ans += rr_list_append(rr_head, n->e);
+		if (!rr_on_iface(n->e, ifindex))
+			continue;
+
+		// all records of a group share its name
+		if (type == n->e->type || type == RR_ANY) {
+			struct rr_entry *known_ans = known ? rr_hashset_match(known, n->e, ans_grp->hash) : NULL;
+
+			if (known_ans != NULL && known_ans->ttl >= n->e->ttl / 2) {
+				DEBUG_PRINTF("(known answer) ");
+				continue;
+			}
+
+			num_ans += rr_list_append_arena(reply->arena, rr_head, n->e);
 		}
 	}
 
-	mutex_unlock(svr->data_lock);
-
 	return num_ans;
 }
 
-// given a list of RRs, look up related records and add them
-static void add_related_rr(struct mdnsd *svr, struct rr_list *list, struct mdns_pkt *reply) {
+// given a list of RRs, look up related records published on the interface
+// ifindex and add them
+static void add_related_rr(struct mdnsd *svr, struct rr_list *list, struct mdns_pkt *reply, unsigned int ifindex) {
 	for (; list; list = list->next) {
 		struct rr_entry *ans = list->e;
 
 		switch (ans->type) {
 			case RR_PTR:
 				// target host A, AAAA records
-				reply->num_add_rr += populate_answers(svr, &reply->rr_add,
-										MDNS_RR_GET_PTR_NAME(ans), RR_ANY);
+				reply->num_add_rr += populate_answers(svr, reply, &reply->rr_add,
+										MDNS_RR_GET_PTR_NAME(ans), RR_ANY, NULL, ifindex);
 				break;
 
 			case RR_SRV:
 				// target host A, AAAA records
-				reply->num_add_rr += populate_answers(svr, &reply->rr_add, 
-										ans->data.SRV.target, RR_ANY);
+				reply->num_add_rr += populate_answers(svr, reply, &reply->rr_add, 
+										ans->data.SRV.target, RR_ANY, NULL, ifindex);
 
 				// perhaps TXT records of the same name?
 				// if we use RR_ANY, we risk pulling in the same RR_SRV
-				reply->num_add_rr += populate_answers(svr, &reply->rr_add, 
-										ans->name, RR_TXT);
+				reply->num_add_rr += populate_answers(svr, reply, &reply->rr_add, 
+										ans->name, RR_TXT, NULL, ifindex);
 				break;
 
 			case RR_A:
 			case RR_AAAA:
-				reply->num_add_rr += populate_answers(svr, &reply->rr_add, 
-										ans->name, RR_NSEC);
+				reply->num_add_rr += populate_answers(svr, reply, &reply->rr_add, 
+										ans->name, RR_NSEC, NULL, ifindex);
 				break;
 
 			default:
@@ -282,29 +1100,131 @@ static void add_related_rr(struct mdnsd *svr, struct rr_list *list, struct mdns_
 	}
 }
 
-// creates an announce packet given the type name PTR 
-static void announce_srv(struct mdnsd *svr, struct mdns_pkt *reply, uint8_t *name) {
-	mdns_init_reply(reply, 0);
+// largest size a record can take in a packet, that is without compression
+static size_t rr_size_max(const struct rr_entry *rr) {
+	size_t len = strlen((const char *) rr->name) + 1;
 
-	reply->num_ans_rr += populate_answers(svr, &reply->rr_ans, name, RR_PTR);
-	
-	// remember to add the services dns-sd PTR too
-	reply->num_ans_rr += populate_answers(svr, &reply->rr_ans, 
-								SERVICES_DNS_SD_NLABEL, RR_PTR);
+	// records the store could not pre-encode get a packet of their own
+	return len + (rr->wire ? rr->wire->len : ANNOUNCE_PKT_SIZE);
+}
+
+static bool rr_list_has(const struct rr_list *list, const struct rr_entry *rr) {
+	for (; list; list = list->next)
+		if (list->e == rr)
+			return true;
+	return false;
+}
+
+// the services PTRs of the instances of a type all say the same
+static bool rr_list_has_bptr(const struct rr_list *list, const struct rr_entry *bptr) {
+	for (; list; list = list->next)
+		if (list->e->name == bptr->name &&
+				cmp_nlabel(MDNS_RR_GET_PTR_NAME(list->e), MDNS_RR_GET_PTR_NAME(bptr)) == 0)
+			return true;
+	return false;
+}
+
+// sizes rr if list does not have it yet, and adds it if add is set
+static size_t announce_rr(struct mdns_pkt *reply, struct rr_list **list, uint16_t *num,
+		struct rr_entry *rr, bool add) {
+	if (rr_list_has(*list, rr))
+		return 0;
+	if (add)
+		*num += rr_list_append_arena(reply->arena, list, rr);
+	return rr_size_max(rr);
+}
+
+// sizes the records announcing a (its PTR, services PTR, SRV and TXT, then
+// the target host records) that reply does not have yet, and adds them if
+// add is set. A goodbye is just the PTR
+static size_t announce_records(struct mdnsd *svr, struct mdns_pkt *reply,
+		struct announce *a, bool add) {
+	struct rr_entry *srv = a->ptr->data.PTR.entry;
+	struct rr_group *g;
+	struct rr_list *n;
+	size_t len;
+
+	len = announce_rr(reply, &reply->rr_ans, &reply->num_ans_rr, a->ptr, add);
+	if (a->leave)
+		return len;
+
+	if (!rr_list_has_bptr(reply->rr_ans, a->bptr))
+		len += announce_rr(reply, &reply->rr_ans, &reply->num_ans_rr, a->bptr, add);
+
+	len += announce_rr(reply, &reply->rr_add, &reply->num_add_rr, srv, add);
+
+	g = rr_group_find(store_get(svr), srv->name);
+	for (n = g ? g->rr : NULL; n; n = n->next)
+		if (n->e->type == RR_TXT)
+			len += announce_rr(reply, &reply->rr_add, &reply->num_add_rr, n->e, add);
+
+	g = rr_group_find(store_get(svr), srv->data.SRV.target);
+	for (n = g ? g->rr : NULL; n; n = n->next)
+		len += announce_rr(reply, &reply->rr_add, &reply->num_add_rr, n->e, add);
+
+	return len;
+}
+
+// the worker that answers a multicast packet, the one its first question
+// hashes to. Unicast ones reach a single worker which keeps them
+// the packets of a query split by the TC bit go by source instead, so that
+// they all end up with the same worker
+// returns -1 if the packet is malformed
+static int pkt_owner(struct mdnsd *svr, const struct mdns_pkt_view *view, const union sockaddr_any *from) {
+	struct mdns_pkt_view v = *view;
+	struct mdns_rr_view qn;
+	uint32_t hash;
+
+	if ((view->flags & MDNS_FLAG_TC) || view->num_qn == 0) {
+		hash = sockaddr_hash(from);
+	} else {
+		if (!mdns_view_next(&v, &qn) || qn.section != MDNS_SECTION_QN ||
+				!mdns_view_name_hash(&v, qn.name, &hash))
+			return -1;
+		hash ^= qn.type;
+	}
+
+	hash *= 16777619u;
+	return (hash >> 16) % svr->num_workers;
+}
+
+// checks on the raw packet if it is a query with at least one question for
+// a name and type we own, so that others can be dropped without parsing
+static bool pkt_is_for_us(struct mdnsd_worker *w, struct mdns_pkt_view *view) {
+	struct rr_groups *store = store_get(w->svr);
+	struct mdns_rr_view qn;
+	bool found = false;
+
+	// we never answer responses and non-standard queries
+	if ((view->flags & MDNS_FLAG_RESP) || MDNS_FLAG_GET_OPCODE(view->flags) != 0)
+		return false;
 
-	// see if we can match additional records for answers
-	add_related_rr(svr, reply->rr_ans, reply);
+	while (!found && mdns_view_next(view, &qn) && qn.section == MDNS_SECTION_QN) {
+		struct rr_group *g;
+
+		// the filter turns most foreign names down without hashing them whole
+		if (!rr_groups_may_own(store, view, qn.name)) {
+			stats_add(w, filter_misses, 1);
+			continue;
+		}
+		stats_add(w, filter_hits, 1);
 
-	// additional records for additional records
-	add_related_rr(svr, reply->rr_add, reply);
+		g = rr_group_find_view(store, view, qn.name);
+		found = g != NULL && (g->types & RR_TYPE_BIT(qn.type));
+	}
+
+	if (!found)
+		DEBUG_PRINTF("(no question for us in packet)\n\n");
+
+	return found;
 }
 
-// processes the incoming MDNS packet
+// processes the incoming MDNS packet, from the interface ifindex
 // returns >0 if processed, 0 otherwise
-static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns_pkt *reply) {
+static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns_pkt *reply, unsigned int ifindex) {
 	int i;
 	struct rr_list *qnl;
-	struct rr_list *ans, *prev_ans;
+	struct rr_hashset known;
 
 	assert(pkt != NULL);
 
@@ -319,6 +1239,9 @@ static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns
 						pkt->num_ans_rr,
 						pkt->num_add_rr);
 
+		// what the querier already knows is looked up for every answer
+		rr_hashset_init(&known, reply->arena, pkt->rr_ans, pkt->num_ans_rr);
+
 		// loop through questions
 		qnl = pkt->rr_qn;
 		for (i = 0; i < pkt->num_qn; i++, qnl = qnl->next) {
@@ -332,495 +1255,2515 @@ static int process_mdns_pkt(struct mdnsd *svr, struct mdns_pkt *pkt, struct mdns
 			// mark that a unicast response is desired
 			reply->unicast |= qn->unicast_query;
 
-			num_ans_added = populate_answers(svr, &reply->rr_ans, qn->name, qn->type);
+			num_ans_added = populate_answers(svr, reply, &reply->rr_ans, qn->name, qn->type, &known, ifindex);
 			reply->num_ans_rr += num_ans_added;
 
 			DEBUG_PRINTF("added %d answers\n", num_ans_added);
 		}
 
-		// remove our replies if they were already in their answers
-		ans = NULL; prev_ans = NULL;
-		for (ans = reply->rr_ans; ans; ) {
-			struct rr_list *next_ans = ans->next;
-			struct rr_entry *known_ans = rr_entry_match(pkt->rr_ans, ans->e);
+		DEBUG_PRINTF("\n");
 
-			// discard answers that have at least half of the actual TTL
-			if (known_ans != NULL && known_ans->ttl >= ans->e->ttl / 2) {
-				char *namestr = nlabel_to_str(ans->e->name);
-				DEBUG_PRINTF("removing answer for %s\n", namestr);
-				free(namestr);
+		return reply->num_ans_rr;
+	}
 
-				// check if list item is head
-				if (prev_ans == NULL)
-					reply->rr_ans = ans->next;
-				else
-					prev_ans->next = ans->next;
-				free(ans);
+	return 0;
+}
 
-				ans = prev_ans;
+// index of a family in mdnsd_worker.stamps
+#define FAMILY_INDEX(family) ((family) == AF_INET6)
 
-				// adjust answer count
-				reply->num_ans_rr--;
-			}
+// the slot of a record in a table of stamps, see multicast_recently()
+#define stamp_slot(e) ((((uintptr_t) (e) >> 4) * 2654435761u) & (STAMP_SLOTS - 1))
 
-			prev_ans = ans;
-			ans = next_ans;
-		}
+// tells if a record was multicast too recently to be sent again to the
+// group of family, or to both groups if it is AF_UNSPEC, on the interface
+// ifindex (0 for all). Each worker remembers what it multicast itself,
+// as it is always the same worker that answers a question
+static bool multicast_recently(struct mdnsd_worker *w, struct rr_entry *e, uint64_t now, int family,
+		unsigned int ifindex) {
+	int i;
 
+	for (i = 0; i < 2; i++) {
+		struct multicast_stamp *st = &w->stamps[i][stamp_slot(e)];
 
-		// see if we can match additional records for answers
-		add_related_rr(svr, reply->rr_ans, reply);
+		if (family != AF_UNSPEC && i != FAMILY_INDEX(family))
+			continue;
+
+		// the slot may have been taken by another record since
+		if (st->e != e || now - st->ms >= MULTICAST_INTERVAL)
+			return false;
+
+		if (st->ifindex != 0 && st->ifindex != ifindex)
+			return false;
+	}
+
+	return true;
+}
+
+static void multicast_stamp(struct mdnsd_worker *w, struct rr_entry *e, int i, uint64_t now,
+		unsigned int ifindex) {
+	struct multicast_stamp *st = &w->stamps[i][stamp_slot(e)];
+
+	st->e = e;
+	st->ms = now;
+	st->ifindex = ifindex;
+}
+
+// stamps the answers of a multicast reply
+static void multicast_mark(struct mdnsd_worker *w, struct rr_list *list, uint64_t now, int family,
+		unsigned int ifindex) {
+	for (; list; list = list->next) {
+		if (family != AF_INET6)
+			multicast_stamp(w, list->e, FAMILY_INDEX(AF_INET), now, ifindex);
+		if (family != AF_INET)
+			multicast_stamp(w, list->e, FAMILY_INDEX(AF_INET6), now, ifindex);
+	}
+}
+
+// xorshift, good enough to spread the responses of several responders
+static uint32_t worker_rand(struct mdnsd_worker *w) {
+	uint32_t x = w->rand_state;
+	x ^= x << 13;
+	x ^= x >> 17;
+	x ^= x << 5;
+	return w->rand_state = x;
+}
+
+// queues a shared answer to be multicast with the others of the window
+// returns false if there is no room left for it. A window serves one
+// interface, the answers to queries from another are not delayed
+static bool aggregate_add(struct mdnsd_worker *w, struct rr_entry *e, uint64_t now, int family,
+		unsigned int ifindex) {
+	int i;
+
+	if (w->aggr_count > 0 && w->aggr_ifindex != ifindex)
+		return false;
+
+	for (i = 0; i < w->aggr_count; i++) {
+		if (w->aggr[i] == e) {
+			if (w->aggr_family != family)
+				w->aggr_family = AF_UNSPEC;
+			return true;
+		}
+	}
+
+	if (w->aggr_count == AGGR_MAX)
+		return false;
+
+	if (w->aggr_count == 0) {
+		mdns_timer_arm(&w->timers, &w->aggr_timer, now + AGGR_DELAY_MIN +
+				worker_rand(w) % (AGGR_DELAY_MAX - AGGR_DELAY_MIN + 1));
+		w->aggr_family = family;
+		w->aggr_ifindex = ifindex;
+	} else if (w->aggr_family != family) {
+		// the window goes out to both groups
+		w->aggr_family = AF_UNSPEC;
+	}
+
+	w->aggr[w->aggr_count++] = e;
+	return true;
+}
+
+// takes the shared answers out of a multicast reply so that those to all
+// the queries of the next 20-120 ms go out in one packet, and drops the
+// answers multicast within the last second. Unique ones stay in the reply
+// to be sent right away. family and ifindex are those of the query
+static void aggregate(struct mdnsd_worker *w, struct mdns_pkt *reply, uint64_t now, int family,
+		unsigned int ifindex) {
+	struct rr_list **l = &reply->rr_ans;
+
+	while (*l) {
+		struct rr_list *ans = *l;
+
+		if (!multicast_recently(w, ans->e, now, family, ifindex) &&
+				(ans->e->cache_flush || !aggregate_add(w, ans->e, now, family, ifindex))) {
+			l = &ans->next;
+			continue;
+		}
+
+		*l = ans->next;
+		if (reply->arena == NULL)
+			free(ans);
+		reply->num_ans_rr--;
+	}
+}
+
+// the socket of a worker for a family
+static int worker_fd(struct mdnsd_worker *w, int family) {
+	return family == AF_INET6 ? w->sockfd6 : w->sockfd;
+}
+
+// multicasts to the group of family, or to both if it is AF_UNSPEC, out of
+// the interface ifindex (0 for the one of the host)
+// returns the number of packets sent
+static int send_group(struct mdnsd_worker *w, int family, unsigned int ifindex, const void *data, size_t len) {
+	const struct mdnsd_iface *ifc = iface_get(w->svr, ifindex);
+	int sent = 0;
+
+	if (family != AF_INET6) {
+		send_packet(w->sockfd, AF_INET, ifc, data, len);
+		sent++;
+	}
+	if (family != AF_INET && w->sockfd6 >= 0) {
+		send_packet(w->sockfd6, AF_INET6, ifc, data, len);
+		sent++;
+	}
+
+	return sent;
+}
+
+// sends an encoded packet of reply to the group of family, or to "to" if
+// it is unicast, out of the interface ifindex
+static void reply_send_pkt(struct mdnsd_worker *w, struct mdns_pkt *reply,
+		const union sockaddr_any *to, int family, unsigned int ifindex, const uint8_t *buf, size_t len) {
+	int sent = 1;
+
+	if (reply->unicast && to != NULL) {
+		send_unicast(worker_fd(w, to->sa.sa_family), buf, len, to, iface_get(w->svr, ifindex));
+		stats_add(w, tx_unicast, 1);
+	} else {
+		sent = send_group(w, family, ifindex, buf, len);
+		stats_add(w, tx_multicast, sent);
+	}
+	stats_add(w, tx_packets, sent);
+	stats_add(w, tx_batches, sent);
+}
+
+// sends reply to the group of family, or to "to" if it is unicast, out of
+// the interface ifindex in as many packets as its answers take, encoded
+// in buf
+static void reply_send(struct mdnsd_worker *w, struct mdns_pkt *reply,
+		const union sockaddr_any *to, int family, unsigned int ifindex, uint8_t *buf) {
+	while (reply->num_ans_rr > 0) {
+		size_t replylen = mdns_encode_pkt(reply, buf, w->svr->pkt_max);
+
+		if (replylen == (size_t) -1)
+			break;
+
+		reply_send_pkt(w, reply, to, family, ifindex, buf, replylen);
+	}
+}
+
+// tells if a record is in the current version of the store, the worker
+// may have found it in a previous one
+static bool rr_published(struct mdnsd *svr, const struct rr_entry *e) {
+	struct rr_group *g = rr_group_find(store_get(svr), e->name);
+	struct rr_list *n;
+
+	for (n = g ? g->rr : NULL; n; n = n->next)
+		if (n->e == e)
+			return true;
+
+	return false;
+}
+
+// multicasts the aggregated answers with their additional records
+static void aggregate_flush(void *arg) {
+	struct mdnsd_worker *w = arg;
+	struct mdns_pkt *reply = w->reply;
+	uint64_t now = mdns_time_ms();
+	int i;
+
+	mdns_arena_reset(w->arena);
+	mdns_init_reply(reply, 0);
+
+	// some may have been multicast meanwhile when the window was full, and
+	// those removed since had their goodbye sent
+	for (i = 0; i < w->aggr_count; i++) {
+		if (!multicast_recently(w, w->aggr[i], now, w->aggr_family, w->aggr_ifindex) &&
+				rr_published(w->svr, w->aggr[i]))
+			reply->num_ans_rr += rr_list_append_arena(w->arena, &reply->rr_ans, w->aggr[i]);
+	}
+	w->aggr_count = 0;
+
+	if (reply->num_ans_rr == 0)
+		return;
+
+	add_related_rr(w->svr, reply->rr_ans, reply, w->aggr_ifindex);
+	add_related_rr(w->svr, reply->rr_add, reply, w->aggr_ifindex);
+
+	multicast_mark(w, reply->rr_ans, now, w->aggr_family, w->aggr_ifindex);
+	reply_send(w, reply, NULL, w->aggr_family, w->aggr_ifindex, w->pkt_buffer);
+}
+
+// answers a parsed query from "from", encoding the reply into out. If the
+// answers do not fit in that packet, it is sent right away and then the
+// follow-up ones, so that they go out in order. Multicast replies go to
+// the group of the family of the query, on the interface ifindex it came
+// from (see iface_scope()) with the records published there
+// returns the length of the reply, 0 if there is nothing left to send
+static size_t answer_query(struct mdnsd_worker *w, struct mdns_pkt *mdns, struct mdns_pkt *reply,
+		const union sockaddr_any *from, unsigned int ifindex, uint8_t *out, size_t out_len) {
+	struct mdnsd *svr = w->svr;
+	int family = from->sa.sa_family;
+	size_t replylen = 0;
+
+	if (process_mdns_pkt(svr, mdns, reply, ifindex)) {
+		uint64_t now = mdns_time_ms();
+
+		if (!reply->unicast)
+			aggregate(w, reply, now, family, ifindex);
+
+		if (reply->num_ans_rr) {
+			// see if we can match additional records for answers
+			add_related_rr(svr, reply->rr_ans, reply, ifindex);
+
+			// additional records for additional records
+			add_related_rr(svr, reply->rr_add, reply, ifindex);
+
+			if (!reply->unicast)
+				multicast_mark(w, reply->rr_ans, now, family, ifindex);
+
+			assert(out_len >= svr->pkt_max);
+			replylen = mdns_encode_pkt(reply, out, svr->pkt_max);
+			if (replylen == (size_t) -1) {
+				replylen = 0;
+			} else if (reply->num_ans_rr > 0) {
+				reply_send_pkt(w, reply, from, family, ifindex, out, replylen);
+				reply_send(w, reply, from, family, ifindex, out);
+				replylen = 0;
+			}
+		}
+	}
+
+	mdns_pkt_destroy(mdns);
+
+	return replylen;
+}
+
+static struct tc_query *tc_find(struct mdnsd_worker *w, const union sockaddr_any *from) {
+	int i;
+
+	for (i = 0; i < TC_MAX; i++) {
+		struct tc_query *t = w->tc + i;
+		if (t->count && sockaddr_equal(&t->from, from))
+			return t;
+	}
+
+	return NULL;
+}
+
+// starts following the packets of a source, NULL if all slots are in use
+static struct tc_query *tc_start(struct mdnsd_worker *w, const union sockaddr_any *from, unsigned int ifindex) {
+	int i;
+
+	for (i = 0; i < TC_MAX; i++) {
+		struct tc_query *t = w->tc + i;
+		if (t->count == 0) {
+			t->from = *from;
+			t->ifindex = ifindex;
+			return t;
+		}
+	}
+
+	return NULL;
+}
+
+static void tc_free(struct tc_query *t) {
+	int i;
+
+	mdns_timer_cancel(&t->w->timers, &t->timer);
+	for (i = 0; i < t->count; i++)
+		free(t->pkts[i]);
+	t->count = 0;
+}
+
+// parses all the packets of a query as one, questions and known answers
+// of the following packets are added to those of the first one
+static struct mdns_pkt *tc_parse(struct tc_query *t, struct mdns_arena *arena) {
+	struct mdns_pkt *first = NULL;
+	int i;
+
+	for (i = 0; i < t->count; i++) {
+		struct mdns_pkt *p = mdns_parse_pkt_arena(arena, t->pkts[i], t->lens[i]);
+		struct rr_list **l;
+
+		if (p == NULL)
+			continue;
+		if (first == NULL) {
+			first = p;
+			continue;
+		}
+
+		for (l = &first->rr_qn; *l; l = &(*l)->next);
+		*l = p->rr_qn;
+		first->num_qn += p->num_qn;
+
+		for (l = &first->rr_ans; *l; l = &(*l)->next);
+		*l = p->rr_ans;
+		first->num_ans_rr += p->num_ans_rr;
+	}
+
+	return first;
+}
+
+// the querier didn't send the rest of its known answers in time, answer
+// with what we got
+static void tc_expire(void *arg) {
+	struct tc_query *t = arg;
+	struct mdnsd_worker *w = t->w;
+	struct mdns_pkt *mdns;
+	size_t replylen = 0;
+
+	mdns_arena_reset(w->arena);
+
+	mdns = tc_parse(t, w->arena);
+	if (mdns != NULL)
+		replylen = answer_query(w, mdns, w->reply, &t->from, t->ifindex, w->pkt_buffer, PACKET_SIZE);
+
+	if (replylen) {
+		int fd = worker_fd(w, t->from.sa.sa_family);
+		const struct mdnsd_iface *ifc = iface_get(w->svr, t->ifindex);
+
+		if (w->reply->unicast) {
+			send_unicast(fd, w->pkt_buffer, replylen, &t->from, ifc);
+			stats_add(w, tx_unicast, 1);
+		} else {
+			send_packet(fd, t->from.sa.sa_family, ifc, w->pkt_buffer, replylen);
+			stats_add(w, tx_multicast, 1);
+		}
+		stats_add(w, tx_packets, 1);
+		stats_add(w, tx_batches, 1);
+	}
+
+	tc_free(t);
+}
+
+// keeps the packets of a query with the TC bit set and those that follow
+// from the same source, until the one without it comes
+// returns true if the query is complete and should be answered now
+static bool tc_add(struct mdnsd_worker *w, struct tc_query *t, const uint8_t *pkt_buf, size_t pkt_len, bool more) {
+	uint8_t *copy = malloc(pkt_len);
+
+	if (copy == NULL)
+		return true;
+
+	if (t->count == 0)
+		mdns_timer_arm(&w->timers, &t->timer, mdns_time_ms() + TC_DELAY_MIN +
+				worker_rand(w) % (TC_DELAY_MAX - TC_DELAY_MIN + 1));
+
+	memcpy(copy, pkt_buf, pkt_len);
+	t->pkts[t->count] = copy;
+	t->lens[t->count] = pkt_len;
+	t->count++;
+
+	return !more || t->count == TC_PKTS;
+}
+
+// ----- cache of the records of others -----
+
+static uint32_t cache_hash(const uint8_t *name, enum rr_type type) {
+	return (name_hash(name) ^ type) * 16777619u;
+}
+
+// returns the next record cached for name and type after "from", the
+// first one if it is NULL. hash is their cache_hash()
+static struct cache_entry *cache_find(struct rr_cache *c, const uint8_t *name, enum rr_type type,
+		uint32_t hash, struct cache_entry *from) {
+	struct cache_entry *e;
+
+	if (c->size == 0)
+		return NULL;
+
+	for (e = from ? from->next : c->buckets[hash & (c->size - 1)]; e; e = e->next)
+		if (e->hash == hash && e->rr->type == type && cmp_nlabel(e->rr->name, name) == 0)
+			return e;
+
+	return NULL;
+}
+
+static void lru_unlink(struct rr_cache *c, struct cache_entry *e) {
+	if (e->lru_prev)
+		e->lru_prev->lru_next = e->lru_next;
+	else
+		c->lru_head = e->lru_next;
+	if (e->lru_next)
+		e->lru_next->lru_prev = e->lru_prev;
+	else
+		c->lru_tail = e->lru_prev;
+}
+
+static void lru_push(struct rr_cache *c, struct cache_entry *e) {
+	e->lru_prev = NULL;
+	e->lru_next = c->lru_head;
+	if (c->lru_head)
+		c->lru_head->lru_prev = e;
+	else
+		c->lru_tail = e;
+	c->lru_head = e;
+}
+
+// marks a record as the most recently used
+static void cache_touch(struct rr_cache *c, struct cache_entry *e) {
+	if (c->lru_head != e) {
+		lru_unlink(c, e);
+		lru_push(c, e);
+	}
+}
+
+// returns the first record cached for name and type that has not expired
+static struct rr_entry *cache_get(struct rr_cache *c, const uint8_t *name, enum rr_type type, uint64_t now) {
+	uint32_t hash = cache_hash(name, type);
+	struct cache_entry *e = NULL;
+
+	while ((e = cache_find(c, name, type, hash, e)) != NULL) {
+		if (e->expire_ms > now) {
+			cache_touch(c, e);
+			return e->rr;
+		}
+	}
+
+	return NULL;
+}
+
+static void cache_insert(struct rr_cache *c, struct cache_entry *e) {
+	// keep chains short, rehash when there are more records than buckets
+	if (c->count >= c->size) {
+		size_t i, size = c->size ? c->size * 2 : 64;
+		struct cache_entry **buckets = calloc(size, sizeof(struct cache_entry *));
+
+		for (i = 0; i < c->size; i++) {
+			struct cache_entry *n, *next;
+			for (n = c->buckets[i]; n; n = next) {
+				next = n->next;
+				n->next = buckets[n->hash & (size - 1)];
+				buckets[n->hash & (size - 1)] = n;
+			}
+		}
+
+		free(c->buckets);
+		c->buckets = buckets;
+		c->size = size;
+	}
+
+	e->next = c->buckets[e->hash & (c->size - 1)];
+	c->buckets[e->hash & (c->size - 1)] = e;
+	c->count++;
+	lru_push(c, e);
+}
+
+static void cache_free(struct rr_cache *c) {
+	size_t i;
+
+	for (i = 0; i < c->size; i++) {
+		while (c->buckets[i]) {
+			struct cache_entry *e = c->buckets[i];
+			c->buckets[i] = e->next;
+			rr_entry_destroy(e->rr);
+			free(e);
+		}
+	}
+
+	free(c->buckets);
+	c->buckets = NULL;
+	c->size = c->count = 0;
+	c->lru_head = c->lru_tail = NULL;
+}
+
+static struct browse_query *browse_query_find(struct mdnsd *svr, const uint8_t *type) {
+	struct browse_query *q;
+
+	for (q = svr->queries; q; q = q->next)
+		if (cmp_nlabel(q->type, type) == 0)
+			return q;
+
+	return NULL;
+}
+
+// returns the browsed type a name is, or is an instance of, NULL if none
+static struct browse_query *browse_query_of(struct mdnsd *svr, const uint8_t *name) {
+	struct browse_query *q = browse_query_find(svr, name);
+
+	return q != NULL || *name == 0 ? q : browse_query_find(svr, name + *name + 1);
+}
+
+// returns the strings of a TXT record, NULL terminated. The strings are
+// those of the record, which are NUL terminated after their length byte
+// free() after use
+static const char **txt_strings(const struct rr_entry *txt) {
+	const struct rr_data_txt *t;
+	const char **strings;
+	int n = 0;
+
+	for (t = &txt->data.TXT; t; t = t->next)
+		n++;
+
+	strings = malloc((n + 1) * sizeof(char *));
+	for (n = 0, t = &txt->data.TXT; t; t = t->next)
+		if (t->txt[0])
+			strings[n++] = (const char *) t->txt + 1;
+	strings[n] = NULL;
+
+	return strings;
+}
+
+// tells the browses of q, or only b if it is not NULL, about the instance
+// a PTR of its type points to, with what is cached about it
+static void browse_report(struct mdnsd *svr, struct browse_query *q, struct mdns_browse *b,
+		const struct rr_entry *ptr, bool removed, uint64_t now) {
+	const uint8_t *instance = MDNS_RR_GET_PTR_NAME(ptr);
+	struct rr_entry *srv = NULL, *txt = NULL, *a;
+	struct mdns_browse_result res;
+	char *hostname = NULL;
+	const char **txts = NULL;
+
+	memset(&res, 0, sizeof(res));
+	res.instance = nlabel_to_str(instance);
+	res.type = nlabel_to_str(q->type);
+	res.removed = removed;
+
+	if (!removed) {
+		srv = cache_get(&svr->cache, instance, RR_SRV, now);
+		txt = cache_get(&svr->cache, instance, RR_TXT, now);
+	}
+
+	if (srv != NULL) {
+		res.hostname = hostname = nlabel_to_str(srv->data.SRV.target);
+		res.port = srv->data.SRV.port;
+		if ((a = cache_get(&svr->cache, srv->data.SRV.target, RR_A, now)) != NULL)
+			res.addr.s_addr = a->data.A.addr;
+		if ((a = cache_get(&svr->cache, srv->data.SRV.target, RR_AAAA, now)) != NULL)
+			res.addr6 = a->data.AAAA.addr;
+	}
+
+	if (txt != NULL)
+		res.txt = txts = txt_strings(txt);
+
+	if (b != NULL)
+		b->cb(b->arg, &res);
+	else
+		for (b = q->browses; b; b = b->next)
+			b->cb(b->arg, &res);
+
+	free((char *) res.instance);
+	free((char *) res.type);
+	free(hostname);
+	free(txts);
+}
+
+// collects in list the cached PTRs of browsed types whose instance the
+// new record rr tells about, each one once
+static void browse_changed(struct mdnsd *svr, struct mdns_arena *arena, struct rr_list **list,
+		const struct rr_entry *rr, uint64_t now) {
+	struct rr_cache *c = &svr->cache;
+	struct browse_query *q;
+
+	for (q = svr->queries; q; q = q->next) {
+		uint32_t hash = cache_hash(q->type, RR_PTR);
+		struct cache_entry *e = NULL;
+
+		while ((e = cache_find(c, q->type, RR_PTR, hash, e)) != NULL) {
+			const uint8_t *instance = e->rr->data.PTR.name;
+			struct rr_entry *srv;
+			bool about;
+
+			if (e->expire_ms <= now)
+				continue;
+
+			switch (rr->type) {
+				case RR_PTR:
+					about = e->rr == rr;
+					break;
+
+				case RR_SRV:
+				case RR_TXT:
+					about = cmp_nlabel(instance, rr->name) == 0;
+					break;
+
+				default:
+					// an address of the host of the instance
+					srv = cache_get(c, instance, RR_SRV, now);
+					about = srv != NULL && cmp_nlabel(srv->data.SRV.target, rr->name) == 0;
+			}
+
+			if (about && !rr_list_has(*list, e->rr))
+				rr_list_append_arena(arena, list, e->rr);
+		}
+	}
+}
+
+// forgets a record taken out of its bucket, telling the browses if it is
+// the PTR of an instance of a browsed type
+static void cache_drop(struct mdnsd *svr, struct cache_entry *e, uint64_t now) {
+	struct browse_query *q = e->rr->type == RR_PTR ? browse_query_find(svr, e->rr->name) : NULL;
+
+	if (q != NULL)
+		browse_report(svr, q, NULL, e->rr, true, now);
+
+	lru_unlink(&svr->cache, e);
+	svr->cache.count--;
+	rr_entry_destroy(e->rr);
+	free(e);
+}
+
+// makes room for a record by forgetting the least recently used one
+static void cache_evict(struct mdnsd *svr, uint64_t now) {
+	struct rr_cache *c = &svr->cache;
+	struct cache_entry *e = c->lru_tail, **pe;
+
+	for (pe = &c->buckets[e->hash & (c->size - 1)]; *pe != e; pe = &(*pe)->next);
+	*pe = e->next;
+	cache_drop(svr, e, now);
+}
+
+// responses are parsed while they may be cached
+static void caching_update(struct mdnsd *svr) {
+	store_relaxed(&svr->caching, svr->passive || svr->queries != NULL || svr->cache.count > 0);
+}
+
+// caches a record received at now, or refreshes the cached one. Unless
+// wanted, only records of a name and type already cached are taken.
+// Unique records flush those of their name and type received more than
+// CACHE_GRACE ago, and a goodbye leaves a record CACHE_GRACE more
+// returns the new cached record, NULL if there is none
+static struct rr_entry *cache_add(struct mdnsd *svr, const struct rr_entry *rr, uint64_t now, bool wanted) {
+	struct rr_cache *c = &svr->cache;
+	uint32_t hash = cache_hash(rr->name, rr->type);
+	struct cache_entry *e = NULL, *found = NULL;
+	bool known = false;
+
+	while ((e = cache_find(c, rr->name, rr->type, hash, e)) != NULL) {
+		known = true;
+		if (rr_entry_same(e->rr, rr)) {
+			found = e;
+		} else if (rr->cache_flush && e->recv_ms + CACHE_GRACE <= now && e->expire_ms > now + CACHE_GRACE) {
+			e->expire_ms = now + CACHE_GRACE;
+			e->refreshed = true;
+		}
+	}
+
+	if (found != NULL) {
+		cache_touch(c, found);
+		found->recv_ms = now;
+		found->expire_ms = now + (rr->ttl ? rr->ttl * 1000ULL : CACHE_GRACE);
+		found->refreshed = rr->ttl == 0;
+		found->rr->ttl = rr->ttl ? rr->ttl : 1;
+		return NULL;
+	}
+
+	if (rr->ttl == 0 || rr->rr_class != 1 || !(wanted || known))
+		return NULL;
+
+	e = malloc(sizeof(struct cache_entry));
+	e->rr = rr_entry_copy(rr);
+	if (e->rr == NULL) {
+		free(e);
+		return NULL;
+	}
+	e->hash = hash;
+	e->recv_ms = now;
+	e->expire_ms = now + rr->ttl * 1000ULL;
+	e->refreshed = false;
+	cache_insert(c, e);
+
+	return e->rr;
+}
+
+// forgets the expired records, telling the browses about the instances
+// that went away. A browsed type is queried again when one of its PTRs is
+// QUERY_REFRESH percent of its TTL old
+static void cache_expire(struct mdnsd *svr, uint64_t now) {
+	struct rr_cache *c = &svr->cache;
+	size_t i;
+
+	c->sweep_ms = now + CACHE_SWEEP;
+	for (i = 0; i < c->size; i++) {
+		struct cache_entry **pe = &c->buckets[i], *e;
+
+		while ((e = *pe) != NULL) {
+			struct browse_query *q;
+
+			if (e->expire_ms <= now) {
+				*pe = e->next;
+				cache_drop(svr, e, now);
+				continue;
+			}
+
+			q = e->rr->type == RR_PTR ? browse_query_find(svr, e->rr->name) : NULL;
+			if (q != NULL && !e->refreshed &&
+					(now - e->recv_ms) * 100 >= e->rr->ttl * 1000ULL * QUERY_REFRESH) {
+				e->refreshed = true;
+				q->refresh = true;
+			}
+			pe = &e->next;
+		}
+	}
+}
+
+// caches the records of a response, all of them if every response is or
+// if it tells about a browsed type, otherwise only those refreshing or
+// flushing cached ones. The browses are told about the instances which got
+// new records, then the least recently used records make room
+static void cache_update(struct mdnsd *svr, struct mdns_pkt *pkt) {
+	struct rr_list *sections[2] = { pkt->rr_ans, pkt->rr_add };
+	struct rr_list *l, *added = NULL, *changed = NULL;
+	uint64_t now = mdns_time_ms();
+	bool wanted;
+	int i;
+
+	mutex_lock(svr->cache_lock);
+
+	// worker 0 sweeps while there are browses, responses do it otherwise
+	if (now >= svr->cache.sweep_ms)
+		cache_expire(svr, now);
+
+	wanted = svr->passive;
+	for (i = 0; i < 2 && !wanted; i++)
+		for (l = sections[i]; l && !wanted; l = l->next)
+			wanted = browse_query_of(svr, l->e->name) != NULL;
+
+	for (i = 0; i < 2; i++) {
+		for (l = sections[i]; l; l = l->next) {
+			struct rr_entry *e = cache_add(svr, l->e, now, wanted);
+			if (e != NULL)
+				rr_list_append_arena(pkt->arena, &added, e);
+		}
+	}
+
+	// the whole response is cached before the instances are reported
+	for (l = added; l; l = l->next)
+		browse_changed(svr, pkt->arena, &changed, l->e, now);
+	for (l = changed; l; l = l->next)
+		browse_report(svr, browse_query_find(svr, l->e->name), NULL, l->e, false, now);
+
+	while (svr->cache.count > svr->cache.max)
+		cache_evict(svr, now);
+
+	caching_update(svr);
+
+	mutex_unlock(svr->cache_lock);
+}
+
+#ifdef HANDOFF
+// queues a multicast packet for the worker owner, which worker 0 wakes up
+// after its batch. A full ring drops it, as a full socket buffer would
+// returns false if the owner can't answer it and worker 0 has to
+static bool handoff_push(struct mdnsd_worker *w, int owner, const uint8_t *pkt_buf, size_t pkt_len,
+		const union sockaddr_any *from, unsigned int ifindex) {
+	struct mdnsd_worker *o = w->svr->workers + owner;
+	size_t head = o->handoff_head;
+	struct handoff *h;
+
+	if (pkt_len > HANDOFF_PKT_SIZE || worker_fd(o, from->sa.sa_family) < 0)
+		return false;
+
+	if (head - load_acquire(&o->handoff_tail) == HANDOFF_SLOTS)
+		return true;
+
+	h = o->handoffs + (head & (HANDOFF_SLOTS - 1));
+	memcpy(h->pkt, pkt_buf, pkt_len);
+	h->len = pkt_len;
+	h->from = *from;
+	h->ifindex = ifindex;
+	store_release(&o->handoff_head, head + 1);
+
+	w->handoff_wake |= (uint64_t) 1 << owner;
+	return true;
+}
+#endif
+
+// parses a received datagram and encodes the reply to it into out, which
+// may be the datagram itself as the parsed packet lives in the arena.
+// ifindex is the interface it came from, see iface_scope()
+// returns the length of the reply, 0 if there is nothing to send
+static size_t process_datagram(struct mdnsd_worker *w, struct mdns_arena *arena, struct mdns_pkt *reply,
+		uint8_t *pkt_buf, size_t pkt_len, const union sockaddr_any *from, unsigned int ifindex, bool multicast,
+		uint8_t *out, size_t out_len) {
+	struct mdns_pkt_view view;
+	struct mdns_pkt *mdns;
+	struct tc_query *t;
+	bool more;
+	int owner;
+
+	mdns_arena_reset(arena);
+
+	if (!mdns_view_init(&view, pkt_buf, pkt_len))
+		return 0;
+
+	if (multicast && w->svr->num_workers > 1 && (owner = pkt_owner(w->svr, &view, from)) != w->id) {
+#ifdef HANDOFF
+		if (owner < 0 || handoff_push(w, owner, pkt_buf, pkt_len, from, ifindex))
+			return 0;
+#else
+		return 0;
+#endif
+	}
+
+	// responses are only of use to the cache
+	if (view.flags & MDNS_FLAG_RESP) {
+		if (load_relaxed(&w->svr->caching) && sockaddr_port(from) == MDNS_PORT &&
+				MDNS_FLAG_GET_OPCODE(view.flags) == 0 && MDNS_FLAG_GET_RCODE(view.flags) == 0 &&
+				(mdns = mdns_parse_pkt_arena(arena, pkt_buf, pkt_len)) != NULL)
+			cache_update(w->svr, mdns);
+		return 0;
+	}
+
+	// the rest of the known answers of a query we are holding
+	more = (view.flags & MDNS_FLAG_TC) != 0;
+	t = tc_find(w, from);
+	if (t != NULL) {
+		if (!tc_add(w, t, pkt_buf, pkt_len, more))
+			return 0;
+
+		mdns = tc_parse(t, arena);
+		tc_free(t);
+		return mdns != NULL ? answer_query(w, mdns, reply, from, ifindex, out, out_len) : 0;
+	}
+
+	// most packets are responses or questions about names we don't
+	// own, drop them by looking at the raw packet before parsing it
+	if (!pkt_is_for_us(w, &view))
+		return 0;
+
+	// more known answers to come, wait for them unless we can't keep them
+	if (more && (t = tc_start(w, from, ifindex)) != NULL && !tc_add(w, t, pkt_buf, pkt_len, more))
+		return 0;
+
+	mdns = mdns_parse_pkt_arena(arena, pkt_buf, pkt_len);
+	if (mdns == NULL)
+		return 0;
+
+	return answer_query(w, mdns, reply, from, ifindex, out, out_len);
+}
+
+#ifdef BATCH_IO
+struct batch {
+	struct mmsghdr in[BATCH_SIZE];
+	struct iovec in_iov[BATCH_SIZE];
+	union sockaddr_any from[BATCH_SIZE];
+	uint8_t ctrl[BATCH_SIZE][PKTINFO_SIZE] __attribute__((aligned(sizeof(size_t))));
+	struct mmsghdr out[BATCH_SIZE];
+	struct iovec out_iov[BATCH_SIZE];
+	uint8_t out_ctrl[BATCH_SIZE][PKTINFO_SIZE] __attribute__((aligned(sizeof(size_t))));
+	union sockaddr_any toaddr;
+	int family;
+	int pending;
+	uint8_t *in_buf;
+	uint8_t *out_buf;	// twice PACKET_SIZE, see batch_process()
+	size_t out_off;
+};
+
+// a batch serves the socket of one address family
+static struct batch *batch_create(int family) {
+	struct batch *b = calloc(1, sizeof(struct batch));
+	int i;
+
+	b->in_buf = malloc(BATCH_SIZE * BATCH_PKT_SIZE);
+	b->out_buf = malloc(2 * PACKET_SIZE);
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		b->in_iov[i].iov_base = b->in_buf + i * BATCH_PKT_SIZE;
+		b->in_iov[i].iov_len = BATCH_PKT_SIZE;
+		b->in[i].msg_hdr.msg_iov = b->in_iov + i;
+		b->in[i].msg_hdr.msg_iovlen = 1;
+		b->in[i].msg_hdr.msg_name = b->from + i;
+		b->out[i].msg_hdr.msg_iov = b->out_iov + i;
+		b->out[i].msg_hdr.msg_iovlen = 1;
+		b->out[i].msg_hdr.msg_name = &b->toaddr;
+	}
+
+	b->family = family;
+	mdns_group(&b->toaddr, family);
+
+	return b;
+}
+
+static void batch_free(struct batch *b) {
+	free(b->in_buf);
+	free(b->out_buf);
+	free(b);
+}
+
+// sends all the pending multicast replies at once
+static void batch_flush(struct mdnsd_worker *w, struct batch *b, int fd) {
+	int sent = 0, n = 0;
+
+	while (sent < b->pending) {
+		int r = sendmmsg(fd, b->out + sent, b->pending - sent, 0);
+		if (r <= 0) {
+			log_message(LOG_ERR, "sendmmsg(): %m\n");
+			break;
+		}
+		sent += r;
+		n++;
+	}
+
+	stats_add(w, tx_packets, sent);
+	stats_add(w, tx_batches, n);
+
+	b->pending = 0;
+	b->out_off = 0;
+}
+
+// answers a datagram of the family of the batch, the reply is sent with
+// the others by batch_flush(). from has to stay valid until then
+static void batch_answer(struct mdnsd_worker *w, struct batch *b, int fd, struct mdns_arena *arena,
+		struct mdns_pkt *reply, uint8_t *pkt_buf, size_t pkt_len, union sockaddr_any *from,
+		unsigned int ifindex, bool multicast) {
+	struct msghdr *reply_msg;
+	const struct mdnsd_iface *ifc;
+	uint8_t *out;
+	size_t replylen;
+
+	// each reply may use up to PACKET_SIZE like in the single packet
+	// path, so only start one in the first half of the buffer
+	if (b->out_off >= PACKET_SIZE)
+		batch_flush(w, b, fd);
+
+	out = b->out_buf + b->out_off;
+	replylen = process_datagram(w, arena, reply, pkt_buf, pkt_len, from, ifindex, multicast, out, PACKET_SIZE);
+	if (!replylen)
+		return;
+
+	// unicast replies go out in the same sendmmsg() call
+	reply_msg = &b->out[b->pending].msg_hdr;
+	if (reply->unicast) {
+		reply_msg->msg_name = from;
+		stats_add(w, tx_unicast, 1);
+	} else {
+		reply_msg->msg_name = &b->toaddr;
+		stats_add(w, tx_multicast, 1);
+	}
+	reply_msg->msg_namelen = sockaddr_len(reply_msg->msg_name);
+
+	// out of the interface the query came in from
+	ifc = iface_get(w->svr, ifindex);
+	reply_msg->msg_control = ifc ? b->out_ctrl[b->pending] : NULL;
+	reply_msg->msg_controllen = ifc ? pktinfo_set(b->out_ctrl[b->pending], b->family, ifc) : 0;
+	b->out_iov[b->pending].iov_base = out;
+	b->out_iov[b->pending].iov_len = replylen;
+	b->pending++;
+	b->out_off += replylen;
+}
+
+// drains up to BATCH_SIZE datagrams and answers them
+static void batch_process(struct mdnsd_worker *w, struct batch *b, int fd,
+		struct mdns_arena *arena, struct mdns_pkt *reply) {
+	int i, n;
+
+	for (i = 0; i < BATCH_SIZE; i++) {
+		b->in[i].msg_hdr.msg_namelen = sizeof(union sockaddr_any);
+		b->in[i].msg_hdr.msg_control = b->ctrl[i];
+		b->in[i].msg_hdr.msg_controllen = PKTINFO_SIZE;
+	}
+
+	n = recvmmsg(fd, b->in, BATCH_SIZE, MSG_DONTWAIT, NULL);
+	if (n <= 0) {
+		if (n < 0)
+			log_message(LOG_ERR, "recvmmsg(): %m\n");
+		return;
+	}
+
+	stats_add(w, rx_packets, n);
+	stats_add(w, rx_batches, 1);
+
+	for (i = 0; i < n; i++) {
+		struct msghdr *msg = &b->in[i].msg_hdr;
+		unsigned int ifindex;
+		bool multicast;
+
+		DEBUG_PRINTF("data family=%d size=%u\n", b->family, b->in[i].msg_len);
+
+		// nothing legitimate is larger than the slot, don't parse half of it
+		if (msg->msg_flags & MSG_TRUNC)
+			continue;
+
+		// the source address stays valid until the batch is flushed
+		multicast = msg_to_multicast(msg, &ifindex);
+		ifindex = iface_scope(w->svr, ifindex);
+		batch_answer(w, b, fd, arena, reply, msg->msg_iov->iov_base, b->in[i].msg_len,
+				b->from + i, ifindex, multicast);
+	}
+
+	batch_flush(w, b, fd);
+}
+#endif
+
+int create_pipe(int handles[2]) {
+#ifdef _WIN32
+	SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
+	struct sockaddr_in serv_addr;
+	int len;
+
+	if (sock == INVALID_SOCKET) {
+		return -1;
+	}
+
+	memset(&serv_addr, 0, sizeof(serv_addr));
+	serv_addr.sin_family = AF_INET;
+	serv_addr.sin_port = htons(0);
+	serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+	if (bind(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == SOCKET_ERROR) {
+		closesocket(sock);
+		return -1;
+	}
+	if (listen(sock, 1) == SOCKET_ERROR) {
+		closesocket(sock);
+		return -1;
+	}
+	len = sizeof(serv_addr);
+	if (getsockname(sock, (SOCKADDR*)&serv_addr, &len) == SOCKET_ERROR) {
+		closesocket(sock);
+		return -1;
+	}
+	if ((handles[1] = socket(PF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
+		closesocket(sock);
+		return -1;
+	}
+	if (connect(handles[1], (struct sockaddr*)&serv_addr, len) == SOCKET_ERROR) {
+		closesocket(sock);
+		return -1;
+	}
+	if ((handles[0] = accept(sock, (struct sockaddr*)&serv_addr, &len)) == INVALID_SOCKET) {
+		closesocket((SOCKET)handles[1]);
+		handles[1] = INVALID_SOCKET;
+		closesocket(sock);
+		return -1;
+	}
+	closesocket(sock);
+	return 0;
+#else
+	return pipe(handles);
+#endif
+}
+
+int read_pipe(int s, char* buf, int len) {
+#ifdef _WIN32
+	int ret = recv(s, buf, len, 0);
+	if (ret < 0 && WSAGetLastError() == WSAECONNRESET) {
+		ret = 0;
+	}
+	return ret;
+#else
+	return read(s, buf, len);
+#endif
+}
+
+int write_pipe(int s, char* buf, int len) {
+#ifdef _WIN32
+	return send(s, buf, len, 0);
+#else
+	return write(s, buf, len);
+#endif
+}
+
+int close_pipe(int s) {
+#ifdef _WIN32
+	return closesocket(s);
+#else
+	return close(s);
+#endif
+}
+
+#define EVENT_NOTIFY 0x01
+#define EVENT_SOCKET 0x02
+#define EVENT_SOCKET6 0x04
+
+// creates what a worker needs to wait for packets and wakeups
+static int events_init(struct mdnsd_worker *w) {
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+
+	w->epoll_fd = epoll_create1(EPOLL_CLOEXEC);
+	if (w->epoll_fd < 0)
+		return -1;
+
+	w->event_fd = eventfd(0, EFD_CLOEXEC | EFD_NONBLOCK);
+	if (w->event_fd < 0) {
+		close(w->epoll_fd);
+		return -1;
+	}
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = EVENT_NOTIFY;
+	if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->event_fd, &ev) < 0) {
+		close(w->event_fd);
+		close(w->epoll_fd);
+		return -1;
+	}
+
+	return 0;
+#else
+	return create_pipe(w->notify_pipe);
+#endif
+}
+
+// adds the sockets to the set the worker waits on
+static int events_add_socket(struct mdnsd_worker *w) {
+#ifdef USE_EPOLL
+	struct epoll_event ev;
+
+	memset(&ev, 0, sizeof(ev));
+	ev.events = EPOLLIN;
+	ev.data.u32 = EVENT_SOCKET;
+	if (epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->sockfd, &ev) < 0)
+		return -1;
+	if (w->sockfd6 < 0)
+		return 0;
+	ev.data.u32 = EVENT_SOCKET6;
+	return epoll_ctl(w->epoll_fd, EPOLL_CTL_ADD, w->sockfd6, &ev);
+#else
+	(void) w;
+	return 0;
+#endif
+}
+
+static void events_close(struct mdnsd_worker *w) {
+#ifdef USE_EPOLL
+	close(w->event_fd);
+	close(w->epoll_fd);
+#else
+	close_pipe(w->notify_pipe[0]);
+	close_pipe(w->notify_pipe[1]);
+#endif
+}
+
+// wakes up a worker
+static void events_notify(struct mdnsd_worker *w) {
+#ifdef USE_EPOLL
+	uint64_t one = 1;
+	(void) !write(w->event_fd, &one, sizeof(one));
+#else
+	write_pipe(w->notify_pipe[1], ".", 1);
+#endif
+}
+
+// waits at most timeout ms (forever if < 0) for a packet or a wakeup, the
+// latter is consumed here. returns the EVENT_ flags of what happened
+static int events_wait(struct mdnsd_worker *w, int timeout) {
+	int events = 0;
+#ifdef USE_EPOLL
+	struct epoll_event ev[3];
+	int i, n;
+
+	n = epoll_wait(w->epoll_fd, ev, sizeof(ev) / sizeof(ev[0]), timeout);
+	for (i = 0; i < n; i++)
+		events |= ev[i].data.u32;
+
+	if (events & EVENT_NOTIFY) {
+		uint64_t count;
+		(void) !read(w->event_fd, &count, sizeof(count));
+	}
+#else
+	fd_set sockfd_set;
+	struct timeval tv;
+	char notify_buf[2];	// buffer for reading of notify_pipe
+	int max_fd = w->sockfd;
+
+	if (w->notify_pipe[0] > max_fd)
+		max_fd = w->notify_pipe[0];
+	if (w->sockfd6 > max_fd)
+		max_fd = w->sockfd6;
+
+	tv.tv_sec = timeout / 1000;
+	tv.tv_usec = (timeout % 1000) * 1000;
+
+	FD_ZERO(&sockfd_set);
+	FD_SET(w->sockfd, &sockfd_set);
+	FD_SET(w->notify_pipe[0], &sockfd_set);
+	if (w->sockfd6 >= 0)
+		FD_SET(w->sockfd6, &sockfd_set);
+	if (select(max_fd + 1, &sockfd_set, NULL, NULL, timeout < 0 ? NULL : &tv) > 0) {
+		if (FD_ISSET(w->notify_pipe[0], &sockfd_set)) {
+			// flush the notify_pipe
+			read_pipe(w->notify_pipe[0], (char*)&notify_buf, 1);
+			events |= EVENT_NOTIFY;
+		}
+		if (FD_ISSET(w->sockfd, &sockfd_set))
+			events |= EVENT_SOCKET;
+		if (w->sockfd6 >= 0 && FD_ISSET(w->sockfd6, &sockfd_set))
+			events |= EVENT_SOCKET6;
+	}
+#endif
+
+	return events;
+}
+
+static void announce_link(struct announce **head, struct announce *a) {
+	a->prev = NULL;
+	a->next = *head;
+	if (*head)
+		(*head)->prev = a;
+	*head = a;
+}
+
+static void announce_unlink(struct announce **head, struct announce *a) {
+	if (a->prev)
+		a->prev->next = a->next;
+	else
+		*head = a->next;
+	if (a->next)
+		a->next->prev = a->prev;
+}
+
+// copies the records of a list published on the interface ifindex
+// returns their number
+static uint16_t rr_list_scope(struct mdns_arena *arena, struct rr_list **dst,
+		const struct rr_list *src, unsigned int ifindex) {
+	uint16_t num = 0;
+
+	*dst = NULL;
+	for (; src; src = src->next)
+		if (rr_on_iface(src->e, ifindex))
+			num += rr_list_append_arena(arena, dst, src->e);
+
+	return num;
+}
+
+// multicasts the records of reply on the interface ifindex, emptying it
+// returns false if the deadline passed before the end
+static bool announce_encode(struct mdnsd_worker *w, struct mdns_pkt *reply, unsigned int ifindex,
+		uint64_t deadline) {
+	while (reply->num_ans_rr > 0) {
+		size_t replylen = mdns_encode_pkt(reply, w->pkt_buffer, w->svr->pkt_max);
+		if (replylen == (size_t) -1)
+			break;
+		send_group(w, AF_UNSPEC, ifindex, w->pkt_buffer, replylen);
+
+		if (reply->num_ans_rr > 0 && mdns_time_ms() >= deadline)
+			return false;
+	}
+
+	return true;
+}
+
+// multicasts the announces or goodbyes gathered in reply, each interface
+// gets the records published on it. The records must stay valid without
+// data_lock, those of the store and the retired ones do until
+// reader_leave(). returns false if the deadline passed before the end
+static bool announce_send(struct mdnsd_worker *w, struct mdns_pkt *reply, uint64_t deadline) {
+	struct mdnsd *svr = w->svr;
+	int i, n = load_acquire(&svr->num_ifaces);
+	bool done = true;
+
+	if (n == 1)
+		return announce_encode(w, reply, 0, deadline);
+
+	for (i = 0; done && i < n; i++) {
+		struct mdns_pkt scoped = *reply;
+		unsigned int ifindex = svr->ifaces[i].ifindex;
+
+		scoped.num_ans_rr = rr_list_scope(reply->arena, &scoped.rr_ans, reply->rr_ans, ifindex);
+		scoped.num_auth_rr = rr_list_scope(reply->arena, &scoped.rr_auth, reply->rr_auth, ifindex);
+		scoped.num_add_rr = rr_list_scope(reply->arena, &scoped.rr_add, reply->rr_add, ifindex);
+		done = announce_encode(w, &scoped, ifindex, deadline);
+	}
 
-		// additional records for additional records
-		add_related_rr(svr, reply->rr_add, reply);
+	return done;
+}
 
-		DEBUG_PRINTF("\n");
+// sends the announces and goodbyes that are due, worker 0 only. Those due
+// together are packed in as few packets as fit, what the pacing leaves
+// over goes out at the next tick of the wheel. The packets are filled
+// under data_lock and sent once it is released
+static void send_announces(struct mdnsd_worker *w) {
+	struct mdnsd *svr = w->svr;
+	struct mdns_pkt pkts[ANNOUNCE_BURST];
+	struct mdns_pkt *reply = pkts;
+	uint64_t now = mdns_time_ms();
+	struct announce *a = NULL;
+	struct rr_list *gone = NULL;
+	size_t len = MDNS_HEADER_SIZE;
+	int count = 0, i, next;
+
+	mdns_arena_reset(w->arena);
+	memset(pkts, 0, sizeof(pkts));
+	for (i = 0; i < ANNOUNCE_BURST; i++) {
+		pkts[i].arena = w->arena;
+		mdns_init_reply(pkts + i, 0);
+	}
 
-		return reply->num_ans_rr;
+	mutex_lock(svr->data_lock);
+
+	while ((a = (struct announce *) mdns_wheel_pop(&svr->wheel, now)) != NULL) {
+		size_t size = announce_records(svr, reply, a, false);
+		char *namestr;
+
+		// announces and goodbyes do not share packets, which stay in the MTU
+		if (reply->num_ans_rr > 0 &&
+				(reply->goodbye != a->leave || len + size > announce_max(svr))) {
+			len = MDNS_HEADER_SIZE;
+
+			// this one starts the first packet of the next tick
+			if (++count == ANNOUNCE_BURST)
+				break;
+			reply = pkts + count;
+		}
+
+		namestr = nlabel_to_str(a->ptr->name);
+		DEBUG_PRINTF("sending %s for %s\n", a->leave ? "bye-bye" : "announce", namestr);
+		free(namestr);
+
+		reply->goodbye = a->leave;
+		len += announce_records(svr, reply, a, true);
+
+		if (a->leave) {
+			// other workers may still be answering with them
+			rr_list_append(&gone, a->ptr->data.PTR.entry);
+			rr_list_append(&gone, a->ptr);
+
+			announce_unlink(&svr->leaving, a);
+			free(a);
+		} else if (++a->sent < ANNOUNCE_COUNT) {
+			mdns_wheel_insert(&svr->wheel, &a->node, now, now + (ANNOUNCE_INTERVAL << (a->sent - 1)));
+		}
 	}
 
-	return 0;
+	if (a != NULL)
+		mdns_wheel_insert(&svr->wheel, &a->node, now, now + MDNS_WHEEL_TICK);
+	else if (reply->num_ans_rr > 0)
+		count++;
+
+	// the goodbyes are sent after this, but nothing retired from now on is
+	// freed before reader_leave()
+	if (gone)
+		retire(svr, NULL, NULL, gone);
+
+	next = mdns_wheel_next(&svr->wheel, now);
+
+	// what was retired while workers were busy can probably go now
+	if (svr->retired)
+		reclaim(svr);
+
+	mutex_unlock(svr->data_lock);
+
+	for (i = 0; i < count; i++)
+		announce_send(w, pkts + i, UINT64_MAX);
+
+	if (next < 0)
+		mdns_timer_cancel(&w->timers, &w->announce_timer);
+	else
+		mdns_timer_arm(&w->timers, &w->announce_timer, now + (next ? next : MDNS_WHEEL_TICK));
 }
 
-int create_pipe(int handles[2]) {
-#ifdef _WIN32
-	SOCKET sock = socket(AF_INET, SOCK_STREAM, 0);
-	struct sockaddr_in serv_addr;
-	int len;
+// adds the goodbyes of a list of services to reply, data_lock must be held
+// the PTRs stay until worker 0 is gone, see mdnsd_pause()
+static void goodbye_all(struct mdns_pkt *reply, struct announce *a) {
+	reply->goodbye = 1;
+	for (; a; a = a->next)
+		reply->num_ans_rr += rr_list_append_arena(reply->arena, &reply->rr_ans, a->ptr);
+}
 
-	if (sock == INVALID_SOCKET) {
-		return -1;
+static void announce_tick(void *arg) {
+	send_announces(arg);
+}
+
+// encodes the questions about the browsed types that are due into
+// w->pkt_buffer, with their PTRs cached with more than half of their TTL
+// left as known answers (RFC 6762 section 7.1). Must be called with
+// cache_lock held, the packets are sent without it by query_send()
+// returns the number of packets, their lengths are stored in lens
+static int query_build(struct mdnsd_worker *w, uint64_t now, size_t *lens) {
+	struct mdnsd *svr = w->svr;
+	struct mdns_pkt *query = w->reply;
+	size_t pkt_max = svr->pkt_max, off = 0;
+	struct browse_query *q;
+	int count = 0;
+
+	mdns_arena_reset(w->arena);
+	mdns_init_reply(query, 0);
+	query->flags = 0;
+
+	for (q = svr->queries; q; q = q->next) {
+		uint32_t hash = cache_hash(q->type, RR_PTR);
+		struct cache_entry *e = NULL;
+		struct rr_entry *qn;
+
+		if (q->next_ms > now && !q->refresh)
+			continue;
+
+		qn = mdns_arena_alloc(w->arena, sizeof(struct rr_entry));
+		if (qn == NULL)
+			break;
+		memset(qn, 0, sizeof(struct rr_entry));
+		qn->name = q->type;
+		qn->type = RR_PTR;
+		qn->rr_class = 1;
+		query->num_qn += rr_list_append_arena(w->arena, &query->rr_qn, qn);
+
+		while ((e = cache_find(&svr->cache, q->type, RR_PTR, hash, e)) != NULL) {
+			uint64_t left = e->expire_ms > now ? (e->expire_ms - now) / 1000 : 0;
+			struct rr_entry *known;
+
+			if (left == 0 || left * 2 <= e->rr->ttl)
+				continue;
+
+			known = mdns_arena_alloc(w->arena, sizeof(struct rr_entry));
+			if (known == NULL)
+				break;
+			*known = *e->rr;
+			known->ttl = (uint32_t) left;
+			query->num_ans_rr += rr_list_append_arena(w->arena, &query->rr_ans, known);
+		}
 	}
 
-	memset(&serv_addr, 0, sizeof(serv_addr));
-	serv_addr.sin_family = AF_INET;
-	serv_addr.sin_port = htons(0);
-	serv_addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
-	if (bind(sock, (struct sockaddr*)&serv_addr, sizeof(serv_addr)) == SOCKET_ERROR) {
-		closesocket(sock);
-		return -1;
+	// known answers which do not fit follow in packets of their own, those
+	// past QUERY_PKTS are left out, the responders then answer once they
+	// gave up waiting for them
+	while (count < QUERY_PKTS && off + pkt_max <= PACKET_SIZE &&
+			(query->num_qn > 0 || query->num_ans_rr > 0)) {
+		size_t len = mdns_encode_pkt(query, w->pkt_buffer + off, pkt_max);
+		if (len == (size_t) -1)
+			break;
+		lens[count++] = len;
+		off += len;
 	}
-	if (listen(sock, 1) == SOCKET_ERROR) {
-		closesocket(sock);
-		return -1;
+
+	return count;
+}
+
+// multicasts the packets encoded by query_build() on the interface ifindex
+static void query_send(struct mdnsd_worker *w, unsigned int ifindex, const size_t *lens, int count) {
+	const uint8_t *buf = w->pkt_buffer;
+	int i;
+
+	for (i = 0; i < count; i++) {
+		send_group(w, AF_UNSPEC, ifindex, buf, lens[i]);
+		buf += lens[i];
 	}
-	len = sizeof(serv_addr);
-	if (getsockname(sock, (SOCKADDR*)&serv_addr, &len) == SOCKET_ERROR) {
-		closesocket(sock);
-		return -1;
+}
+
+// forgets the expired records and sends the queries that are due, worker
+// 0 only. The timer is armed for the next query or cache sweep
+static void browse_tick(void *arg) {
+	struct mdnsd_worker *w = arg;
+	struct mdnsd *svr = w->svr;
+	uint64_t now = mdns_time_ms(), next = UINT64_MAX;
+	struct browse_query *q;
+	size_t lens[QUERY_PKTS];
+	bool due = false;
+	int i, n, count = 0;
+
+	mutex_lock(svr->cache_lock);
+
+	cache_expire(svr, now);
+
+	for (q = svr->queries; q; q = q->next) {
+		// the first query waits a little, so that types browsed at once
+		// share it
+		if (q->interval == 0) {
+			q->next_ms = now + QUERY_DELAY_MIN + worker_rand(w) % (QUERY_DELAY_MAX - QUERY_DELAY_MIN + 1);
+			q->interval = QUERY_INTERVAL_MIN;
+		}
+		due |= q->next_ms <= now || q->refresh;
 	}
-	if ((handles[1] = socket(PF_INET, SOCK_STREAM, 0)) == INVALID_SOCKET) {
-		closesocket(sock);
-		return -1;
+
+	if (due) {
+		count = query_build(w, now, lens);
+
+		// refreshes do not change the intervals
+		for (q = svr->queries; q; q = q->next) {
+			q->refresh = false;
+			if (q->next_ms <= now) {
+				q->next_ms = now + q->interval;
+				q->interval = q->interval * 2 < QUERY_INTERVAL_MAX ? q->interval * 2 : QUERY_INTERVAL_MAX;
+			}
+		}
 	}
-	if (connect(handles[1], (struct sockaddr*)&serv_addr, len) == SOCKET_ERROR) {
-		closesocket(sock);
-		return -1;
+
+	for (q = svr->queries; q; q = q->next)
+		if (q->next_ms < next)
+			next = q->next_ms;
+	if (svr->cache.count > 0 && now + CACHE_SWEEP < next)
+		next = now + CACHE_SWEEP;
+
+	caching_update(svr);
+
+	mutex_unlock(svr->cache_lock);
+
+	// the same packets go out on every interface
+	n = load_acquire(&svr->num_ifaces);
+	if (count > 0 && n == 1)
+		query_send(w, 0, lens, count);
+	for (i = 0; count > 0 && n > 1 && i < n; i++)
+		query_send(w, svr->ifaces[i].ifindex, lens, count);
+
+	if (next == UINT64_MAX)
+		mdns_timer_cancel(&w->timers, &w->query_timer);
+	else
+		mdns_timer_arm(&w->timers, &w->query_timer, next);
+}
+
+static void worker_close_socks(struct mdnsd_worker *w) {
+	close_pipe(w->sockfd);
+	if (w->sockfd6 >= 0)
+		close_pipe(w->sockfd6);
+}
+
+#ifndef BATCH_IO
+// receives one datagram from fd and answers it
+static void socket_process(struct mdnsd_worker *w, int fd, struct mdns_arena *arena, struct mdns_pkt *reply,
+		uint8_t *pkt_buffer) {
+	union sockaddr_any fromaddr;
+	unsigned int ifindex;
+	size_t replylen;
+	bool multicast;
+
+	ssize_t recvsize = recv_packet(fd, pkt_buffer, PACKET_SIZE, &fromaddr, &multicast, &ifindex);
+	if (recvsize < 0) {
+		log_message(LOG_ERR, "recv(): %m\n");
+		return;
 	}
-	if ((handles[0] = accept(sock, (struct sockaddr*)&serv_addr, &len)) == INVALID_SOCKET) {
-		closesocket((SOCKET)handles[1]);
-		handles[1] = INVALID_SOCKET;
-		closesocket(sock);
-		return -1;
+
+	DEBUG_PRINTF("data family=%d size=%ld\n", fromaddr.sa.sa_family, (long) recvsize);
+
+	stats_add(w, rx_packets, 1);
+	stats_add(w, rx_batches, 1);
+
+	ifindex = iface_scope(w->svr, ifindex);
+	replylen = process_datagram(w, arena, reply, pkt_buffer, recvsize, &fromaddr, ifindex, multicast,
+					pkt_buffer, PACKET_SIZE);
+	if (!replylen)
+		return;
+
+	stats_add(w, tx_packets, 1);
+	stats_add(w, tx_batches, 1);
+
+	if (reply->unicast) {
+		send_unicast(fd, pkt_buffer, replylen, &fromaddr, iface_get(w->svr, ifindex));
+		stats_add(w, tx_unicast, 1);
+	} else {
+		send_packet(fd, fromaddr.sa.sa_family, iface_get(w->svr, ifindex), pkt_buffer, replylen);
+		stats_add(w, tx_multicast, 1);
 	}
-	closesocket(sock);
-	return 0;
-#else
-	return pipe(handles);
+}
 #endif
+
+#ifdef HANDOFF
+// wakes up the workers handoff_push() queued packets for
+static void handoff_wake(struct mdnsd_worker *w) {
+	int i;
+
+	for (i = 1; w->handoff_wake; i++) {
+		if (w->handoff_wake & ((uint64_t) 1 << i)) {
+			events_notify(w->svr->workers + i);
+			w->handoff_wake &= ~((uint64_t) 1 << i);
+		}
+	}
 }
 
-int read_pipe(int s, char* buf, int len) {
-#ifdef _WIN32
-	int ret = recv(s, buf, len, 0);
-	if (ret < 0 && WSAGetLastError() == WSAECONNRESET) {
-		ret = 0;
+// answers the packets worker 0 queued for this worker, BATCH_SIZE at a
+// time so that their slots are given back as the replies go out
+static void handoff_drain(struct mdnsd_worker *w, struct batch *batch, struct batch *batch6,
+		struct mdns_arena *arena, struct mdns_pkt *reply) {
+	size_t head = load_acquire(&w->handoff_head), tail = w->handoff_tail;
+
+	while (tail != head) {
+		size_t end = head - tail > BATCH_SIZE ? tail + BATCH_SIZE : head;
+
+		for (; tail != end; tail++) {
+			struct handoff *h = w->handoffs + (tail & (HANDOFF_SLOTS - 1));
+
+			if (h->from.sa.sa_family == AF_INET6)
+				batch_answer(w, batch6, w->sockfd6, arena, reply, h->pkt, h->len, &h->from, h->ifindex, true);
+			else
+				batch_answer(w, batch, w->sockfd, arena, reply, h->pkt, h->len, &h->from, h->ifindex, true);
+		}
+
+		batch_flush(w, batch, w->sockfd);
+		if (w->sockfd6 >= 0)
+			batch_flush(w, batch6, w->sockfd6);
+		store_release(&w->handoff_tail, tail);
 	}
-	return ret;
-#else
-	return read(s, buf, len);
-#endif
 }
+#endif
 
-int write_pipe(int s, char* buf, int len) {
-#ifdef _WIN32
-	return send(s, buf, len, 0);
-#else
-	return write(s, buf, len);
+// main loop of a worker to receive, process and send out MDNS replies
+// the first worker also handles MDNS service announces
+static void main_loop(struct mdnsd_worker *w) {
+	struct mdnsd *svr = w->svr;
+	struct mdns_pkt *mdns_reply;
+	struct mdns_arena arena;
+	int next_deadline = -1;
+	int i;
+#ifdef BATCH_IO
+	struct batch *batch = batch_create(AF_INET);
+	struct batch *batch6 = batch_create(AF_INET6);
 #endif
-}
 
-int close_pipe(int s) {
-#ifdef _WIN32
-	return closesocket(s);
+	void *pkt_buffer = malloc(PACKET_SIZE);
+
+	// packets, records and reply lists all live in the arena which is reset
+	// for every packet we process or send
+	mdns_arena_init(&arena, ARENA_SIZE);
+
+	mdns_reply = malloc(sizeof(struct mdns_pkt));
+	memset(mdns_reply, 0, sizeof(struct mdns_pkt));
+	mdns_reply->arena = &arena;
+
+	w->arena = &arena;
+	w->reply = mdns_reply;
+	w->pkt_buffer = pkt_buffer;
+
+	while (!load_acquire(&svr->stop_flag)) {
+		int events = events_wait(w, next_deadline);
+
+		// records we answer with can't be freed until reader_leave(), the
+		// aggregated ones keep the worker in the epoch they were found in
+		if (w->aggr_count == 0)
+			reader_enter(w);
+
+		if (events & EVENT_SOCKET) {
+#ifdef BATCH_IO
+			batch_process(w, batch, w->sockfd, &arena, mdns_reply);
 #else
-	return close(s);
+			socket_process(w, w->sockfd, &arena, mdns_reply, pkt_buffer);
+#endif
+		}
+		if (events & EVENT_SOCKET6) {
+#ifdef BATCH_IO
+			batch_process(w, batch6, w->sockfd6, &arena, mdns_reply);
+#else
+			socket_process(w, w->sockfd6, &arena, mdns_reply, pkt_buffer);
+#endif
+		}
+
+#ifdef HANDOFF
+		// worker 0 never has any, the others are woken up for them
+		if (w->handoffs)
+			handoff_drain(w, batch, batch6, &arena, mdns_reply);
+		handoff_wake(w);
+#endif
+
+		// the first worker also takes care of announces and queries, the
+		// API wakes it up when there are new ones
+		if (w->id == 0 && (events & EVENT_NOTIFY)) {
+			send_announces(w);
+			browse_tick(w);
+		}
+
+		// fire due timers, the loop sleeps until the next one at most
+		next_deadline = mdns_timers_run(&w->timers, mdns_time_ms());
+
+		if (w->aggr_count == 0)
+			reader_leave(w);
+	}
+
+	// the goodbyes make the pending answers moot
+	w->aggr_count = 0;
+	for (i = 0; i < TC_MAX; i++)
+		tc_free(w->tc + i);
+
+	// main thread terminating. send out "goodbye packets" for services
+	reader_enter(w);
+	mdns_arena_reset(&arena);
+	mdns_init_reply(mdns_reply, 0);
+
+	if (w->id == 0) {
+		uint64_t deadline = mdns_time_ms() + GOODBYE_TIMEOUT;
+
+		mutex_lock(svr->data_lock);
+		goodbye_all(mdns_reply, svr->services);
+		goodbye_all(mdns_reply, svr->leaving);
+		mutex_unlock(svr->data_lock);
+
+		if (!announce_send(w, mdns_reply, deadline))
+			log_message(LOG_ERR, "out of time for goodbyes\n");
+	}
+	reader_leave(w);
+
+	// destroy packet
+	mdns_init_reply(mdns_reply, 0);
+
+	free(mdns_reply);
+	mdns_arena_free(&arena);
+
+	free(pkt_buffer);
+#ifdef BATCH_IO
+	batch_free(batch);
+	batch_free(batch6);
 #endif
+
+	if (w->stats.rx_batches)
+		DEBUG_PRINTF("worker %d received %llu packets, %.2f per batch\n", w->id, (unsigned long long) w->stats.rx_packets,
+				(double) w->stats.rx_packets / w->stats.rx_batches);
+
+	worker_close_socks(w);
+	mdns_timers_free(&w->timers);
+}
+
+/////////////////////////////////////////////////////
+
+// announces the registered services anew, from the first announce, after
+// a change of the host or of the interfaces (RFC 6762 section 8.3)
+// data_lock must be held
+static void announce_again(struct mdnsd *svr) {
+	uint64_t now = mdns_time_ms();
+	struct announce *a;
+
+	for (a = svr->services; a; a = a->next) {
+		mdns_wheel_cancel(&svr->wheel, &a->node);
+		a->sent = 0;
+		mdns_wheel_insert(&svr->wheel, &a->node, now, now);
+	}
+
+	// a paused responder announces them when it resumes
+	if (svr->services && svr->running)
+		events_notify(svr->workers);
+}
+
+// adds an address record of the host. A and AAAA share the name, its NSEC
+// lists every address type it has and is replaced at each call. The A
+// record of the address of an interface is only published on it
+// dont ask me what happens if the IP changes
+static bool hostname_add(struct mdnsd *svr, struct rr_entry *addr_e) {
+	struct rr_entry *nsec_e = rr_create(addr_e->name, RR_NSEC),
+					*old_e = NULL;
+	struct rr_list *gone = NULL;
+	struct rr_groups *next;
+	int i;
+
+	nsec_e->ttl = DEFAULT_TTL_FOR_RECORD_WITH_HOSTNAME;
+
+	mutex_lock(svr->data_lock);
+
+	// the host has one name whatever the family
+	if (svr->hostname != NULL && svr->hostname != addr_e->name) {
+		char *namestr = nlabel_to_str(addr_e->name);
+		log_message(LOG_ERR, "can't name the host %s, it has another name\n", namestr);
+		free(namestr);
+		mutex_unlock(svr->data_lock);
+		rr_entry_destroy(addr_e);
+		rr_entry_destroy(nsec_e);
+		return false;
+	}
+
+	next = store_begin(svr);
+
+	for (i = 0; addr_e->type == RR_A && i < svr->num_ifaces; i++)
+		if (svr->ifaces[i].addr.s_addr == addr_e->data.A.addr)
+			addr_e->ifindex = svr->ifaces[i].ifindex;
+
+	if (svr->hostname == NULL) {
+		svr->hostname = name_ref(addr_e->name);
+	} else {
+		struct rr_group *g = rr_group_find(next, svr->hostname);
+		old_e = g ? rr_entry_find(g->rr, svr->hostname, RR_NSEC) : NULL;
+	}
+
+	if (old_e) {
+		memcpy(nsec_e->data.NSEC.bitmap, old_e->data.NSEC.bitmap, sizeof(nsec_e->data.NSEC.bitmap));
+		rr_group_remove(next, old_e);
+		rr_list_append(&gone, old_e);
+	}
+	rr_set_nsec(nsec_e, addr_e->type);
+
+	rr_group_add(next, addr_e);
+	rr_group_add(next, nsec_e);
+	// workers may still be answering with the old NSEC
+	store_commit(svr, next, gone);
+
+	// the services go with the new address
+	announce_again(svr);
+	mutex_unlock(svr->data_lock);
+	return true;
 }
 
-// main loop to receive, process and send out MDNS replies
-// also handles MDNS service announces
-static void main_loop(struct mdnsd *svr) {
-	fd_set sockfd_set;
-	int max_fd = svr->sockfd;
-	char notify_buf[2];	// buffer for reading of notify_pipe
-	struct mdns_pkt *mdns_reply;
-	struct mdns_pkt *mdns;
-	struct rr_list *svc_le;
+bool mdnsd_set_hostname(struct mdnsd *svr, const char *hostname, struct in_addr addr) {
+	uint8_t *name = create_nlabel(hostname);
+	bool ok = hostname_add(svr, rr_create_a(name, addr));
+
+	free(name);
+	return ok;
+}
+
+bool mdnsd_set_hostname_v6(struct mdnsd *svr, const char *hostname, struct in6_addr *addr) {
+	uint8_t *name = create_nlabel(hostname);
+	struct in6_addr *copy = malloc(sizeof(struct in6_addr));
+	bool ok;
+
+	// the record owns its address
+	memcpy(copy, addr, sizeof(struct in6_addr));
+	ok = hostname_add(svr, rr_create_aaaa(name, copy));	// 120 seconds automatically
+	free(name);
+	return ok;
+}
+
+void mdnsd_get_stats(struct mdnsd *svr, struct mdnsd_stats *stats) {
+	int i;
+
+	memset(stats, 0, sizeof(struct mdnsd_stats));
+
+	for (i = 0; i < svr->num_workers; i++) {
+		struct worker_stats *ws = &svr->workers[i].stats;
+		stats->rx_packets += load_relaxed(&ws->rx_packets);
+		stats->rx_batches += load_relaxed(&ws->rx_batches);
+		stats->tx_packets += load_relaxed(&ws->tx_packets);
+		stats->tx_batches += load_relaxed(&ws->tx_batches);
+		stats->tx_unicast += load_relaxed(&ws->tx_unicast);
+		stats->tx_multicast += load_relaxed(&ws->tx_multicast);
+		stats->filter_hits += load_relaxed(&ws->filter_hits);
+		stats->filter_misses += load_relaxed(&ws->filter_misses);
+	}
+}
+
+void mdnsd_add_rr(struct mdnsd *svr, struct rr_entry *rr) {
+	struct rr_groups *next;
+
+	mutex_lock(svr->data_lock);
+	next = store_begin(svr);
+	rr_group_add(next, rr);
+	store_commit(svr, next, NULL);
+	mutex_unlock(svr->data_lock);
+}
+
+// builds the records of a service, outside of the lock
+// the service entries are its TXT and SRV, the PTR hangs off its announce
+static struct mdns_service *service_create(struct mdnsd *svr, const char *instance_name,
+		const char *type, uint16_t port, const char *hostname, const char *txt[], unsigned int ifindex) {
+	struct rr_entry *txt_e = NULL, 
+					*srv_e = NULL;
+	struct announce *a;
+	uint8_t *target;
+	uint8_t *inst_nlabel, *type_nlabel, *nlabel;
+	struct mdns_service *service = malloc(sizeof(struct mdns_service));
+	memset(service, 0, sizeof(struct mdns_service));
+
+	// combine service name
+	type_nlabel = create_nlabel(type);
+	inst_nlabel = create_label(instance_name);
+	nlabel = join_nlabel(inst_nlabel, type_nlabel);
+
+	// create TXT record
+	if (txt && *txt) {
+		txt_e = rr_create(nlabel, RR_TXT);
+		rr_list_append(&service->entries, txt_e);
+
+		// add TXTs
+		for (; *txt; txt++) 
+			rr_add_txt(txt_e, *txt);
+	}
+
+	// create SRV record
+	assert(hostname || svr->hostname);	// either one as target
+	target = hostname ? create_nlabel(hostname) : NULL;
+
+	srv_e = rr_create_srv(nlabel, port, target ? target : svr->hostname);
+	rr_list_append(&service->entries, srv_e);
+
+	// create PTR record for type
+	a = calloc(1, sizeof(struct announce));
+	a->ptr = rr_create_ptr(type_nlabel, srv_e);
+	service->announce = a;
+
+	// all published on the same interfaces
+	srv_e->ifindex = a->ptr->ifindex = ifindex;
+	if (txt_e)
+		txt_e->ifindex = ifindex;
+
+	// records have their own (interned) copies of names
+	free(nlabel);
+	free(inst_nlabel);
+	free(type_nlabel);
+	if (target)
+		free(target);
+
+	return service;
+}
+
+// publishes a service created by service_create() in the next store
+// and queues its first announce at now
+// data_lock must be held
+static void service_add(struct mdnsd *svr, struct rr_groups *next,
+		struct mdns_service *svc, uint64_t now) {
+	struct announce *a = svc->announce;
+	struct rr_list *rr;
+
+	for (rr = svc->entries; rr; rr = rr->next)
+		rr_group_add(next, rr->e);
+	rr_group_add(next, a->ptr);
+
+	// create services PTR record for type
+	// this enables the type to show up as a "service"
+	a->bptr = rr_create_ptr(SERVICES_DNS_SD_NLABEL, a->ptr);
+	a->bptr->ifindex = a->ptr->ifindex;
+	rr_group_add(next, a->bptr);
+
+	announce_link(&svr->services, a);
+	mdns_wheel_insert(&svr->wheel, &a->node, now, now);
+}
+
+// withdraws a service from the next store and queues its goodbye at now,
+// what is no longer needed is appended to gone
+// data_lock must be held
+static void service_drop(struct mdnsd *svr, struct rr_groups *next,
+		struct mdns_service *svc, struct rr_list **gone, uint64_t now) {
+	struct rr_list *rr;
+	struct announce *a = svc->announce;
+
+	for (rr = svc->entries; rr; rr = rr->next) {
+		struct rr_entry *ptr_e = NULL;
+
+		// remove entry from its group
+		rr_group_remove(next, rr->e);
 
-	void *pkt_buffer = malloc(PACKET_SIZE);
+		// remove PTR and BPTR related to this SVC, the PTR is owned by the
+		// type name which is the SRV name without the instance label
+		if (rr->e->type == RR_SRV)
+			ptr_e = rr_entry_remove(next, rr->e->name + rr->e->name[0] + 1, rr->e, RR_PTR);
 
-	if (svr->notify_pipe[0] > max_fd)
-		max_fd = svr->notify_pipe[0];
+		if (ptr_e != NULL) {
+			struct rr_entry *bptr_e;
 
-	mdns_reply = malloc(sizeof(struct mdns_pkt));
-	memset(mdns_reply, 0, sizeof(struct mdns_pkt));
+			// find BPTR and remove it from groups
+			bptr_e = rr_entry_remove(next, SERVICES_DNS_SD_NLABEL, ptr_e, RR_PTR);
+			if (bptr_e)
+				rr_list_append(gone, bptr_e);
+
+			// pending announces make way for the goodbye, which keeps
+			// the PTR and SRV until it is sent
+			announce_unlink(&svr->services, a);
+			announce_link(&svr->leaving, a);
+			mdns_wheel_cancel(&svr->wheel, &a->node);
+			a->bptr = NULL;
+			a->leave = true;
+			mdns_wheel_insert(&svr->wheel, &a->node, now, now);
+		} else {
+			// destroy entries not needed for sending "leave" packet
+			rr_list_append(gone, rr->e);
+		}
+	}
 
-	while (! svr->stop_flag) {
-		FD_ZERO(&sockfd_set);
-		FD_SET(svr->sockfd, &sockfd_set);
-		FD_SET(svr->notify_pipe[0], &sockfd_set);
-		select(max_fd + 1, &sockfd_set, NULL, NULL, NULL);
+	// destroy this service entries
+	rr_list_destroy(svc->entries, 0);
+	free(svc);
+}
 
-		if (FD_ISSET(svr->notify_pipe[0], &sockfd_set)) {
-			// flush the notify_pipe
-			read_pipe(svr->notify_pipe[0], (char*)&notify_buf, 1);
-		} else if (FD_ISSET(svr->sockfd, &sockfd_set)) {
-			struct sockaddr_in fromaddr;
-			socklen_t sockaddr_size = sizeof(struct sockaddr_in);
-
-			ssize_t recvsize = recvfrom(svr->sockfd, pkt_buffer, PACKET_SIZE, 0,
-				(struct sockaddr *) &fromaddr, &sockaddr_size);
-			if (recvsize < 0) {
-				log_message(LOG_ERR, "recv(): %m\n");
-			}
+struct mdns_service *mdnsd_register_svc(struct mdnsd *svr, const char *instance_name,
+		const char *type, uint16_t port, const char *hostname, const char *txt[]) {
+	struct mdns_service_desc desc = { instance_name, type, port, hostname, txt, 0 };
+	struct mdns_service *service;
 
-			DEBUG_PRINTF("data from=%s size=%ld\n", inet_ntoa(fromaddr.sin_addr), (long) recvsize);
-			mdns = mdns_parse_pkt(pkt_buffer, recvsize);
-			if (mdns != NULL) {
-				if (process_mdns_pkt(svr, mdns, mdns_reply)) {
-					size_t replylen = mdns_encode_pkt(mdns_reply, pkt_buffer, PACKET_SIZE);
-					if (mdns_reply->unicast) {
-						int sock = socket(fromaddr.sin_family, SOCK_DGRAM, 0);
-						sendto(sock, pkt_buffer, replylen, 0, (void*) &fromaddr, sizeof(struct sockaddr_in));
-						DEBUG_PRINTF("unicast answer\n");
-#ifdef _WIN32
-						closesocket(sock);
-#else
-						close(sock);
-#endif
-					} else {
-						send_packet(svr->sockfd, pkt_buffer, replylen);
-					}
-				} else if (mdns->num_qn == 0) {
-					DEBUG_PRINTF("(no questions in packet)\n\n");
-				}
+	mdnsd_register_svcs(svr, &desc, 1, &service);
+	return service;
+}
 
-				mdns_pkt_destroy(mdns);
-			}
-		}
+void mdnsd_register_svcs(struct mdnsd *svr, const struct mdns_service_desc *descs,
+		int count, struct mdns_service **svcs) {
+	struct rr_groups *next;
+	uint64_t now;
+	int i;
 
-		// send out announces
-		while (1) {
-			struct rr_entry *ann_e = NULL;
-			char *namestr;
+	assert(svr != NULL && (count == 0 || (descs != NULL && svcs != NULL)));
 
-			// extract from head of list
-			mutex_lock(svr->data_lock);
-			if (svr->announce)
-				ann_e = rr_list_remove(&svr->announce, svr->announce->e);
-			mutex_unlock(svr->data_lock);
+	for (i = 0; i < count; i++)
+		svcs[i] = service_create(svr, descs[i].instance_name, descs[i].type,
+				descs[i].port, descs[i].hostname, descs[i].txt, descs[i].ifindex);
 
-			if (! ann_e)
-				break;
+	// modify lists here, the whole set becomes visible at once and is
+	// announced on the same tick
+	mutex_lock(svr->data_lock);
+	next = store_begin(svr);
 
-			namestr = nlabel_to_str(ann_e->name);
-			DEBUG_PRINTF("sending announce for %s\n", namestr);
-			free(namestr);
+	now = mdns_time_ms();
+	for (i = 0; i < count; i++)
+		service_add(svr, next, svcs[i], now);
 
-			announce_srv(svr, mdns_reply, ann_e->name);
+	store_commit(svr, next, NULL);
 
-			if (mdns_reply->num_ans_rr > 0) {
-				size_t replylen = mdns_encode_pkt(mdns_reply, pkt_buffer, PACKET_SIZE);
-				send_packet(svr->sockfd, pkt_buffer, replylen);
-			}
-		}
+	// notify server, unless it is paused
+	if (svr->running)
+		events_notify(svr->workers);
 
-		// send out bye-bye for terminating services
-		while (1) {
-			struct rr_entry *leave_e = NULL;
-			char *namestr;
+	mutex_unlock(svr->data_lock);
+}
 
-			mutex_lock(svr->data_lock);
-			if (svr->leave)
-				leave_e = rr_list_remove(&svr->leave, svr->leave->e);
-			mutex_unlock(svr->data_lock);
+void mdns_service_remove(struct mdnsd *svr, struct mdns_service *svc) {
+	assert(svc != NULL);
+	mdns_services_remove(svr, &svc, 1);
+}
 
-			if (!leave_e)
-				break;
+void mdns_services_remove(struct mdnsd *svr, struct mdns_service **svcs, int count) {
+	struct rr_list *gone = NULL;
+	struct rr_groups *next;
+	uint64_t now;
+	int i;
 
-			mdns_init_reply(mdns_reply, 0);
+	assert(svr != NULL && (count == 0 || svcs != NULL));
 
-			namestr = nlabel_to_str(leave_e->name);
-			DEBUG_PRINTF("sending bye-bye for %s\n", namestr);
-			free(namestr);
+	// modify lists here
+	mutex_lock(svr->data_lock);
+	next = store_begin(svr);
 
-			leave_e->ttl = 0;
-			mdns_reply->num_ans_rr += rr_list_append(&mdns_reply->rr_ans, leave_e);
+	now = mdns_time_ms();
+	for (i = 0; i < count; i++)
+		service_drop(svr, next, svcs[i], &gone, now);
 
-			// send out packet
-			if (mdns_reply->num_ans_rr > 0) {
-				size_t replylen = mdns_encode_pkt(mdns_reply, pkt_buffer, PACKET_SIZE);
-				send_packet(svr->sockfd, pkt_buffer, replylen);
-			}
+	// workers may still be answering with what was removed
+	store_commit(svr, next, gone);
 
-			rr_entry_destroy(leave_e->data.PTR.entry);
-			rr_entry_destroy(leave_e);
-		}
-	}
+	// notify server, unless it is paused
+	if (svr->running)
+		events_notify(svr->workers);
 
-	// main thread terminating. send out "goodbye packets" for services
-	mdns_init_reply(mdns_reply, 0);
+	mutex_unlock(svr->data_lock);
+}
 
-	mutex_lock(svr->data_lock);
-	svc_le = svr->services;
-	for (; svc_le; svc_le = svc_le->next) {
-		// set TTL to zero
-		svc_le->e->ttl = 0;
-		mdns_reply->num_ans_rr += rr_list_append(&mdns_reply->rr_ans, svc_le->e);
+void mdns_service_destroy(struct mdns_service *srv) {
+	assert(srv != NULL);
+	rr_list_destroy(srv->entries, 0);
+	free(srv);
+}
+
+struct mdns_browse *mdnsd_browse(struct mdnsd *svr, const char *type, mdns_browse_cb cb, void *arg) {
+	struct mdns_browse *b;
+	struct browse_query *q;
+	struct cache_entry *e = NULL;
+	uint8_t *nlabel;
+	uint64_t now;
+	bool query;
+	uint32_t hash;
+
+	assert(svr != NULL && type != NULL && cb != NULL);
+
+	nlabel = create_nlabel(type);
+	if (nlabel == NULL || *nlabel == 0) {
+		free(nlabel);
+		return NULL;
 	}
-	mutex_unlock(svr->data_lock);
 
-	// send out packet
-	if (mdns_reply->num_ans_rr > 0) {
-		size_t replylen = mdns_encode_pkt(mdns_reply, pkt_buffer, PACKET_SIZE);
-		send_packet(svr->sockfd, pkt_buffer, replylen);
+	b = malloc(sizeof(struct mdns_browse));
+	b->cb = cb;
+	b->arg = arg;
+
+	mutex_lock(svr->cache_lock);
+
+	// browses of the same type share its queries
+	q = browse_query_find(svr, nlabel);
+	query = q == NULL;
+	if (query) {
+		q = malloc(sizeof(struct browse_query));
+		memset(q, 0, sizeof(struct browse_query));
+		q->type = name_intern(nlabel);
+		q->next = svr->queries;
+		svr->queries = q;
+		caching_update(svr);
 	}
+	b->query = q;
+	b->next = q->browses;
+	q->browses = b;
 
-	// destroy packet
-	mdns_init_reply(mdns_reply, 0);
+	// what is cached already is known without asking
+	now = mdns_time_ms();
+	hash = cache_hash(q->type, RR_PTR);
+	while ((e = cache_find(&svr->cache, q->type, RR_PTR, hash, e)) != NULL)
+		if (e->expire_ms > now)
+			browse_report(svr, q, b, e->rr, false, now);
 
-	free(mdns_reply);
+	mutex_unlock(svr->cache_lock);
 
-	free(pkt_buffer);
+	free(nlabel);
 
-	close_pipe(svr->sockfd);
+	// worker 0 schedules the first query, unless the responder is paused
+	if (query) {
+		mutex_lock(svr->data_lock);
+		if (svr->running)
+			events_notify(svr->workers);
+		mutex_unlock(svr->data_lock);
+	}
 
-	svr->stop_flag = 2;
+	return b;
 }
 
-/////////////////////////////////////////////////////
+void mdnsd_browse_stop(struct mdnsd *svr, struct mdns_browse *browse) {
+	struct browse_query *q, **pq;
+	struct mdns_browse **pb;
 
+	assert(svr != NULL && browse != NULL);
 
-void mdnsd_set_hostname(struct mdnsd *svr, const char *hostname, struct in_addr addr) {
-	struct rr_entry *a_e = NULL,
-					*nsec_e = NULL;
+	mutex_lock(svr->cache_lock);
 
-	// currently can't be called twice
-	// dont ask me what happens if the IP changes
-	assert(svr->hostname == NULL);
+	q = browse->query;
+	for (pb = &q->browses; *pb != browse; pb = &(*pb)->next);
+	*pb = browse->next;
 
-	a_e = rr_create_a(create_nlabel(hostname), addr);
+	// nobody browses the type anymore, its records stay until they expire
+	if (q->browses == NULL) {
+		for (pq = &svr->queries; *pq != q; pq = &(*pq)->next);
+		*pq = q->next;
+		name_release(q->type);
+		free(q);
+	}
 
-	nsec_e = rr_create(create_nlabel(hostname), RR_NSEC);
-	nsec_e->ttl = DEFAULT_TTL_FOR_RECORD_WITH_HOSTNAME;
-	rr_set_nsec(nsec_e, RR_A);
+	mutex_unlock(svr->cache_lock);
 
-	
-	mutex_lock(svr->data_lock);
-	svr->hostname = create_nlabel(hostname);
-	rr_group_add(&svr->group, a_e);
-	rr_group_add(&svr->group, nsec_e);
-	mutex_unlock(svr->data_lock);
+	free(browse);
 }
 
-void mdnsd_set_hostname_v6(struct mdnsd *svr, const char *hostname, struct in6_addr *addr) {
-  struct rr_entry *aaaa_e = NULL, *nsec_e = NULL;
+void mdnsd_cache_responses(struct mdnsd *svr, int max_records) {
+	uint64_t now = mdns_time_ms();
 
-  // currently can't be called twice
-  // dont ask me what happens if the IP changes
-  assert(svr->hostname == NULL);
+	assert(svr != NULL);
 
-  aaaa_e = rr_create_aaaa(create_nlabel(hostname), addr); // 120 seconds automatically
+	mutex_lock(svr->cache_lock);
 
-  nsec_e = rr_create(create_nlabel(hostname), RR_NSEC);
-  nsec_e->ttl = DEFAULT_TTL_FOR_RECORD_WITH_HOSTNAME; // set to 120 seconds (default is 4500)
-  rr_set_nsec(nsec_e, RR_AAAA);
+	svr->passive = max_records > 0;
+	svr->cache.max = max_records > 0 ? max_records : CACHE_MAX;
+	while (svr->cache.count > svr->cache.max)
+		cache_evict(svr, now);
+	caching_update(svr);
 
-  mutex_lock(svr->data_lock);
-  svr->hostname = create_nlabel(hostname);
-  rr_group_add(&svr->group, aaaa_e);
-  rr_group_add(&svr->group, nsec_e);
-  mutex_unlock(svr->data_lock);
+	mutex_unlock(svr->cache_lock);
 }
 
-void mdnsd_add_rr(struct mdnsd *svr, struct rr_entry *rr) {
-	mutex_lock(svr->data_lock);
-	rr_group_add(&svr->group, rr);
-	mutex_unlock(svr->data_lock);
+int mdnsd_lookup(struct mdnsd *svr, const char *name, uint16_t type, mdns_lookup_cb cb, void *arg) {
+	static const enum rr_type types[] = { RR_A, RR_AAAA, RR_PTR, RR_SRV, RR_TXT };
+	uint64_t now = mdns_time_ms();
+	uint8_t *nlabel;
+	int i, found = 0;
+
+	assert(svr != NULL && name != NULL && cb != NULL);
+
+	nlabel = create_nlabel(name);
+	if (nlabel == NULL)
+		return 0;
+
+	mutex_lock(svr->cache_lock);
+
+	for (i = 0; i < sizeof(types) / sizeof(types[0]); i++) {
+		uint32_t hash = cache_hash(nlabel, types[i]);
+		struct cache_entry *e = NULL;
+
+		if (type != RR_ANY && type != types[i])
+			continue;
+
+		while ((e = cache_find(&svr->cache, nlabel, types[i], hash, e)) != NULL) {
+			struct mdns_lookup_result res;
+			struct rr_entry *rr = e->rr;
+			char *target = NULL;
+			const char **txts = NULL;
+
+			if (e->expire_ms <= now)
+				continue;
+
+			memset(&res, 0, sizeof(res));
+			res.name = name;
+			res.type = rr->type;
+			res.ttl = (uint32_t) ((e->expire_ms - now) / 1000);
+
+			switch (rr->type) {
+				case RR_A:
+					res.addr.s_addr = rr->data.A.addr;
+					break;
+				case RR_AAAA:
+					res.addr6 = rr->data.AAAA.addr;
+					break;
+				case RR_PTR:
+					res.target = target = nlabel_to_str(rr->data.PTR.name);
+					break;
+				case RR_SRV:
+					res.target = target = nlabel_to_str(rr->data.SRV.target);
+					res.port = rr->data.SRV.port;
+					break;
+				default:
+					res.txt = txts = txt_strings(rr);
+			}
+
+			cache_touch(&svr->cache, e);
+			cb(arg, &res);
+			found++;
+
+			free(target);
+			free(txts);
+		}
+	}
+
+	mutex_unlock(svr->cache_lock);
+
+	free(nlabel);
+	return found;
 }
 
-struct mdns_service *mdnsd_register_svc(struct mdnsd *svr, const char *instance_name,
-		const char *type, uint16_t port, const char *hostname, const char *txt[]) {
-	struct rr_entry *txt_e = NULL, 
-					*srv_e = NULL, 
-					*ptr_e = NULL,
-					*bptr_e = NULL;
-	uint8_t *target;
-	uint8_t *inst_nlabel, *type_nlabel, *nlabel;
-	struct mdns_service *service = malloc(sizeof(struct mdns_service));
-	memset(service, 0, sizeof(struct mdns_service));
+// MTU and index of the interface with the given address, MTU_DEFAULT and
+// 0 (let the system pick) if they can't be told (any address, or no way to
+// ask). The index is found even where the MTU can't be read
+static size_t interface_mtu(struct in_addr host, unsigned int *ifindex) {
+	size_t mtu = MTU_DEFAULT;
+#ifdef _WIN32
+	IP_ADAPTER_ADDRESSES *adapters = NULL, *a;
+	ULONG size = 15 * 1024, r = ERROR_BUFFER_OVERFLOW;
+	int tries;
+
+	*ifindex = 0;
+	if (host.s_addr == htonl(INADDR_ANY))
+		return mtu;
+
+	// the list may grow between the calls
+	for (tries = 0; r == ERROR_BUFFER_OVERFLOW && tries < 3; tries++) {
+		free(adapters);
+		adapters = malloc(size);
+		if (adapters == NULL)
+			return mtu;
+		r = GetAdaptersAddresses(AF_INET, GAA_FLAG_SKIP_ANYCAST | GAA_FLAG_SKIP_MULTICAST |
+				GAA_FLAG_SKIP_DNS_SERVER, NULL, adapters, &size);
+	}
 
-	// combine service name
-	type_nlabel = create_nlabel(type);
-	inst_nlabel = create_label(instance_name);
-	nlabel = join_nlabel(inst_nlabel, type_nlabel);
+	for (a = r == NO_ERROR ? adapters : NULL; a && *ifindex == 0; a = a->Next) {
+		IP_ADAPTER_UNICAST_ADDRESS *u;
 
-	// create TXT record
-	if (txt && *txt) {
-		txt_e = rr_create(dup_nlabel(nlabel), RR_TXT);
-		rr_list_append(&service->entries, txt_e);
+		for (u = a->FirstUnicastAddress; u; u = u->Next) {
+			if (((struct sockaddr_in *) u->Address.lpSockaddr)->sin_addr.s_addr != host.s_addr)
+				continue;
 
-		// add TXTs
-		for (; *txt; txt++) 
-			rr_add_txt(txt_e, *txt);
+			if (a->Mtu >= MTU_MIN)
+				mtu = a->Mtu < MTU_MAX ? a->Mtu : MTU_MAX;
+			*ifindex = a->IfIndex;
+			break;
+		}
 	}
 
-	// create SRV record
-	assert(hostname || svr->hostname);	// either one as target
-	target = hostname ? 
-				create_nlabel(hostname) : 
-				dup_nlabel(svr->hostname);
+	free(adapters);
+#else
+	struct ifaddrs *ifa, *i;
 
-	srv_e = rr_create_srv(dup_nlabel(nlabel), port, target);
-	rr_list_append(&service->entries, srv_e);
+	*ifindex = 0;
+	if (host.s_addr == htonl(INADDR_ANY) || getifaddrs(&ifa) != 0)
+		return mtu;
 
-	// create PTR record for type
-	ptr_e = rr_create_ptr(type_nlabel, srv_e);
+	for (i = ifa; i; i = i->ifa_next) {
+		if (i->ifa_addr == NULL || i->ifa_addr->sa_family != AF_INET ||
+				((struct sockaddr_in *) i->ifa_addr)->sin_addr.s_addr != host.s_addr)
+			continue;
 
-	// create services PTR record for type
-	// this enables the type to show up as a "service"
-	bptr_e = rr_create_ptr(dup_nlabel(SERVICES_DNS_SD_NLABEL), ptr_e);
+#ifdef SIOCGIFMTU
+		{
+			struct ifreq ifr;
+			int fd = socket(AF_INET, SOCK_DGRAM, 0);
+
+			memset(&ifr, 0, sizeof(ifr));
+			strncpy(ifr.ifr_name, i->ifa_name, IFNAMSIZ - 1);
+			if (fd >= 0) {
+				if (ioctl(fd, SIOCGIFMTU, &ifr) == 0 && ifr.ifr_mtu >= MTU_MIN)
+					mtu = ifr.ifr_mtu < MTU_MAX ? ifr.ifr_mtu : MTU_MAX;
+				close(fd);
+			}
+		}
+#endif
+		*ifindex = if_nametoindex(i->ifa_name);
+		break;
+	}
 
-	// modify lists here
-	mutex_lock(svr->data_lock);
+	freeifaddrs(ifa);
+#endif
+	return mtu;
+}
 
-	if (txt_e)
-		rr_group_add(&svr->group, txt_e);
-	rr_group_add(&svr->group, srv_e);
-	rr_group_add(&svr->group, ptr_e);
-	rr_group_add(&svr->group, bptr_e);
+// sizes the packets for the smallest MTU and the headers of the families
+// the workers answer on
+static void packet_max_update(struct mdnsd *svr) {
+	size_t overhead = svr->workers[0].sockfd6 >= 0 ? UDP6_OVERHEAD : UDP_OVERHEAD;
+	svr->pkt_max = svr->mtu - overhead;
+}
 
-	// append PTR entry to announce list
-	rr_list_append(&svr->announce, ptr_e);
-	rr_list_append(&svr->services, ptr_e);
+// creates the sockets of a worker and what it needs to wait on them, those
+// of the group_members() join the group on every interface of the
+// responder. The IPv4 one is required, without IPv6 the worker runs on
+// IPv4 only
+static bool worker_init(struct mdnsd_worker *w) {
+	struct mdnsd *svr = w->svr;
+	bool member = w->id < group_members(svr);
+	bool joined = true;
+	int i;
 
-	mutex_unlock(svr->data_lock);
+	if (events_init(w) != 0) {
+		log_message(LOG_ERR, "pipe(): %m\n");
+		return false;
+	}
 
-	// don't free type_nlabel - it's with the PTR record
-	free(nlabel);
-	free(inst_nlabel);
+	w->sockfd = create_recv_sock(svr->ifaces[0].addr.s_addr, member);
+#ifdef USE_IPV6
+	w->sockfd6 = w->sockfd >= 0 ? create_recv_sock6(svr->ifaces[0].ifindex, member) : -1;
+#else
+	w->sockfd6 = -1;
+#endif
+	for (i = 1; w->sockfd >= 0 && member && joined && i < svr->num_ifaces; i++)
+		joined = join_group(w->sockfd, w->sockfd6, svr->ifaces[i].addr, svr->ifaces[i].ifindex, true);
+
+	if (w->sockfd < 0 || !joined || events_add_socket(w) != 0) {
+		log_message(LOG_ERR, "unable to create recv socket\n");
+		if (w->sockfd >= 0)
+			worker_close_socks(w);
+		events_close(w);
+		return false;
+	}
 
-	// notify server
-	write_pipe(svr->notify_pipe[1], ".", 1);
+	w->aggr_timer.cb = aggregate_flush;
+	w->aggr_timer.arg = w;
+	w->announce_timer.cb = announce_tick;
+	w->announce_timer.arg = w;
+	w->query_timer.cb = browse_tick;
+	w->query_timer.arg = w;
+	for (i = 0; i < TC_MAX; i++) {
+		w->tc[i].w = w;
+		w->tc[i].timer.cb = tc_expire;
+		w->tc[i].timer.arg = w->tc + i;
+	}
+	w->rand_state = (uint32_t) mdns_time_ms() * 2654435761u + w->id + 1;
+	if (w->rand_state == 0)
+		w->rand_state = 1;
+#ifdef HANDOFF
+	// what a stopped worker left is stale
+	w->handoff_head = w->handoff_tail = 0;
+#endif
 
-	return service;
+	return true;
 }
 
-void mdns_service_remove(struct mdnsd *svr, struct mdns_service *svc) {
-	struct rr_list *rr;
+static bool worker_start(struct mdnsd_worker *w) {
+#ifdef USE_WIN32_THREAD
+	w->thread = CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) main_loop, (void*) w, 0, NULL);
+	return w->thread != NULL;
+#else
+	return pthread_create(&w->thread, NULL, (void *(*)(void *)) main_loop, (void *) w) == 0;
+#endif
+}
 
-	assert(svr != NULL && svc != NULL);
+// stops the given number of started workers and waits for them, they
+// close their own socket
+static void workers_stop(struct mdnsd *s, int count) {
+	int i;
 
-	// modify lists here
-	mutex_lock(svr->data_lock);
+	store_release(&s->stop_flag, 1);
+	for (i = 0; i < count; i++)
+		events_notify(s->workers + i);
 
-	for (rr = svc->entries; rr; rr = rr->next) {
-		struct rr_group *g;
-		struct rr_entry *ptr_e;
+	for (i = 0; i < count; i++) {
+#ifdef USE_WIN32_THREAD
+		WaitForSingleObject(s->workers[i].thread, INFINITE);
+		CloseHandle(s->workers[i].thread);
+#else
+		pthread_join(s->workers[i].thread, NULL);
+#endif
+		events_close(s->workers + i);
+	}
+}
 
-		// remove entry from groups and destroy entries that are not PTR
-		if ((g = rr_group_find(svr->group, rr->e->name)) != NULL) {
-			rr_list_remove(&g->rr, rr->e);
-		}
+// creates the sockets of the workers and starts them, all or none
+static bool workers_start(struct mdnsd *svr) {
+	int i, started;
 
-		// remove PTR and BPTR related to this SVC
-		if ((ptr_e = rr_entry_remove(svr->group, rr->e, RR_PTR)) != NULL) {
-			struct rr_entry *bptr_e;
+	store_relaxed(&svr->stop_flag, 0);
 
-			// remove PTR from announce and services
-			rr_list_remove(&svr->announce, ptr_e);
-			rr_list_remove(&svr->services, ptr_e);
+	for (i = 0; i < svr->num_workers; i++) {
+		struct mdnsd_worker *w = svr->workers + i;
 
-			// find BPTR and remove it from groups
-			bptr_e = rr_entry_remove(svr->group, ptr_e, RR_PTR);
-			rr_entry_destroy(bptr_e);
+		// main_loop() leaves the rest as it found it
+		w->svr = svr;
+		w->id = i;
+		if (!worker_init(w))
+			break;
+	}
 
-			// add PTR to list of announces for leaving
-			rr_list_append(&svr->leave, ptr_e);
-		} else {
-			// destroy entries not needed for sending "leave" packet
-			rr_entry_destroy(rr->e);
+	if (i < svr->num_workers) {
+		while (i--) {
+			worker_close_socks(svr->workers + i);
+			events_close(svr->workers + i);
 		}
+		return false;
+	}
+
+	// before the workers send anything
+	mutex_lock(svr->data_lock);
+	packet_max_update(svr);
+	mutex_unlock(svr->data_lock);
+
+	for (started = 0; started < svr->num_workers; started++) {
+		if (!worker_start(svr->workers + started))
+			break;
 	}
 
-	// remove all empty groups
-	rr_group_clean(&svr->group);
+	if (started < svr->num_workers) {
+		workers_stop(svr, started);
+		for (i = started; i < svr->num_workers; i++) {
+			worker_close_socks(svr->workers + i);
+			events_close(svr->workers + i);
+		}
+		return false;
+	}
 
-	// destroy this service entries
-	rr_list_destroy(svc->entries, 0);
-	free(svc);
+	mutex_lock(svr->data_lock);
+	svr->running = true;
+	mutex_unlock(svr->data_lock);
+
+	return true;
+}
 
+// stops the workers if they run, worker 0 says goodbye for the services
+static void workers_halt(struct mdnsd *svr) {
+	bool running;
+
+	// the API does not wake up workers which are going away
+	mutex_lock(svr->data_lock);
+	running = svr->running;
+	svr->running = false;
 	mutex_unlock(svr->data_lock);
+
+	if (running)
+		workers_stop(svr, svr->num_workers);
 }
 
-void mdns_service_destroy(struct mdns_service *srv) {
-	assert(srv != NULL);
-	rr_list_destroy(srv->entries, 0);
-	free(srv);
+static void workers_create(struct mdnsd *svr, int count) {
+	svr->workers = calloc(count, sizeof(struct mdnsd_worker));
+	svr->num_workers = count;
+#ifdef HANDOFF
+	int i;
+	for (i = group_members(svr); i < count; i++)
+		svr->workers[i].handoffs = malloc(HANDOFF_SLOTS * sizeof(struct handoff));
+#endif
 }
 
-struct mdnsd *mdnsd_start(struct in_addr host, bool verbose) {
-#ifndef USE_WIN32_THREAD
-	pthread_t tid;
-	pthread_attr_t attr;
+static void workers_free(struct mdnsd *svr) {
+#ifdef HANDOFF
+	int i;
+	for (i = group_members(svr); i < svr->num_workers; i++)
+		free(svr->workers[i].handoffs);
 #endif
+	free(svr->workers);
+}
 
+struct mdnsd *mdnsd_start(struct in_addr host, bool verbose) {
+	return mdnsd_start_workers(host, 1, verbose);
+}
+
+struct mdnsd *mdnsd_start_workers(struct in_addr host, int workers, bool verbose) {
 	log_verbose = verbose;
 
+	if (workers < 1)
+		workers = 1;
+	else if (workers > MAX_WORKERS)
+		workers = MAX_WORKERS;
+
 	struct mdnsd *server = malloc(sizeof(struct mdnsd));
 	memset(server, 0, sizeof(struct mdnsd));
 
-	if (create_pipe(server->notify_pipe) != 0) {
-		log_message(LOG_ERR, "pipe(): %m\n");
-		free(server);
-		return NULL;
-	}
-
-	server->sockfd = create_recv_sock(host.s_addr);
-	if (server->sockfd < 0) {
-		log_message(LOG_ERR, "unable to create recv socket\n");
-		free(server);
-		return NULL;
-	}
+	workers_create(server, workers);
+	server->store = calloc(1, sizeof(struct rr_groups));
+	server->cache.max = CACHE_MAX;
+	server->epoch = 1;
+	server->ifaces[0].addr = host;
+	server->num_ifaces = 1;
+	server->mtu = interface_mtu(host, &server->ifaces[0].ifindex);
+	mdns_wheel_init(&server->wheel, mdns_time_ms());
 
 #ifdef USE_WIN32_THREAD
 	server->data_lock = CreateMutex(NULL, FALSE, NULL);
+	server->cache_lock = CreateMutex(NULL, FALSE, NULL);
 #else
 	pthread_mutex_init(&server->data_lock, NULL);
+	pthread_mutex_init(&server->cache_lock, NULL);
 #endif
 
+	if (!workers_start(server)) {
 #ifdef USE_WIN32_THREAD
-	if (CreateThread(NULL, 0, (LPTHREAD_START_ROUTINE) main_loop, (void*) server, 0, NULL) == NULL) {
 		CloseHandle(server->data_lock);
+		CloseHandle(server->cache_lock);
 #else
-	// init thread
-	pthread_attr_init(&attr);
-	pthread_attr_setdetachstate(&attr, PTHREAD_CREATE_DETACHED);
-
-	if (pthread_create(&tid, &attr, (void *(*)(void *)) main_loop, (void *) server) != 0) {
 		pthread_mutex_destroy(&server->data_lock);
+		pthread_mutex_destroy(&server->cache_lock);
 #endif
+		workers_free(server);
+		free(server->store);
 		free(server);
 		return NULL;
 	}
@@ -828,41 +3771,170 @@ struct mdnsd *mdnsd_start(struct in_addr host, bool verbose) {
 	return server;
 }
 
-void mdnsd_stop(struct mdnsd *s) {
-	struct timeval tv;
+bool mdnsd_add_interface(struct mdnsd *svr, struct in_addr addr) {
+	struct mdnsd_iface *ifc;
+	size_t mtu = MTU_DEFAULT;
+	int i, joined = 0;
+	bool ok = true;
 
-	if (!s) return;
+	assert(svr != NULL);
 
-	tv.tv_sec = 0;
-	tv.tv_usec = 500*1000;
+	mutex_lock(svr->data_lock);
 
-	assert(s != NULL);
+	// the slot is not seen by the workers until num_ifaces covers it
+	ifc = svr->ifaces + svr->num_ifaces;
+	if (svr->num_ifaces < IFACE_MAX) {
+		ifc->addr = addr;
+		mtu = interface_mtu(addr, &ifc->ifindex);
 
-	s->stop_flag = 1;
-	write_pipe(s->notify_pipe[1], ".", 1);
+		// the interface has to be told apart from the others
+		for (i = 0; i < svr->num_ifaces; i++)
+			if (svr->ifaces[i].ifindex == ifc->ifindex)
+				ok = false;
+	}
+	if (svr->num_ifaces == IFACE_MAX || !ok || ifc->ifindex == 0) {
+		log_message(LOG_ERR, "can't answer on %s\n", inet_ntoa(addr));
+		mutex_unlock(svr->data_lock);
+		return false;
+	}
 
-	while (s->stop_flag != 2)
-#ifdef WIN32
-		Sleep(tv.tv_usec / 1000);
-#else
-		select(0, NULL, NULL, NULL, &tv);
-#endif
+	// the workers of a paused responder join it when it resumes
+	for (; svr->running && joined < svr->num_workers; joined++) {
+		struct mdnsd_worker *w = svr->workers + joined;
+		if (!join_group(w->sockfd, w->sockfd6, addr, ifc->ifindex, true))
+			break;
+	}
+
+	if (svr->running && joined < svr->num_workers) {
+		while (joined--) {
+			struct mdnsd_worker *w = svr->workers + joined;
+			join_group(w->sockfd, w->sockfd6, addr, ifc->ifindex, false);
+		}
+		mutex_unlock(svr->data_lock);
+		return false;
+	}
+
+	// packets are sized for the smallest MTU, a paused responder sizes
+	// them when it resumes
+	if (mtu < svr->mtu)
+		svr->mtu = mtu;
+	if (svr->running)
+		packet_max_update(svr);
+	store_release(&svr->num_ifaces, svr->num_ifaces + 1);
+
+	// the services are announced on the new link too
+	announce_again(svr);
+
+	mutex_unlock(svr->data_lock);
+	return true;
+}
+
+void mdnsd_pause(struct mdnsd *svr) {
+	struct announce *a;
+
+	assert(svr != NULL);
+
+	workers_halt(svr);
+
+	// workers are gone, what they may have been reading can be freed, and
+	// the goodbyes have been sent
+	mutex_lock(svr->data_lock);
+	reclaim(svr);
+	for (a = svr->services; a; a = a->next) {
+		mdns_wheel_cancel(&svr->wheel, &a->node);
+		a->sent = 0;
+	}
+	while (svr->leaving) {
+		a = svr->leaving;
+		svr->leaving = a->next;
+		mdns_wheel_cancel(&svr->wheel, &a->node);
+		rr_entry_destroy(a->ptr->data.PTR.entry);
+		rr_entry_destroy(a->ptr);
+		free(a);
+	}
+	mutex_unlock(svr->data_lock);
+}
+
+bool mdnsd_resume(struct mdnsd *svr) {
+	struct announce *a;
+	uint64_t now;
+
+	assert(svr != NULL);
+
+	// services are announced again from the start
+	mutex_lock(svr->data_lock);
+	if (svr->running) {
+		mutex_unlock(svr->data_lock);
+		return true;
+	}
+	now = mdns_time_ms();
+	for (a = svr->services; a; a = a->next) {
+		mdns_wheel_cancel(&svr->wheel, &a->node);
+		a->sent = 0;
+		mdns_wheel_insert(&svr->wheel, &a->node, now, now);
+	}
+	mutex_unlock(svr->data_lock);
+
+	if (!workers_start(svr))
+		return false;
+
+	events_notify(svr->workers);
+	return true;
+}
+
+void mdnsd_stop(struct mdnsd *s) {
+	if (!s) return;
+
+	assert(s != NULL);
 
-	close_pipe(s->notify_pipe[0]);
-	close_pipe(s->notify_pipe[1]);
+	workers_halt(s);
+	workers_free(s);
 
 #ifdef USE_WIN32_THREAD
 	CloseHandle(s->data_lock);
+	CloseHandle(s->cache_lock);
 #else
 	pthread_mutex_destroy(&s->data_lock);
+	pthread_mutex_destroy(&s->cache_lock);
 #endif
-	rr_group_destroy(s->group);
-	rr_list_destroy(s->announce, 0);
-	rr_list_destroy(s->services, 0);
-	rr_list_destroy(s->leave, 0);
+	// workers are gone, everything can be freed
+	while (s->retired) {
+		struct retired *next = s->retired->next;
+		retired_free(s->retired);
+		s->retired = next;
+	}
+	rr_group_destroy(s->store);
+	free(s->store);
+	while (s->services) {
+		struct announce *a = s->services;
+		s->services = a->next;
+		free(a);
+	}
+	// goodbyes not sent yet still hold their PTR and SRV
+	while (s->leaving) {
+		struct announce *a = s->leaving;
+		s->leaving = a->next;
+		rr_entry_destroy(a->ptr->data.PTR.entry);
+		rr_entry_destroy(a->ptr);
+		free(a);
+	}
 
 	if (s->hostname)
-		free(s->hostname);
+		name_release(s->hostname);
+
+	// browses that were not stopped go with their queries
+	while (s->queries) {
+		struct browse_query *q = s->queries;
+		s->queries = q->next;
+		while (q->browses) {
+			struct mdns_browse *b = q->browses;
+			q->browses = b->next;
+			free(b);
+		}
+		name_release(q->type);
+		free(q);
+	}
+	cache_free(&s->cache);
 
 	free(s);
 }
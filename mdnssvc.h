@@ -43,28 +43,145 @@ extern "C" {
 
 struct mdnsd;
 struct mdns_service;
+struct mdns_browse;
+
+// responder counters, the average batch size is packets / batches
+struct mdnsd_stats {
+	uint64_t rx_packets;	// datagrams received
+	uint64_t rx_batches;	// wakeups that received at least one datagram
+	uint64_t tx_packets;	// replies sent
+	uint64_t tx_batches;	// system calls used to send them
+	uint64_t tx_unicast;	// replies sent straight to the querier (QU questions)
+	uint64_t tx_multicast;	// replies sent to the group
+	uint64_t filter_hits;	// question names that may be ours, looked up
+	uint64_t filter_misses;	// question names dropped by the owned name filter
+};
+
+// a service to register, see mdnsd_register_svc() for the fields
+struct mdns_service_desc {
+	const char *instance_name;
+	const char *type;
+	uint16_t port;
+	const char *hostname;	// NULL for the responder hostname
+	const char **txt;		// NULL terminated, or NULL
+	unsigned int ifindex;	// interface to publish it on, 0 for all
+};
+
+// an instance found by mdnsd_browse(), names are in dotted form
+struct mdns_browse_result {
+	const char *instance;	// full name of the instance
+	const char *type;		// the browsed type
+	const char *hostname;	// target of its SRV, NULL until known
+	uint16_t port;
+	struct in_addr addr;	// of hostname, INADDR_ANY until known
+	const struct in6_addr *addr6;	// of hostname, NULL until known
+	const char **txt;		// NULL terminated, NULL until known
+	bool removed;			// it said goodbye or expired
+};
+
+// called when an instance is found, again when more of it is known, and a
+// last time once it is removed. It runs on a responder thread which holds
+// the cache, the browse functions must not be called from it. The result
+// is only valid during the call
+typedef void (*mdns_browse_cb)(void *arg, const struct mdns_browse_result *result);
+
+// a cached record found by mdnsd_lookup(), names are in dotted form
+struct mdns_lookup_result {
+	const char *name;		// as looked up
+	uint16_t type;			// 1 (A), 12 (PTR), 16 (TXT), 28 (AAAA) or 33 (SRV)
+	uint32_t ttl;			// seconds left
+	struct in_addr addr;	// A
+	const struct in6_addr *addr6;	// AAAA
+	const char *target;		// PTR and SRV
+	uint16_t port;			// SRV
+	const char **txt;		// TXT, NULL terminated
+};
+
+// called for each record found, with the same restrictions as a browse
+// callback
+typedef void (*mdns_lookup_cb)(void *arg, const struct mdns_lookup_result *result);
 
 
 // starts a MDNS responder instance
 // returns NULL if unsuccessful
 struct mdnsd *mdnsd_start(struct in_addr host, bool verbose);
 
+// starts a MDNS responder instance answering on several threads, each one
+// with its own socket. workers is clamped to what the platform supports
+// returns NULL if unsuccessful
+struct mdnsd *mdnsd_start_workers(struct in_addr host, int workers, bool verbose);
+
+// answers on the interface with the given address too, queries are
+// answered on the interface they came from with the records published
+// there. Add interfaces before setting the hostname so that the A record
+// of each address is only published on its interface. Not to be called
+// while mdnsd_resume() runs. Packets are sized for the smallest MTU of the
+// interfaces, 1500 where it can't be read
+// returns false if the address is not of another interface, or on error
+bool mdnsd_add_interface(struct mdnsd *svr, struct in_addr addr);
+
 // stops the given MDNS responder instance
 void mdnsd_stop(struct mdnsd *s);
 
-// sets the hostname for the given MDNS responder instance
-void mdnsd_set_hostname(struct mdnsd *svr, const char *hostname, struct in_addr addr);
+// stops answering and says goodbye for every service, the records are kept
+// and services can still be registered and removed
+void mdnsd_pause(struct mdnsd *svr);
+
+// starts answering again after mdnsd_pause(), services are announced anew
+// returns false if the sockets could not be created, it can be retried
+bool mdnsd_resume(struct mdnsd *svr);
+
+// sets the hostname for the given MDNS responder instance, it can be called
+// again with the same name to add addresses
+// returns false if the host already has another name
+bool mdnsd_set_hostname(struct mdnsd *svr, const char *hostname, struct in_addr addr);
+
+// adds an IPv6 address to the hostname, it can be called with the same
+// name as mdnsd_set_hostname() to publish both A and AAAA
+// returns false if the host already has another name
+bool mdnsd_set_hostname_v6(struct mdnsd *svr, const char *hostname, struct in6_addr *addr);
 
 // registers a service with the MDNS responder instance
 struct mdns_service *mdnsd_register_svc(struct mdnsd *svr, const char *instance_name, 
 		const char *type, uint16_t port, const char *hostname, const char *txt[]);
 
+// registers count services at once, they are published together and
+// announced as one set. svcs receives the handle of each one
+void mdnsd_register_svcs(struct mdnsd *svr, const struct mdns_service_desc *descs,
+		int count, struct mdns_service **svcs);
+
 // destroys the mdns_service struct returned by mdnsd_register_svc()
 void mdns_service_destroy(struct mdns_service *srv);
 
 // remove AND destroys the mdns_service struct returned by mdnsd_register_svc()
 void mdns_service_remove(struct mdnsd *svr, struct mdns_service *svc);
 
+// removes AND destroys count services at once, their goodbyes go out together
+void mdns_services_remove(struct mdnsd *svr, struct mdns_service **svcs, int count);
+
+// looks for the instances of a service type such as "_http._tcp.local".
+// Those already cached are reported before it returns, the type is queried
+// for as long as it is browsed, at growing intervals (RFC 6762 section 5.2)
+// returns NULL if the type is not valid
+struct mdns_browse *mdnsd_browse(struct mdnsd *svr, const char *type, mdns_browse_cb cb, void *arg);
+
+// stops and destroys a browse, cb is not called anymore once it returns.
+// Browses left are destroyed by mdnsd_stop()
+void mdnsd_browse_stop(struct mdnsd *svr, struct mdns_browse *browse);
+
+// caches the records of every response received, not only those of the
+// browsed types, keeping the max_records most recently used ones. 0 stops
+// it, the browses still cache what they need
+void mdnsd_cache_responses(struct mdnsd *svr, int max_records);
+
+// reports the records cached for a name such as "host.local", of the
+// given type or of any type if it is 255, without sending anything
+// returns the number of records reported
+int mdnsd_lookup(struct mdnsd *svr, const char *name, uint16_t type, mdns_lookup_cb cb, void *arg);
+
+// copies the counters of the given MDNS responder instance
+void mdnsd_get_stats(struct mdnsd *svr, struct mdnsd_stats *stats);
+
 #ifdef __cplusplus
 }
 #endif